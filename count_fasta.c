@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "count_fasta.h"
+
+/* What each counting thread gets */
+typedef struct count_worker {
+  FastaSrcP src;
+  KSP kmers;
+  int tid;
+} CountWorker;
+
+/* add_kmers_from_seq
+   Counts every good canonical kmer of the len characters at seq
+   (a Chr's sequence, or a FastaView's, line ends and all) in kmers
+*/
+void add_kmers_from_seq( const char* seq, size_t len, KSP kmers ) {
+  pkmer block[LOOKUP_BATCH];
+  size_t n;
+  KIter it;
+
+  init_kmer_iter( &it, seq, len, kmers->k );
+  while( (n = next_canonical_kmers( &it, block, LOOKUP_BATCH )) > 0 ) {
+    increment_or_insert_pkmers( block, n, kmers );
+  }
+}
+
+/* add_kmers_from_seq_mt
+   Same, but safe to run alongside other threads doing the same
+   with their own tid
+*/
+void add_kmers_from_seq_mt( const char* seq, size_t len,
+			    KSP kmers, int tid ) {
+  pkmer block[LOOKUP_BATCH];
+  size_t n;
+  KIter it;
+
+  init_kmer_iter( &it, seq, len, kmers->k );
+  while( (n = next_canonical_kmers( &it, block, LOOKUP_BATCH )) > 0 ) {
+    increment_or_insert_pkmers_mt( block, n, kmers, tid );
+  }
+}
+
+/* scatter_kmers_from_seq
+   Puts every good canonical kmer of seq in the scatter buffer sc
+*/
+void scatter_kmers_from_seq( const char* seq, size_t len, KScatterP sc ) {
+  size_t pos;
+  pkmer pk;
+  KIter it;
+
+  init_kmer_iter( &it, seq, len, sc->ks->k );
+  while( next_canonical_kmer( &it, &pk, &pos ) ) {
+    kscatter_add( sc, pk );
+  }
+}
+
+/* open_fasta_src
+   Args: FastaSrcP src - where to keep the open file
+         const char* fn - fasta file, gzipped or not
+         int map - if true and fn isn't gzipped, map it, so that
+                   next_fasta_bases hands out its sequences where
+                   they are. Such a src can't do next_fasta_seq.
+   Returns: 0 if fn was opened, -1 if it can't be
+*/
+int open_fasta_src( FastaSrcP src, const char* fn, int map ) {
+  src->gzipped = is_gz( fn );
+  src->mapped = map && !src->gzipped;
+  src->total_read = 0;
+  /* Get a handle on the input file to pass to parser */
+  if ( src->gzipped ) {
+    fprintf( stderr, "Opening gzipped file: %s\n", fn );
+    src->fp_gz = gzopen( fn, "r" );
+    if ( src->fp_gz == NULL ) {
+      return -1;
+    }
+  }
+  else if ( src->mapped ) {
+    fprintf( stderr, "Mapping file: %s\n", fn );
+    if ( open_fasta_map( &src->map, fn ) != 0 ) {
+      fprintf( stderr, "%s\n", fn );
+      perror( "Cannot map file" );
+      return -1;
+    }
+  }
+  else {
+    fprintf( stderr, "Opening file: %s\n", fn );
+    src->fp = fileOpen( fn, "r" );
+    if ( src->fp == NULL ) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void close_fasta_src( FastaSrcP src ) {
+  if ( src->gzipped ) {
+    gzclose( src->fp_gz );
+  }
+  else if ( src->mapped ) {
+    close_fasta_map( &src->map );
+  }
+  else {
+    fclose( src->fp );
+  }
+}
+
+/* Counts a sequence read from src, keeping the progress dots going */
+static void note_fasta_read( FastaSrcP src ) {
+  src->total_read++;
+  if ( src->total_read%10 == 0 ) {
+    fprintf( stderr, "." );
+  }
+}
+
+/* next_fasta_seq
+   Gets the next sequence from src into seq, keeping the progress
+   dots going. Returns: 0 if there was one, non-zero when done */
+int next_fasta_seq( FastaSrcP src, ChrP seq ) {
+  int read_status;
+  if ( src->gzipped ) {
+    read_status = gz_read_next_fasta( src->fp_gz, seq );
+  }
+  else {
+    read_status = read_next_fasta( src->fp, seq );
+  }
+  if ( read_status == 0 ) {
+    note_fasta_read( src );
+  }
+  return read_status;
+}
+
+/* next_fasta_bases
+   Args: FastaSrcP src - source to read from
+         ChrP seq - where to read the sequence to, if src isn't
+                    mapped (can be NULL if it is)
+         const char** bases - gets where the sequence is
+         size_t* len - gets its length in characters
+   Returns: 0 if there was one, non-zero when done. A mapped src's
+            sequence is left in the file with its line ends, for
+            the kmer iterator to step over
+*/
+int next_fasta_bases( FastaSrcP src, ChrP seq,
+		      const char** bases, size_t* len ) {
+  FastaView fv;
+  if ( !src->mapped ) {
+    if ( next_fasta_seq( src, seq ) != 0 ) {
+      return -1;
+    }
+    *bases = seq->seq;
+    *len   = seq->len;
+    return 0;
+  }
+  if ( next_fasta_view( &src->map, &fv ) != 0 ) {
+    return -1;
+  }
+  note_fasta_read( src );
+  *bases = fv.seq;
+  *len   = fv.seq_len;
+  return 0;
+}
+
+/* Thread body: take turns reading, count outside the lock */
+static void* count_worker( void* arg ) {
+  CountWorker* w = (CountWorker*)arg;
+  ChrP seq;
+  const char* bases;
+  size_t len;
+  int read_status = 0;
+
+  seq = w->src->mapped ? NULL : newSeq();
+  while( read_status == 0 ) {
+    pthread_mutex_lock( &w->src->lock );
+    read_status = next_fasta_bases( w->src, seq, &bases, &len );
+    pthread_mutex_unlock( &w->src->lock );
+    if ( read_status == 0 ) {
+      add_kmers_from_seq_mt( bases, len, w->kmers, w->tid );
+    }
+  }
+  free( seq );
+  return NULL;
+}
+
+/* count_fasta_kmers
+   Args: const char* fn - fasta file, gzipped or not
+         KSP kmers - where the canonical kmers get counted
+         int threads - number of counting threads; no more than
+                       the KSP was made for (KSPOpts threads)
+         int mode - COUNT_SHARED: threads read sequences and add
+                    their kmers anywhere in the KSP.
+                    COUNT_PARTITIONED: the file is read here and
+                    the kmers are scattered by prefix; each thread
+                    builds only its own part, with no atomics
+   Returns: number of sequences read, -1 if fn can't be opened
+*/
+int count_fasta_kmers( const char* fn, KSP kmers, int threads, int mode ) {
+  FastaSrc src;
+  KScatterP sc;
+  CountWorker* workers;
+  pthread_t* tids;
+  ChrP seq = NULL;
+  const char* bases;
+  size_t len;
+  int i;
+
+  if ( open_fasta_src( &src, fn, 1 ) != 0 ) {
+    return -1;
+  }
+
+  if ( threads > kmers->n_threads ) {
+    threads = kmers->n_threads;
+  }
+  fprintf( stderr, "[Reading fasta sequences:" );
+  if ( threads <= 1 ) {
+    if ( !src.mapped ) {
+      seq = newSeq();
+    }
+    while( next_fasta_bases( &src, seq, &bases, &len ) == 0 ) {
+      /* Got a good sequence at bases. Find the kmers */
+      add_kmers_from_seq( bases, len, kmers );
+    }
+    /* Like Elsa says, "Let it go!" */
+    free( seq );
+  }
+  else if ( mode == COUNT_PARTITIONED ) {
+    sc = init_kscatter( kmers, threads, SCATTER_CAP );
+    if ( !src.mapped ) {
+      seq = newSeq();
+    }
+    while( next_fasta_bases( &src, seq, &bases, &len ) == 0 ) {
+      scatter_kmers_from_seq( bases, len, sc );
+    }
+    kscatter_flush( sc );
+    free_kscatter( sc );
+    free( seq );
+  }
+  else {
+    pthread_mutex_init( &src.lock, NULL );
+    workers = (CountWorker*)malloc(sizeof(CountWorker) * threads);
+    tids = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+    for( i = 0; i < threads; i++ ) {
+      workers[i].src   = &src;
+      workers[i].kmers = kmers;
+      workers[i].tid   = i;
+      pthread_create( &tids[i], NULL, count_worker, &workers[i] );
+    }
+    for( i = 0; i < threads; i++ ) {
+      pthread_join( tids[i], NULL );
+    }
+    pthread_mutex_destroy( &src.lock );
+    free( workers );
+    free( tids );
+  }
+  fprintf( stderr, "]\n" );
+
+  close_fasta_src( &src );
+  return src.total_read;
+}
+
+/* sketch_fasta_hist
+   Args: const char* fn - fasta file the sketch was made from
+         KSP kmers - a KSP_SKETCH with all of fn counted in it
+         size_t* hist - hist[i] gets about the number of kmers seen
+                        i times
+         size_t hist_len - length of hist
+   Returns: number of sequences read, -1 if fn can't be opened
+   A sketch can't list its kmers, so this goes over fn again. Every
+   kmer with an estimated count of c turns up c times, so the number
+   of positions with an estimate of c, divided by c, is about how
+   many kmers were seen c times.
+*/
+int sketch_fasta_hist( const char* fn, KSP kmers,
+		       size_t* hist, size_t hist_len ) {
+  FastaSrc src;
+  ChrP seq = NULL;
+  KIter it;
+  pkmer pk;
+  const char* bases;
+  size_t pos, est, c, len;
+
+  if ( open_fasta_src( &src, fn, 1 ) != 0 ) {
+    return -1;
+  }
+  memset( hist, 0, sizeof(size_t) * hist_len );
+  fprintf( stderr, "[Reading fasta sequences for histogram:" );
+  if ( !src.mapped ) {
+    seq = newSeq();
+  }
+  while( next_fasta_bases( &src, seq, &bases, &len ) == 0 ) {
+    init_kmer_iter( &it, bases, len, kmers->k );
+    while( next_canonical_kmer( &it, &pk, &pos ) ) {
+      est = get_pkmer_count( pk, kmers );
+      if ( est < hist_len ) {
+	hist[est]++;
+      }
+    }
+  }
+  free( seq );
+  fprintf( stderr, "]\n" );
+  close_fasta_src( &src );
+
+  for( c = 1; c < hist_len; c++ ) {
+    hist[c] = (hist[c] + c/2) / c;
+  }
+  return src.total_read;
+}
@@ -0,0 +1,36 @@
+#ifndef COUNT_FASTA_H
+#define COUNT_FASTA_H
+#include "kmer.h"
+#include "file_io.h"
+
+/* Counting the kmers of a whole fasta file into a KSP, shared by
+   the tools. One open file is read a sequence at a time by however
+   many counting threads there are. */
+typedef struct fasta_source {
+  int gzipped;
+  int mapped;           // plain file read with map, no copying
+  FILE* fp;
+  gzFile fp_gz;
+  FastaMap map;
+  pthread_mutex_t lock; // one thread reads at a time
+  int total_read;       // sequences read so far
+} FastaSrc;
+typedef struct fasta_source* FastaSrcP;
+
+/* How count_fasta_kmers shares the KSP between threads */
+#define COUNT_SHARED      (0) // every thread adds to the whole KSP
+#define COUNT_PARTITIONED (1) // each thread owns part of the prefixes
+
+int open_fasta_src( FastaSrcP src, const char* fn, int map );
+int next_fasta_seq( FastaSrcP src, ChrP seq );
+int next_fasta_bases( FastaSrcP src, ChrP seq,
+		      const char** bases, size_t* len );
+void close_fasta_src( FastaSrcP src );
+void add_kmers_from_seq( const char* seq, size_t len, KSP kmers );
+void add_kmers_from_seq_mt( const char* seq, size_t len,
+			    KSP kmers, int tid );
+void scatter_kmers_from_seq( const char* seq, size_t len, KScatterP sc );
+int count_fasta_kmers( const char* fn, KSP kmers, int threads, int mode );
+int sketch_fasta_hist( const char* fn, KSP kmers,
+		       size_t* hist, size_t hist_len );
+#endif
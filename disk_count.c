@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "disk_count.h"
+#include "count_fasta.h"
+
+/* Mixes the bits of a packed m-mer so that minimizers aren't just
+   the poly-A m-mers (the murmur3 finalizer) */
+static inline uint64_t hash_mmer( pkmer mmer ) {
+  uint64_t h = (uint64_t)mmer;
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* parse_mem_size
+   Args: const char* str - a number of bytes, with an optional
+                           K, M, or G after it, like 512M
+   Returns: the number of bytes, 0 if str isn't one
+*/
+size_t parse_mem_size( const char* str ) {
+  char* end;
+  size_t size;
+
+  size = (size_t)strtoul( str, &end, 10 );
+  switch( *end ) {
+  case 'G' : case 'g' :
+    size <<= 10;
+  case 'M' : case 'm' :
+    size <<= 10;
+  case 'K' : case 'k' :
+    size <<= 10;
+    end++;
+  }
+  if ( *end != '\0' ) {
+    return 0;
+  }
+  return size;
+}
+
+/* choose_n_buckets
+   Args: size_t expected - about how many distinct kmers there are
+         size_t max_mem - how many bytes counting may use
+   Returns: how many buckets keep each one under max_mem, with
+            room for buckets coming out uneven; 1 means it all
+            fits in memory at once
+*/
+int choose_n_buckets( size_t expected, size_t max_mem ) {
+  size_t n;
+  if ( max_mem == 0 ) {
+    return 1;
+  }
+  n = 2 * ((expected * DISK_BYTES_PER_KMER) / max_mem + 1) - 1;
+  return (n > MAX_BUCKETS) ? MAX_BUCKETS : (int)n;
+}
+
+/* init_kbuckets
+   Args: size_t k - kmer length
+         int n - number of buckets
+   Returns: pointer to a new set of empty bucket files
+*/
+KBucketsP init_kbuckets( size_t k, int n ) {
+  KBucketsP kb;
+  int b;
+
+  kb = (KBucketsP)malloc(sizeof(KBuckets));
+  kb->k = k;
+  kb->m = (k < MINIMIZER_LEN) ? k : MINIMIZER_LEN;
+  kb->n = n;
+  kb->fps = (FILE**)malloc(sizeof(FILE*) * n);
+  kb->n_kmers = (size_t*)calloc( n, sizeof(size_t) );
+  kb->peak_bytes = 0;
+  for( b = 0; b < n; b++ ) {
+    kb->fps[b] = tmpfile();
+    if ( kb->fps[b] == NULL ) {
+      fprintf( stderr, "ERROR: Cannot make temporary bucket file %d\n", b );
+      exit( 1 );
+    }
+  }
+  return kb;
+}
+
+/* Writes the super-kmer of n kmers starting at seq to bucket b
+   as its length followed by its bases */
+static void write_super_kmer( KBucketsP kb, int b,
+			      const char* seq, size_t n ) {
+  uint32_t len = (uint32_t)(n + kb->k - 1);
+  fwrite( &len, sizeof(uint32_t), 1, kb->fps[b] );
+  fwrite( seq, sizeof(char), len, kb->fps[b] );
+  kb->n_kmers[b] += n;
+}
+
+/* spill_seq_kmers
+   Cuts seq into super-kmers and writes each to its bucket. Kmers
+   with bad bases aren't in any of them.
+*/
+void spill_seq_kmers( KBucketsP kb, const ChrP seq ) {
+  size_t w = kb->k - kb->m + 1; // m-mers in each kmer
+  uint64_t* hashes;             // last w m-mer hashes, by pos % w
+  size_t run = 0;    // m-mers in a row with no bad bases
+  size_t min_pos = 0; // position of the current minimizer
+  size_t last = 0;    // position of the last m-mer
+  size_t p, q, i;
+  size_t sk_start = 0, sk_n = 0; // super-kmer being built
+  int sk_b = 0, b;
+  pkmer mmer;
+  KIter it;
+
+  hashes = (uint64_t*)malloc(sizeof(uint64_t) * w);
+  init_kmer_iter( &it, seq->seq, seq->len, kb->m );
+  while( next_canonical_kmer( &it, &mmer, &q ) ) {
+    if ( (run == 0) || (q != last + 1) ) { // bad base in between
+      if ( sk_n > 0 ) {
+	write_super_kmer( kb, sk_b, &seq->seq[sk_start], sk_n );
+	sk_n = 0;
+      }
+      run = 0;
+    }
+    last = q;
+    run++;
+    hashes[ q % w ] = hash_mmer( mmer );
+    if ( run < w ) {
+      continue;
+    }
+    /* The kmer at p has all its m-mers; find its minimizer,
+       only looking at them all when the old one went out */
+    p = q - w + 1;
+    if ( (run == w) || (min_pos < p) ) {
+      min_pos = p;
+      for( i = p + 1; i <= q; i++ ) {
+	if ( hashes[ i % w ] < hashes[ min_pos % w ] ) {
+	  min_pos = i;
+	}
+      }
+    }
+    else if ( hashes[ q % w ] < hashes[ min_pos % w ] ) {
+      min_pos = q;
+    }
+    b = (int)(hashes[ min_pos % w ] % kb->n);
+    if ( (sk_n > 0) && (b != sk_b) ) {
+      write_super_kmer( kb, sk_b, &seq->seq[sk_start], sk_n );
+      sk_n = 0;
+    }
+    if ( sk_n == 0 ) {
+      sk_start = p;
+      sk_b = b;
+    }
+    sk_n++;
+  }
+  if ( sk_n > 0 ) {
+    write_super_kmer( kb, sk_b, &seq->seq[sk_start], sk_n );
+  }
+  free( hashes );
+}
+
+/* spill_fasta_kmers
+   Args: const char* fn - fasta file, gzipped or not
+         KBucketsP kb - where the super-kmers go
+   Returns: number of sequences read, -1 if fn can't be opened
+*/
+int spill_fasta_kmers( const char* fn, KBucketsP kb ) {
+  FastaSrc src;
+  ChrP seq;
+
+  if ( open_fasta_src( &src, fn, 0 ) != 0 ) {
+    return -1;
+  }
+  fprintf( stderr, "[Spilling fasta sequences to %d buckets:", kb->n );
+  seq = newSeq();
+  while( next_fasta_seq( &src, seq ) == 0 ) {
+    spill_seq_kmers( kb, seq );
+  }
+  free( seq );
+  fprintf( stderr, "]\n" );
+  close_fasta_src( &src );
+  return src.total_read;
+}
+
+/* Reads the next super-kmer of fp into *buf, growing it if need
+   be. Returns: its length, 0 at the end of the bucket */
+static size_t read_super_kmer( FILE* fp, char** buf, size_t* buf_len ) {
+  uint32_t len;
+  if ( fread( &len, sizeof(uint32_t), 1, fp ) != 1 ) {
+    return 0;
+  }
+  if ( len > *buf_len ) {
+    free( *buf );
+    *buf_len = len;
+    *buf = (char*)malloc(sizeof(char) * len);
+  }
+  if ( fread( *buf, sizeof(char), len, fp ) != len ) {
+    fprintf( stderr, "ERROR: Temporary bucket file is cut short\n" );
+    exit( 1 );
+  }
+  return len;
+}
+
+/* count_kbucket
+   Args: KBucketsP kb - buckets, all spilled
+         int b - which bucket to count
+         const KSPOpts* opts - how to make the KSP; with threads
+                               more than 1, it is built partitioned
+   Returns: a new KSP with the counts of every kmer in bucket b.
+            kb->peak_bytes goes up to its size if it's the biggest
+            so far.
+*/
+KSP count_kbucket( KBucketsP kb, int b, const KSPOpts* opts ) {
+  KSPOpts bopts = *opts;
+  KSPStats st;
+  KSP ks;
+  KScatterP sc = NULL;
+  KIter it;
+  pkmer pk;
+  size_t pos, len;
+  size_t buf_len = 0;
+  char* buf = NULL;
+
+  /* There can't be more distinct kmers than went in the bucket
+     (an empty one still gets a small KSP, not the default size) */
+  bopts.expected = (kb->n_kmers[b] > 0) ? kb->n_kmers[b] : 1;
+  ks = init_KSP_opts( kb->k, &bopts );
+  if ( bopts.threads > 1 ) {
+    sc = init_kscatter( ks, bopts.threads, SCATTER_CAP );
+  }
+  rewind( kb->fps[b] );
+  while( (len = read_super_kmer( kb->fps[b], &buf, &buf_len )) > 0 ) {
+    init_kmer_iter( &it, buf, len, kb->k );
+    while( next_canonical_kmer( &it, &pk, &pos ) ) {
+      if ( sc != NULL ) {
+	kscatter_add( sc, pk );
+      }
+      else {
+	increment_or_insert_pkmer( pk, ks );
+      }
+    }
+  }
+  if ( sc != NULL ) {
+    kscatter_flush( sc );
+    free_kscatter( sc );
+  }
+  free( buf );
+  ksp_stats( ks, &st );
+  if ( st.total_bytes > kb->peak_bytes ) {
+    kb->peak_bytes = st.total_bytes;
+  }
+  return ks;
+}
+
+/* disk_count_hist
+   Args: KBucketsP kb - buckets, all spilled
+         const KSPOpts* opts - how to make each bucket's KSP
+         size_t* hist - hist[i] gets the number of kmers seen i times
+         size_t hist_len - length of hist
+   Same as count_hist on one KSP of the whole input, but only one
+   bucket is in memory at a time
+*/
+void disk_count_hist( KBucketsP kb, const KSPOpts* opts,
+		      size_t* hist, size_t hist_len ) {
+  size_t* bhist;
+  size_t i;
+  int b;
+  KSP ks;
+
+  bhist = (size_t*)malloc(sizeof(size_t) * hist_len);
+  memset( hist, 0, sizeof(size_t) * hist_len );
+  fprintf( stderr, "[Counting buckets:" );
+  for( b = 0; b < kb->n; b++ ) {
+    ks = count_kbucket( kb, b, opts );
+    count_hist( ks, bhist, hist_len );
+    for( i = 0; i < hist_len; i++ ) {
+      hist[i] += bhist[i];
+    }
+    free_KSP( ks );
+    fprintf( stderr, "." );
+  }
+  fprintf( stderr, "]\n" );
+  free( bhist );
+}
+
+/* disk_repeated_kmers
+   Args: KBucketsP kb - buckets, all spilled
+         const KSPOpts* opts - how to make the KSPs
+   Returns: a new KSP with just the kmers seen more than once, with
+            their counts. Any good kmer of the input that isn't in
+            it was seen once. Most distinct kmers are usually seen
+            once, so this is much smaller than all the counts.
+*/
+KSP disk_repeated_kmers( KBucketsP kb, const KSPOpts* opts ) {
+  KSPOpts ropts = *opts;
+  KSP ks, repeats;
+  KIter it;
+  pkmer pk;
+  size_t pos, len;
+  size_t buf_len = 0;
+  char* buf = NULL;
+  int b;
+
+  /* Guess that the repeats are no more than one bucket's worth */
+  ropts.expected = 1;
+  for( b = 0; b < kb->n; b++ ) {
+    if ( kb->n_kmers[b] > ropts.expected ) {
+      ropts.expected = kb->n_kmers[b];
+    }
+  }
+  ropts.threads = 1;
+  ropts.bloom_bytes = 0; // everything that goes in is a repeat
+  repeats = init_KSP_opts( kb->k, &ropts );
+
+  fprintf( stderr, "[Counting buckets:" );
+  for( b = 0; b < kb->n; b++ ) {
+    ks = count_kbucket( kb, b, opts );
+    /* Go over the bucket again to find its repeated kmers. Every
+       kmer is in just one bucket, so counting each time a repeated
+       one comes up gives its whole count */
+    rewind( kb->fps[b] );
+    while( (len = read_super_kmer( kb->fps[b], &buf, &buf_len )) > 0 ) {
+      init_kmer_iter( &it, buf, len, kb->k );
+      while( next_canonical_kmer( &it, &pk, &pos ) ) {
+	if ( get_pkmer_count( pk, ks ) > 1 ) {
+	  increment_or_insert_pkmer( pk, repeats );
+	}
+      }
+    }
+    free_KSP( ks );
+    fprintf( stderr, "." );
+  }
+  fprintf( stderr, "]\n" );
+  free( buf );
+  return repeats;
+}
+
+/* free_kbuckets
+   Closes (and so deletes) the bucket files and frees kb
+*/
+void free_kbuckets( KBucketsP kb ) {
+  int b;
+  for( b = 0; b < kb->n; b++ ) {
+    fclose( kb->fps[b] );
+  }
+  free( kb->fps );
+  free( kb->n_kmers );
+  free( kb );
+}
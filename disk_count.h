@@ -0,0 +1,40 @@
+#ifndef DISK_COUNT_H
+#define DISK_COUNT_H
+#include "kmer.h"
+#include "file_io.h"
+
+/* Out-of-core counting, for inputs with more distinct kmers than
+   fit in memory. Each sequence is cut into super-kmers: runs of
+   consecutive kmers that have the same minimizer (the m-mer with
+   the smallest hash among the canonical m-mers in the kmer). Every
+   super-kmer is spilled to the bucket file its minimizer hashes
+   to. A kmer and its reverse complement have the same minimizer,
+   so every copy of a canonical kmer lands in the same bucket, and
+   the buckets can be counted one at a time in a KSP of their own. */
+typedef struct kmer_buckets {
+  size_t k;
+  size_t m;         // minimizer length
+  int n;            // number of bucket files
+  FILE** fps;       // temporary bucket files, gone when closed
+  size_t* n_kmers;  // kmers spilled to each bucket
+  size_t peak_bytes; // most memory any one bucket's KSP took
+} KBuckets;
+typedef struct kmer_buckets* KBucketsP;
+
+#define MINIMIZER_LEN (11)
+#define MAX_BUCKETS (512) // stay well under the open file limit
+/* Rough memory per distinct kmer, to decide how many buckets
+   the max memory needs */
+#define DISK_BYTES_PER_KMER (32)
+
+size_t parse_mem_size( const char* str );
+int choose_n_buckets( size_t expected, size_t max_mem );
+KBucketsP init_kbuckets( size_t k, int n );
+void spill_seq_kmers( KBucketsP kb, const ChrP seq );
+int spill_fasta_kmers( const char* fn, KBucketsP kb );
+KSP count_kbucket( KBucketsP kb, int b, const KSPOpts* opts );
+void disk_count_hist( KBucketsP kb, const KSPOpts* opts,
+		      size_t* hist, size_t hist_len );
+KSP disk_repeated_kmers( KBucketsP kb, const KSPOpts* opts );
+void free_kbuckets( KBucketsP kb );
+#endif
@@ -5,27 +5,58 @@
 #include <getopt.h>
 #include "kmer.h"
 #include "file_io.h"
+#include "count_fasta.h"
+#include "disk_count.h"
+#include "kmer_db.h"
 
 #define MAX_COUNTS (511)
 #define HKC_LEN (1027);
-typedef struct kmer_data {
-  short unsigned int count;
-} kd;
 
-void increment_kmer_count( klnP kmer );
-short unsigned int get_kmer_count( klnP kmer );
+#define COV_CHUNK (4096) // kmer positions looked up at a time
+
+/* Coverage of COV_CHUNK kmer positions of a sequence, and room
+   to look them up */
+typedef struct cov_buf {
+  size_t covs[COV_CHUNK];
+  pkmer pks[COV_CHUNK];
+  size_t pos[COV_CHUNK];
+  size_t counts[COV_CHUNK];
+} CovBuf;
+typedef struct cov_buf* CovBufP;
+
+/* Where the second pass gets the counts: a KSP, or a kmer count
+   database made by an earlier run */
+typedef struct hkc_counts {
+  size_t k;
+  KSP ks;
+  KDBP db;
+  int repeats_only; // ks has only the kmers seen more than once
+} HkcCounts;
+typedef struct hkc_counts* HkcCountsP;
+
 void print_hist( KSP kmers );
-void search_kmer_tree( ktnP tree_node,
-		       size_t depth,
-		       short unsigned int* hist );
-void add_kmers_from_seq( ChrP seq, KSP kmers );
-void find_and_write_hkcs( ChrP seq, KSP kmers );
-void find_and_write_HKConLongReads( const ChrP seq, const KSP kmers );
+void fill_covs( const ChrP seq, const HkcCountsP hc, size_t from, CovBufP cb );
+void find_and_write_hkcs( const ChrP seq, const HkcCountsP hc );
+void find_and_write_HKConLongReads( const ChrP seq, const HkcCountsP hc );
 
 void help( void ) {
-  printf( "fasta-hkc -f <fasta file> -k <kmer length> -l [make HKConLongReads.txt file]\n" );
+  printf( "fasta-hkc -f <fasta file> -k <kmer length> -l [make HKConLongReads.txt file] -H [use hash table] -t <threads> -p [partitioned build] -m <max memory> -b <bloom memory> -w <db to write> -d <db to read> -s [show memory stats] -c [compress tree]\n" );
   printf( " By default, makes an HKC file.\n" );
   printf( " If -l is given, makes an HKConLongReads output file instead.\n" );
+  printf( " -H keeps the kmers in a hash table instead of the default tree.\n" );
+  printf( " -t counts with this many threads (default 1).\n" );
+  printf( " -p with -t, gives each thread its own part of the kmers to build\n" );
+  printf( " instead of sharing the whole tree. Uses more memory for buffers.\n" );
+  printf( " -m, --max-mem counts on disk, in buckets that each fit in this\n" );
+  printf( " much memory (like 4G or 500M), if the input looks too big for it.\n" );
+  printf( " -b keeps kmers seen only once out of the tree, in a bloom filter\n" );
+  printf( " of this much memory (like 1G). Saves a lot on noisy reads.\n" );
+  printf( " -w writes the kmer counts to this database file, for later runs.\n" );
+  printf( " -d takes the kmer counts (and k) from a database written by -w\n" );
+  printf( " instead of counting them again. Not with -w.\n" );
+  printf( " -s, --stats shows how much memory the kmers took, and where it went.\n" );
+  printf( " -c, --compress keeps each run of the tree with no branches as one\n" );
+  printf( " node. Much less memory for big k. Use -p if it's with -t.\n" );
   exit( 0 );
 }
 
@@ -36,26 +67,40 @@ int main ( int argc, char* argv[] ) {
   extern int optin;
 
   int ich, i;
+  static struct option long_opts[] = {
+    { "max-mem", required_argument, NULL, 'm' },
+    { "stats", no_argument, NULL, 's' },
+    { "compress", no_argument, NULL, 'c' },
+    { NULL, 0, NULL, 0 }
+  };
   
   size_t k;
   char* kmer_str;
-  KSP kmers;
-  klnP kmer;
-  kd* data;
+  HkcCounts hc;
+  char* db_in     = NULL;
+  char* db_out    = NULL;
+  KSPOpts opts;
   gzFile fp_gz;
   FILE* fp;
   int gzipped     = 0;
   int read_status = 0;
-  int total_read  = 0;
   int make_hkc    = 1;
   int make_HKConLongReads = 0;
+  int threads     = 1;
+  int mode        = COUNT_SHARED;
+  size_t max_mem  = 0;
+  int show_stats  = 0;
+  int n_buckets   = 1;
+  KBucketsP kb;
   ChrP seq;
   char fn[MAX_FN_LEN+1];
     
   if( argc == 1 ) {
     help();
   }
-  while( (ich=getopt( argc, argv, "k:f:l" )) != -1 ) {
+  set_default_KSPOpts( &opts );
+  opts.count_bits = 8; // high counts go in the overflow table
+  while( (ich=getopt_long( argc, argv, "k:f:lHt:pm:b:w:d:sc", long_opts, NULL )) != -1 ) {
     switch(ich) {
     case 'k' :
       k = (size_t)atoi( optarg );
@@ -69,61 +114,127 @@ int main ( int argc, char* argv[] ) {
       make_HKConLongReads = 1;
       make_hkc = 0;
       break;
+    case 'H' :
+      opts.backend = KSP_HASH;
+      break;
+    case 't' :
+      threads = atoi( optarg );
+      break;
+    case 'p' :
+      mode = COUNT_PARTITIONED;
+      break;
+    case 's' :
+      show_stats = 1;
+      break;
+    case 'c' :
+      opts.compress = 1;
+      break;
+    case 'm' :
+      max_mem = parse_mem_size( optarg );
+      if ( max_mem == 0 ) {
+	fprintf( stderr, "ERROR: Can't make sense of max memory %s\n",
+		 optarg );
+	exit( 1 );
+      }
+      break;
+    case 'b' :
+      opts.bloom_bytes = parse_mem_size( optarg );
+      if ( opts.bloom_bytes == 0 ) {
+	fprintf( stderr, "ERROR: Can't make sense of bloom filter memory %s\n",
+		 optarg );
+	exit( 1 );
+      }
+      break;
+    case 'w' :
+      db_out = optarg;
+      break;
+    case 'd' :
+      db_in = optarg;
+      break;
     default :
       help();
     }
   }
 
+  if ( (db_in != NULL) && (db_out != NULL) ) {
+    fprintf( stderr, "ERROR: -w can't be used with -d\n" );
+    exit( 1 );
+  }
+
+  /* Can't be more distinct kmers than bases; that's plenty good
+     enough to size the array part of the tree */
+  if ( opts.backend == KSP_TRIE ) {
+    opts.expected = fasta_size_hint( fn );
+  }
   fprintf( stderr, "[Initializing data structures]\n" );
   kmer_str = (char*)malloc(sizeof(char) * k);
-  kmers = init_KSP( k );
+  opts.threads = threads;
   seq = newSeq();
-  
-  /* Get a handle on the input file to pass to parser */
-  if ( is_gz( fn ) ) {
-    gzipped = 1;
-    fprintf( stderr, "Opening gzipped file: %s\n", fn );
-    fp_gz = gzopen( fn, "r" );
-    if ( fp_gz == NULL ) {
+  hc.ks = NULL;
+  hc.db = NULL;
+  hc.repeats_only = 0;
+
+  if ( db_in != NULL ) {
+    /* Counted already, by an earlier run */
+    hc.db = open_kmer_db( db_in );
+    if ( hc.db == NULL ) {
+      fprintf( stderr, "ERROR: Can't read kmer count database %s\n", db_in );
+      exit( 1 );
+    }
+    k = hc.db->k;
+    /* Kmers of the input that aren't there were seen once */
+    hc.repeats_only = (hc.db->hdr->flags & KDB_ONLY_REPEATS) != 0;
+  }
+  else if ( (n_buckets = choose_n_buckets( fasta_size_hint( fn ),
+					   max_mem )) > 1 ) {
+    /* Too big for memory; count on disk and keep only the kmers
+       seen more than once. All the others were seen once. */
+    kb = init_kbuckets( k, n_buckets );
+    if ( spill_fasta_kmers( fn, kb ) < 0 ) {
       fprintf( stderr,
-	       "ERROR: Problem reading compressed fasta file.\n" );
+	       "ERROR: Problem reading fasta file.\n" );
       exit( 1 );
     }
+    hc.ks = disk_repeated_kmers( kb, &opts );
+    if ( show_stats ) {
+      fprintf( stderr, "[Biggest bucket took %.1f MB]\n",
+	       (double)kb->peak_bytes / (1 << 20) );
+    }
+    free_kbuckets( kb );
+    hc.repeats_only = 1;
   }
   else {
-    fp = fileOpen( fn, "r" );
-    fprintf( stderr, "Opening file: %s\n", fn );
-    if ( fp == NULL ) {
+    hc.ks = init_KSP_opts( k, &opts );
+    if ( count_fasta_kmers( fn, hc.ks, threads, mode ) < 0 ) {
       fprintf( stderr,
 	       "ERROR: Problem reading fasta file.\n" );
       exit( 1 );
     }
   }
+  hc.k = k;
+  if ( show_stats && (hc.ks != NULL) ) {
+    print_ksp_stats( hc.ks, stderr );
+  }
 
-  fprintf( stderr, "[Reading fasta sequences:" );
-  while( read_status == 0 ) {
-    if ( gzipped ) {
-      read_status = gz_read_next_fasta( fp_gz, seq );
-    }
-    else {
-      read_status = read_next_fasta( fp, seq );
-    }
-    if ( read_status == 0 ) {
-      /* Got a good sequence in seq. Find the kmers */
-      add_kmers_from_seq( seq, kmers );
-      total_read++;
-      if ( total_read%10 == 0 ) {
-	fprintf( stderr, "." );
-      }
+  if ( (db_out != NULL) && (hc.ks != NULL) ) {
+    fprintf( stderr, "[Writing kmer count database]\n" );
+    if ( write_kmer_db( hc.ks, db_out,
+			hc.repeats_only ? KDB_ONLY_REPEATS : 0 ) != 0 ) {
+      fprintf( stderr, "ERROR: Can't write kmer count database %s\n",
+	       db_out );
+      exit( 1 );
     }
   }
-  fprintf( stderr, "]\n" );
 
-  if ( is_gz(fn) ) {
-    gzclose( fp_gz );
-  }
-  else {
-    fclose( fp );
+  /* From here on, all that matters is whether a kmer was seen once.
+     When every kmer is in the KSP (no bloom filter, not just the
+     repeats), the rest can go so the lookups search a smaller tree */
+  if ( (hc.ks != NULL) && !hc.repeats_only && (hc.ks->bloom == NULL) ) {
+    fprintf( stderr, "[Dropped %lu kmers seen more than once]\n",
+	     ksp_prune( hc.ks, 1, 1 ) );
+    if ( show_stats ) {
+      print_ksp_stats( hc.ks, stderr );
+    }
   }
 
   /* Get a handle on the input file to pass to parser */
@@ -148,7 +259,7 @@ int main ( int argc, char* argv[] ) {
   }
 
   if ( make_hkc ) {
-    printf( "%lu\t.\n", kmers->k );
+    printf( "%lu\t.\n", hc.k );
   }
 
   fprintf( stderr, "[Reading fasta sequences for hkcs]\n" );
@@ -162,53 +273,73 @@ int main ( int argc, char* argv[] ) {
     }
     if ( read_status == 0 ) {
       if ( make_hkc ) {
-	find_and_write_hkcs( seq, kmers );
+	find_and_write_hkcs( seq, &hc );
       }
       if ( make_HKConLongReads ) {
-	find_and_write_HKConLongReads( seq, kmers );
+	find_and_write_HKConLongReads( seq, &hc );
       }
     }
   }
   /* Like Elsa says, "Let it go!" */
   free(seq);
+  free_KSP( hc.ks );
+  close_kmer_db( hc.db );
 
 }
 
- void add_kmers_from_seq( const ChrP seq, KSP kmers ) {
-  size_t i;
-  kd* data;
-  klnP kmer;
-  
-  for( i = 0; i < seq->len - kmers->k + 1; i++ ) {
-    kmer = get_canonical_kmer( &seq->seq[i], kmers );
-    if ( kmer == NULL ) { // new kmer or bad kmer
-      kmer = add_canonical_kmer( &seq->seq[i], kmers );
-      if ( kmer != NULL ) { //bad kmer?
-	data = (kd*)malloc(sizeof(kd));
-	data->count = 1;
-	kmer->data = data;
-      }
-    }
-    else {
-      increment_kmer_count( kmer );
+/* fill_covs
+   Puts the coverage of the kmers at positions from, from+1, ... of
+   seq in cb->covs, up to COV_CHUNK of them. Kmers with bad bases
+   have no coverage. They are all looked up in one batch, which is
+   much faster than one at a time.
+*/
+void fill_covs( const ChrP seq, const HkcCountsP hc, size_t from, CovBufP cb ) {
+  size_t n, m, j, pos;
+  pkmer pk;
+  KIter it;
+
+  n = seq->len - hc->k + 1 - from;
+  if ( n > COV_CHUNK ) {
+    n = COV_CHUNK;
+  }
+  memset( cb->covs, 0, sizeof(size_t) * n );
+  m = 0;
+  init_kmer_iter( &it, &seq->seq[from], n + hc->k - 1, hc->k );
+  while( next_canonical_kmer( &it, &pk, &pos ) ) {
+    cb->pks[m] = pk;
+    cb->pos[m] = pos;
+    m++;
+  }
+  if ( hc->db != NULL ) {
+    kdb_get_batch( hc->db, cb->pks, m, cb->counts );
+  }
+  else {
+    get_kmers_batch( hc->ks, cb->pks, m, cb->counts );
+  }
+  for( j = 0; j < m; j++ ) {
+    cb->covs[ cb->pos[j] ] = cb->counts[j];
+    if ( (cb->counts[j] == 0) && hc->repeats_only ) {
+      cb->covs[ cb->pos[j] ] = 1;
     }
   }
 }
 
-void find_and_write_hkcs( const ChrP seq, const KSP kmers ) {
+void find_and_write_hkcs( const ChrP seq, const HkcCountsP hc ) {
   size_t i, hkc_start, hkc_end, cov;
   char* HKC_seq; // place to copy the HKC for printing
   int in_hkc = 0; // boolean - are we in an HKC at this position?
   size_t max_hkc_len = HKC_LEN;
-  kd* data;
-  klnP kmer;
+  CovBufP cb;
 
   /* Initialize HKC_seq. We'll grow it later if necessary */
   HKC_seq = (char*)malloc(sizeof(char) * (max_hkc_len+1));
 
-  for( i = 0; i < seq->len - kmers->k + 1; i++ ) {
-    kmer = get_canonical_kmer( &seq->seq[i], kmers );
-    cov = get_kmer_count( kmer );
+  cb = (CovBufP)malloc(sizeof(CovBuf));
+  for( i = 0; i + hc->k <= seq->len; i++ ) {
+    if ( i % COV_CHUNK == 0 ) {
+      fill_covs( seq, hc, i, cb );
+    }
+    cov = cb->covs[ i % COV_CHUNK ];
     if ( cov == 1 ) { // this is an HKC position
       if ( in_hkc ) { // continuing HKC already started
 	; // keep going
@@ -221,7 +352,7 @@ void find_and_write_hkcs( const ChrP seq, const KSP kmers ) {
     else { // not HKC
       if ( in_hkc ) { // must have just ended a HKC;
 	// Therefore, i is first position after end of HKC
-	hkc_end = i + kmers->k - 1; // set hkc_end to first position
+	hkc_end = i + hc->k - 1; // set hkc_end to first position
 	// outside of kmer, i.e. 0-index open ended coordinate
 	// minus one because i was the first position *outside*
 	// the HKC
@@ -238,23 +369,26 @@ void find_and_write_hkcs( const ChrP seq, const KSP kmers ) {
     }
   }
   free( HKC_seq );
+  free( cb );
 }
 
 /* Takes a sequence from the input fasta file and the kmers
    Writes out a line of the HKConLongReads */
-void find_and_write_HKConLongReads( const ChrP seq, const KSP kmers ) {
+void find_and_write_HKConLongReads( const ChrP seq, const HkcCountsP hc ) {
   size_t i, hkc_start, hkc_end, cov;
   int in_hkc = 0; // boolean - are we in an HKC at this position?
-  kd* data;
-  klnP kmer;
+  CovBufP cb;
 
   /* Every fasta sequence get a line, regardless of the number of
      HKCs on it - even if there are none */
   printf( "%s %lu", seq->id, seq->len );
   
-  for( i = 0; i < seq->len - kmers->k + 1; i++ ) {
-    kmer = get_canonical_kmer( &seq->seq[i], kmers );
-    cov = get_kmer_count( kmer );
+  cb = (CovBufP)malloc(sizeof(CovBuf));
+  for( i = 0; i + hc->k <= seq->len; i++ ) {
+    if ( i % COV_CHUNK == 0 ) {
+      fill_covs( seq, hc, i, cb );
+    }
+    cov = cb->covs[ i % COV_CHUNK ];
     if ( cov == 1 ) { // this is an HKC position
       if ( in_hkc ) { // continuing HKC already started
 	; // keep going
@@ -267,7 +401,7 @@ void find_and_write_HKConLongReads( const ChrP seq, const KSP kmers ) {
     else { // not HKC
       if ( in_hkc ) { // must have just ended a HKC;
 	// Therefore, i is first position after end of HKC
-	hkc_end = i + kmers->k - 1; // set hkc_end to first position
+	hkc_end = i + hc->k - 1; // set hkc_end to first position
 	// outside of kmer, i.e. 0-index open ended coordinate
 	// minus one because i was the first position *outside*
 	// the HKC
@@ -279,98 +413,20 @@ void find_and_write_HKConLongReads( const ChrP seq, const KSP kmers ) {
     }
   }
   printf( "\n" );
+  free( cb );
 }
  
 void print_hist( KSP kmers ) {
-  size_t i, len;
-  short unsigned int* hist;
-  hist = (short unsigned int*)malloc(sizeof(short unsigned int)*MAX_COUNTS);
-  for( i = 0; i < MAX_COUNTS; i++ ) {
-    hist[i] = 0;
-  }
-  len = 1<<(K_AR_SIZE*2);
-  /* Look in each position of the array part */
-  for( i = 0; i < len; i++ ) {
-    if ( kmers->ka[i] != NULL ) {
-      search_kmer_tree( kmers->ka[i],
-			(kmers->k - kmers->k_ar_size),
-			hist );
-    }
-  }
+  size_t i;
+  size_t* hist;
+  hist = (size_t*)malloc(sizeof(size_t)*MAX_COUNTS);
+  count_hist( kmers, hist, MAX_COUNTS );
   for( i = 0; i < MAX_COUNTS; i++ ) {
-    printf( "%lu %d\n", i, hist[i] );
+    printf( "%lu %lu\n", i, hist[i] );
   }
   free( hist );
 }
 
-void search_kmer_tree( ktnP tree_node,
-		       size_t depth, short unsigned int* hist ) {
-  klnP leaf_node;
-  kd* data;
-  if ( depth > 1 ) {
-    if ( tree_node->Ap != NULL ) {
-      search_kmer_tree( tree_node->Ap, depth - 1, hist );
-    }
-    if ( tree_node->Cp != NULL ) {
-      search_kmer_tree( tree_node->Cp, depth - 1, hist );
-    }
-    if ( tree_node->Gp != NULL ) {
-      search_kmer_tree( tree_node->Gp, depth - 1, hist );
-    }
-    if ( tree_node->Tp != NULL ) {
-      search_kmer_tree( tree_node->Tp, depth - 1, hist );
-    }
-    return;
-  }
-  else {
-    if ( tree_node->Ap != NULL ) {
-      leaf_node = tree_node->Ap;
-      data = (kd*)leaf_node->data;
-      if ( data->count <= MAX_COUNTS ) {
-	hist[data->count]++;
-      }
-    }
-    if ( tree_node->Cp != NULL ) {
-      leaf_node = tree_node->Cp;
-      data = (kd*)leaf_node->data;
-      if ( data->count <= MAX_COUNTS ) {
-	hist[data->count]++;
-      }
-    }
-    if ( tree_node->Gp != NULL ) {
-      leaf_node = tree_node->Gp;
-      data = (kd*)leaf_node->data;
-      if ( data->count <= MAX_COUNTS ) {
-	hist[data->count]++;
-      }
-    }
-    if ( tree_node->Tp != NULL ) {
-      leaf_node = tree_node->Tp;
-      data = (kd*)leaf_node->data;
-      if ( data->count <= MAX_COUNTS ) {
-	hist[data->count]++;
-      }
-    }
-  }
-}
-
-short unsigned int get_kmer_count( klnP kmer ) {
-  kd* data;
-  if ( kmer == NULL ) {
-    return 0;
-  }
-  data = (kd*)kmer->data;
-  return data->count;
-}
- 
-void increment_kmer_count( klnP kmer ) {
-  kd* data;
-  data = (kd*)kmer->data;
-  if ( data->count < MAX_COUNTS ) {
-    data->count++;
-  }
-}
-
 void make_random_kmer( char* kmer_str, size_t k ) {
   int i, r;
   for( i = 0; i < k; i++ ) {
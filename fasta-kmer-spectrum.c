@@ -5,21 +5,34 @@
 #include <getopt.h>
 #include "kmer.h"
 #include "file_io.h"
+#include "count_fasta.h"
+#include "disk_count.h"
+#include "kmer_sketch.h"
+#include "kmer_db.h"
 
 #define NUM_TESTS (1000000)
 #define MAX_COUNTS (511)
-typedef struct kmer_data {
-  size_t count;
-} kd;
 
-void increment_kmer_count( klnP kmer );
-void print_hist( KSP kmers );
-void search_kmer_tree( ktnP tree_node,
-		       size_t depth, size_t* hist );
-void add_kmers_from_seq( ChrP seq, KSP kmers );
+void print_hist( size_t* hist );
 
 void help( void ) {
-  printf( "fasta-kmer-spectrum -f <fasta file> -k <kmer length>\n" );
+  printf( "fasta-kmer-spectrum -f <fasta file> -k <kmer length> -H [use hash table] -t <threads> -p [partitioned build] -m <max memory> -a <sketch memory> -b <bloom memory> -w <db to write> -s [show memory stats] -c [compress tree]\n" );
+  printf( " -H keeps the kmers in a hash table instead of the default tree.\n" );
+  printf( " It uses much less memory for big inputs and large k.\n" );
+  printf( " -t counts with this many threads (default 1).\n" );
+  printf( " -p with -t, gives each thread its own part of the kmers to build\n" );
+  printf( " instead of sharing the whole tree. Uses more memory for buffers.\n" );
+  printf( " -m, --max-mem counts on disk, in buckets that each fit in this\n" );
+  printf( " much memory (like 4G or 500M), if the input looks too big for it.\n" );
+  printf( " -b keeps kmers seen only once out of the tree, in a bloom filter\n" );
+  printf( " of this much memory (like 1G). Saves a lot on noisy reads.\n" );
+  printf( " -a counts approximately, in a count-min sketch of this much memory\n" );
+  printf( " (like 1G), no matter how big the input is. Reads the input twice.\n" );
+  printf( " -w writes the kmer counts to this database file, for fasta-hkc -d\n" );
+  printf( " or kmer-db-merge. Needs all the counts at once, so not with -m or -a.\n" );
+  printf( " -s, --stats shows how much memory the kmers took, and where it went.\n" );
+  printf( " -c, --compress keeps each run of the tree with no branches as one\n" );
+  printf( " node. Much less memory for big k. Use -p if it's with -t.\n" );
   exit( 0 );
 }
 
@@ -28,24 +41,33 @@ int main ( int argc, char* argv[] ) {
   extern int optin;
 
   int ich, i;
+  static struct option long_opts[] = {
+    { "max-mem", required_argument, NULL, 'm' },
+    { "stats", no_argument, NULL, 's' },
+    { "compress", no_argument, NULL, 'c' },
+    { NULL, 0, NULL, 0 }
+  };
   
   size_t k;
   char* kmer_str;
   KSP kmers;
-  klnP kmer;
-  kd* data;
-  gzFile fp_gz;
-  FILE* fp;
-  int gzipped     = 0;
-  int read_status = 0;
-  int total_read  = 0;
-  ChrP seq;
+  KSPOpts opts;
+  int threads     = 1;
+  int mode        = COUNT_SHARED;
+  size_t max_mem  = 0;
+  int show_stats  = 0;
+  int n_buckets   = 1;
+  KBucketsP kb;
+  size_t* hist;
+  char* db_out    = NULL;
   char fn[MAX_FN_LEN+1];
     
   if( argc == 1 ) {
     help();
   }
-  while( (ich=getopt( argc, argv, "k:f:" )) != -1 ) {
+  set_default_KSPOpts( &opts );
+  opts.count_bits = 8; // high counts go in the overflow table
+  while( (ich=getopt_long( argc, argv, "k:f:Ht:pm:a:b:w:sc", long_opts, NULL )) != -1 ) {
     switch(ich) {
     case 'k' :
       k = (size_t)atoi( optarg );
@@ -55,170 +77,141 @@ int main ( int argc, char* argv[] ) {
     case 'f' :
       strcpy( fn, optarg );
       break;
+    case 'H' :
+      opts.backend = KSP_HASH;
+      break;
+    case 't' :
+      threads = atoi( optarg );
+      break;
+    case 'p' :
+      mode = COUNT_PARTITIONED;
+      break;
+    case 's' :
+      show_stats = 1;
+      break;
+    case 'c' :
+      opts.compress = 1;
+      break;
+    case 'm' :
+      max_mem = parse_mem_size( optarg );
+      if ( max_mem == 0 ) {
+	fprintf( stderr, "ERROR: Can't make sense of max memory %s\n",
+		 optarg );
+	exit( 1 );
+      }
+      break;
+    case 'a' :
+      opts.backend = KSP_SKETCH;
+      opts.sketch_bytes = parse_mem_size( optarg );
+      if ( opts.sketch_bytes == 0 ) {
+	fprintf( stderr, "ERROR: Can't make sense of sketch memory %s\n",
+		 optarg );
+	exit( 1 );
+      }
+      break;
+    case 'b' :
+      opts.bloom_bytes = parse_mem_size( optarg );
+      if ( opts.bloom_bytes == 0 ) {
+	fprintf( stderr, "ERROR: Can't make sense of bloom filter memory %s\n",
+		 optarg );
+	exit( 1 );
+      }
+      break;
+    case 'w' :
+      db_out = optarg;
+      break;
     default :
       help();
     }
   }
+  /* Neither buckets on disk nor a sketch can list every kmer with
+     its count, which is what goes in a database */
+  if ( (db_out != NULL) && (max_mem > 0) ) {
+    fprintf( stderr, "ERROR: -w can't be used with -m\n" );
+    exit( 1 );
+  }
+  if ( (db_out != NULL) && (opts.backend == KSP_SKETCH) ) {
+    fprintf( stderr, "ERROR: -w can't be used with -a\n" );
+    exit( 1 );
+  }
 
+  /* Can't be more distinct kmers than bases; that's plenty good
+     enough to size the array part of the tree */
+  if ( opts.backend == KSP_TRIE ) {
+    opts.expected = fasta_size_hint( fn );
+  }
   fprintf( stderr, "[Initializing data structures]\n" );
   kmer_str = (char*)malloc(sizeof(char) * k);
-  kmers = init_KSP( k );
-  seq = newSeq();
-  
-  /* Get a handle on the input file to pass to parser */
-  if ( is_gz( fn ) ) {
-    gzipped = 1;
-    fprintf( stderr, "Opening gzipped file: %s\n", fn );
-    fp_gz = gzopen( fn, "r" );
-    if ( fp_gz == NULL ) {
-      fprintf( stderr,
-	       "ERROR: Problem reading compressed fasta file.\n" );
-      exit( 1 );
-    }
+  opts.threads = threads;
+  if ( opts.backend != KSP_SKETCH ) { // a sketch's memory is fixed already
+    n_buckets = choose_n_buckets( fasta_size_hint( fn ), max_mem );
   }
-  else {
-    fp = fileOpen( fn, "r" );
-    fprintf( stderr, "Opening file: %s\n", fn );
-    if ( fp == NULL ) {
+
+  if ( n_buckets > 1 ) { // too big for memory; count on disk
+    kb = init_kbuckets( k, n_buckets );
+    if ( spill_fasta_kmers( fn, kb ) < 0 ) {
       fprintf( stderr,
 	       "ERROR: Problem reading fasta file.\n" );
       exit( 1 );
     }
+    hist = (size_t*)malloc(sizeof(size_t)*MAX_COUNTS);
+    disk_count_hist( kb, &opts, hist, MAX_COUNTS );
+    if ( show_stats ) {
+      fprintf( stderr, "[Biggest bucket took %.1f MB]\n",
+	       (double)kb->peak_bytes / (1 << 20) );
+    }
+    free_kbuckets( kb );
+    fprintf( stderr, "[Writing histogram]\n" );
+    print_hist( hist );
+    free( hist );
+    return 0;
   }
 
-  fprintf( stderr, "[Reading fasta sequences:" );
-  while( read_status == 0 ) {
-    if ( gzipped ) {
-      read_status = gz_read_next_fasta( fp_gz, seq );
-    }
-    else {
-      read_status = read_next_fasta( fp, seq );
-    }
-    if ( read_status == 0 ) {
-      /* Got a good sequence in seq. Find the kmers */
-      add_kmers_from_seq( seq, kmers );
-      total_read++;
-      if ( total_read%10 == 0 ) {
-	fprintf( stderr, "." );
-      }
-    }
-  }
-  fprintf( stderr, "]\n" );
+  kmers = init_KSP_opts( k, &opts );
 
-  if ( is_gz(fn) ) {
-    gzclose( fp_gz );
+  if ( count_fasta_kmers( fn, kmers, threads, mode ) < 0 ) {
+    fprintf( stderr,
+	     "ERROR: Problem reading fasta file.\n" );
+    exit( 1 );
   }
-  else {
-    fclose( fp );
-  }
-  /* Like Elsa says, "Let it go!" */
-  free(seq);
-
-  fprintf( stderr, "[Writing histogram]\n" );
-  print_hist( kmers );
-  
-}
-
-void add_kmers_from_seq( const ChrP seq, KSP kmers ) {
-  size_t i;
-  kd* data;
-  klnP kmer;
-  
-  for( i = 0; i < seq->len - kmers->k + 1; i++ ) {
-    kmer = get_canonical_kmer( &seq->seq[i], kmers );
-    if ( kmer == NULL ) { // new kmer or bad kmer
-      kmer = add_canonical_kmer( &seq->seq[i], kmers );
-      if ( kmer != NULL ) { //bad kmer?
-	data = (kd*)malloc(sizeof(kd));
-	data->count = 1;
-	kmer->data = data;
-      }
-    }
-    else {
-      increment_kmer_count( kmer );
-    }
+  if ( show_stats ) {
+    print_ksp_stats( kmers, stderr );
   }
-}
 
-
-void print_hist( KSP kmers ) {
-  size_t i, len;
-  size_t* hist;
   hist = (size_t*)malloc(sizeof(size_t)*MAX_COUNTS);
-  for( i = 0; i < MAX_COUNTS; i++ ) {
-    hist[i] = 0;
-  }
-  len = 1<<(K_AR_SIZE*2);
-  /* Look in each position of the array part */
-  for( i = 0; i < len; i++ ) {
-    if ( kmers->ka[i] != NULL ) {
-      search_kmer_tree( kmers->ka[i],
-			(kmers->k - kmers->k_ar_size),
-			hist );
-    }
-  }
-  for( i = 0; i < MAX_COUNTS; i++ ) {
-    printf( "%lu %lu\n", i, hist[i] );
-  }
-  free( hist );
-}
-
-void search_kmer_tree( ktnP tree_node,
-		       size_t depth, size_t* hist ) {
-  klnP leaf_node;
-  kd* data;
-  if ( depth > 1 ) {
-    if ( tree_node->Ap != NULL ) {
-      search_kmer_tree( tree_node->Ap, depth - 1, hist );
-    }
-    if ( tree_node->Cp != NULL ) {
-      search_kmer_tree( tree_node->Cp, depth - 1, hist );
-    }
-    if ( tree_node->Gp != NULL ) {
-      search_kmer_tree( tree_node->Gp, depth - 1, hist );
-    }
-    if ( tree_node->Tp != NULL ) {
-      search_kmer_tree( tree_node->Tp, depth - 1, hist );
+  if ( kmers->backend == KSP_SKETCH ) {
+    fprintf( stderr, "[Counts are at most %lu too high, with %.0f%% certainty]\n",
+	     kcms_error_bound( kmers->cms ),
+	     100.0 * kcms_confidence( kmers->cms ) );
+    if ( sketch_fasta_hist( fn, kmers, hist, MAX_COUNTS ) < 0 ) {
+      fprintf( stderr,
+	       "ERROR: Problem reading fasta file.\n" );
+      exit( 1 );
     }
-    return;
   }
   else {
-    if ( tree_node->Ap != NULL ) {
-      leaf_node = tree_node->Ap;
-      data = (kd*)leaf_node->data;
-      if ( data->count <= MAX_COUNTS ) {
-	hist[data->count]++;
-      }
-    }
-    if ( tree_node->Cp != NULL ) {
-      leaf_node = tree_node->Cp;
-      data = (kd*)leaf_node->data;
-      if ( data->count <= MAX_COUNTS ) {
-	hist[data->count]++;
-      }
-    }
-    if ( tree_node->Gp != NULL ) {
-      leaf_node = tree_node->Gp;
-      data = (kd*)leaf_node->data;
-      if ( data->count <= MAX_COUNTS ) {
-	hist[data->count]++;
-      }
-    }
-    if ( tree_node->Tp != NULL ) {
-      leaf_node = tree_node->Tp;
-      data = (kd*)leaf_node->data;
-      if ( data->count <= MAX_COUNTS ) {
-	hist[data->count]++;
+    count_hist( kmers, hist, MAX_COUNTS );
+    if ( db_out != NULL ) {
+      fprintf( stderr, "[Writing kmer count database]\n" );
+      if ( write_kmer_db( kmers, db_out, 0 ) != 0 ) {
+	fprintf( stderr, "ERROR: Can't write kmer count database %s\n",
+		 db_out );
+	exit( 1 );
       }
     }
   }
+  fprintf( stderr, "[Writing histogram]\n" );
+  print_hist( hist );
+  free( hist );
+  free_KSP( kmers );
+  
 }
 
-void increment_kmer_count( klnP kmer ) {
-  kd* data;
-  data = (kd*)kmer->data;
-  if ( data->count < MAX_COUNTS ) {
-    data->count++;
+/* Writes hist[0..MAX_COUNTS-1], one count per line */
+void print_hist( size_t* hist ) {
+  size_t i;
+  for( i = 0; i < MAX_COUNTS; i++ ) {
+    printf( "%lu %lu\n", i, hist[i] );
   }
 }
 
@@ -1,3 +1,8 @@
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "file_io.h"
 
 ChrP newSeq( void ) {
@@ -19,95 +24,242 @@ FILE * fileOpen(const char *name, char access_mode[]) {
   return f;
 }
 
-/* gz_read_next_fasta
-   args 1. gzFile pointer to file to be read
-        2. ChrP to put the sequence
-   returns: FALSE (0) if no problem
-            non-zero if there is a problem
-*/
-int gz_read_next_fasta( gzFile genome_file, ChrP chr ) {
-  char c;
-  size_t i;
-  c = gzgetc( genome_file );
-    if ( c == EOF ) return -1;
-    if ( c != '>' ) return -1;
+/* The plain and gzipped fasta readers read the file in big blocks
+   into a buffer of their own, find line ends and headers in there
+   with memchr, and copy whole lines out. Reading a record reads
+   ahead of it, so each stream's buffer is kept (found again by the
+   stream pointer) until the reader gets to the end of the stream.
+   A file should be read to the end, till the reader returns
+   non-zero, before it's closed. */
+#define FA_BLOCK (1 << 20)
+
+typedef struct fasta_buf {
+  void* fp;
+  int gz;
+  char* buf;    // FA_BLOCK bytes
+  size_t pos;   // next byte to look at
+  size_t end;   // bytes in buf
+  int at_eof;   // the stream had nothing more to give
+  z_off_t tell; // gztell of the stream after the last read
+  struct fasta_buf* next;
+} FaBuf;
+
+static FaBuf* fa_bufs = NULL; // every stream being read
+static pthread_mutex_t fa_bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns: the buffer of stream fp, a new one if it hasn't got one
+   or if the one it has was for a stream that's gone (a new stream
+   that got the same pointer) */
+static FaBuf* fa_buf( void* fp, int gz ) {
+  FaBuf* b;
+
+  pthread_mutex_lock( &fa_bufs_lock );
+  for( b = fa_bufs; b != NULL; b = b->next ) {
+    if ( b->fp == fp ) {
+      break;
+    }
+  }
+  if ( b == NULL ) {
+    b = (FaBuf*)malloc(sizeof(FaBuf));
+    if ( (b == NULL) ||
+	 ((b->buf = (char*)malloc(sizeof(char) * FA_BLOCK)) == NULL) ) {
+      fprintf( stderr, "ERROR: Cannot allocate fasta read buffer\n" );
+      exit( 1 );
+    }
+    b->fp = fp;
+    b->gz = gz;
+    b->pos = b->end = 0;
+    b->at_eof = 0;
+    b->tell = 0;
+    b->next = fa_bufs;
+    fa_bufs = b;
+  }
+  else if ( (gz && (gztell( (gzFile)fp ) != b->tell)) ||
+	    (!gz && b->at_eof && !feof( (FILE*)fp )) ) {
+    b->pos = b->end = 0;
+    b->at_eof = 0;
+    b->tell = 0;
+  }
+  pthread_mutex_unlock( &fa_bufs_lock );
+  return b;
+}
 
-  // get id
-  i = 0;
-  while( (!isspace( c=gzgetc( genome_file ) ) &&
-	  (i < MAX_ID_LEN) ) ) {
-    if ( c == EOF ) {
-      return 0;
-    }
-    chr->id[i] = c;
-    i++;
-    if ( i == MAX_ID_LEN ) {
-      //id is too long - truncate it
-      chr->id[i] = '\0';
-    }
-  }
-  chr->id[i] = '\0';
+/* Frees b, once its stream is done */
+static void fa_buf_done( FaBuf* b ) {
+  FaBuf** p;
 
-  // everything else on this line is description, if there is anything
-  if ( c == '\n' ) {
+  pthread_mutex_lock( &fa_bufs_lock );
+  for( p = &fa_bufs; *p != b; p = &(*p)->next )
     ;
+  *p = b->next;
+  pthread_mutex_unlock( &fa_bufs_lock );
+  free( b->buf );
+  free( b );
+}
+
+/* Moves what's left in b to the start and reads more after it.
+   Returns: the number of bytes read, 0 at the end of the stream */
+static size_t fa_fill( FaBuf* b ) {
+  size_t n;
+  int got;
+
+  if ( b->at_eof ) {
+    return 0;
   }
-  else { // not end of line, so skip past the stupid whitespace...
-    while( (c != '\n') &&
-	   (isspace(c)) ) {
-      c = gzgetc( genome_file );
-    }
-    ///...everthing else is description
-    i = 0;
-    gzungetc( c, genome_file );
-    while ( c != '\n' ) {
-      c = gzgetc( genome_file );
-    }
+  memmove( b->buf, &b->buf[b->pos], b->end - b->pos );
+  b->end -= b->pos;
+  b->pos = 0;
+  if ( b->gz ) {
+    got = gzread( (gzFile)b->fp, &b->buf[b->end], FA_BLOCK - b->end );
+    n = (got > 0) ? (size_t)got : 0;
+    b->tell = gztell( (gzFile)b->fp );
+  }
+  else {
+    n = fread( &b->buf[b->end], 1, FA_BLOCK - b->end, (FILE*)b->fp );
   }
+  b->end += n;
+  b->at_eof = (n == 0);
+  return n;
+}
 
-  // read sequence
-  i = 0;
-  c = gzgetc( genome_file );
-  while ( ( c != '>' ) &&
-          ( c != EOF ) &&
-	  (i < MAX_SEQ_LEN) ) {
-    if ( isspace(c) ) {
-      ;
-    }
-    else {
-      c = toupper( c );
-      chr->seq[i++] = c;
+/* Returns: TRUE if there is at least one byte to look at in b */
+static inline int fa_more( FaBuf* b ) {
+  return (b->pos < b->end) || (fa_fill( b ) > 0);
+}
+
+/* Takes the whitespace out of the n characters of a sequence line
+   at s and makes them upper case, as the old reader did a character
+   at a time. Usually the only whitespace is the newline at the end,
+   so the loops that look at every character are simple enough for
+   the compiler to vectorize.
+   Returns: the number of bases left at s */
+static size_t squeeze_seq_line( char* s, size_t n ) {
+  size_t i, j;
+  int any_space = 0;
+
+  while( (n > 0) && isspace( (unsigned char)s[n-1] ) ) {
+    n--;
+  }
+  for( i = 0; i < n; i++ ) {
+    any_space |= ((unsigned char)s[i] <= ' ');
+    s[i] = ((unsigned char)(s[i] - 'a') < 26) ? s[i] - ('a' - 'A') : s[i];
+  }
+  if ( !any_space ) {
+    return n;
+  }
+  for( i = 0, j = 0; i < n; i++ ) {
+    if ( !isspace( (unsigned char)s[i] ) ) {
+      s[j++] = s[i];
     }
-    c = gzgetc( genome_file );
   }
-  chr->seq[i] = '\0';
+  return j;
+}
 
-  chr->len = i;
+/* Skips the rest of the line */
+static void fa_skip_line( FaBuf* b ) {
+  const char* nl;
+  while( fa_more( b ) ) {
+    nl = (const char*)memchr( &b->buf[b->pos], '\n', b->end - b->pos );
+    if ( nl != NULL ) {
+      b->pos = nl + 1 - b->buf;
+      return;
+    }
+    b->pos = b->end;
+  }
+}
 
-  if ( c == '>' ) {
-    gzungetc( '>', genome_file );
-    return 0;
+/* What read_next_fasta and gz_read_next_fasta do. eof_in_id is
+   what to return if the file ends in the middle of the id (the two
+   have always differed on that) */
+static int read_fasta_block( void* fp, int gz, ChrP chr, int eof_in_id ) {
+  FaBuf* b;
+  const char* nl;
+  const char* gt;
+  size_t i, n, avail;
+  int too_long;
+
+  b = fa_buf( fp, gz );
+  if ( !fa_more( b ) ) {
+    fa_buf_done( b );
+    return -1;
   }
+  if ( b->buf[b->pos++] != '>' ) return -1;
 
-  /* Run up against the sequence length limit so truncate it here,
-     wind through the genome_file filehandle, and return this guy */
-  if ( i == MAX_SEQ_LEN ) {
-    while ( (c != '>') &&
-	    (c != EOF) ) {
-      c = gzgetc( genome_file );
-    }
-    if ( c == '>' ) {
-      gzungetc( '>', genome_file );
-    }
-    fprintf( stderr, "%s is longer than allowed length: %d\n",
-	     chr->id, MAX_SEQ_LEN );
-    return 0;
+  /* The id is up to the first whitespace (or MAX_ID_LEN characters);
+     everything else on the line is description, and skipped */
+  while( (b->end - b->pos <= MAX_ID_LEN) && (fa_fill( b ) > 0) )
+    ;
+  avail = b->end - b->pos;
+  if ( avail > MAX_ID_LEN + 1 ) {
+    avail = MAX_ID_LEN + 1;
+  }
+  for( n = 0; (n < avail) && !isspace( (unsigned char)b->buf[b->pos + n] ); n++ )
+    ;
+  if ( n > MAX_ID_LEN ) {
+    n = MAX_ID_LEN;
   }
+  memcpy( chr->id, &b->buf[b->pos], n );
+  chr->id[n] = '\0';
+  if ( (n == avail) && (n < MAX_ID_LEN) ) { // the file ended in the id
+    b->pos = b->end;
+    return eof_in_id;
+  }
+  fa_skip_line( b );
 
+  /* Sequence lines go straight into chr->seq, up to the next '>' */
+  i = 0;
+  while( fa_more( b ) && (b->buf[b->pos] != '>') ) {
+    if ( i + 1 >= MAX_SEQ_LEN ) {
+      /* Run up against the sequence length limit, so truncate it
+	 here, wind through to the next one, and return this guy
+	 (if all that's left is whitespace, it wasn't too long) */
+      too_long = 0;
+      while( fa_more( b ) ) {
+	gt = (const char*)memchr( &b->buf[b->pos], '>', b->end - b->pos );
+	n = (gt == NULL) ? b->end - b->pos : (size_t)(gt - &b->buf[b->pos]);
+	for( avail = 0; avail < n; avail++ ) {
+	  too_long |= !isspace( (unsigned char)b->buf[b->pos + avail] );
+	}
+	b->pos += n;
+	if ( gt != NULL ) {
+	  break;
+	}
+      }
+      if ( too_long ) {
+	fprintf( stderr, "%s is longer than allowed length: %d\n",
+		 chr->id, MAX_SEQ_LEN );
+      }
+      break;
+    }
+    /* The rest of the line (or of the buffer, if the line goes on
+       past it), stopping short of any '>' */
+    nl = (const char*)memchr( &b->buf[b->pos], '\n', b->end - b->pos );
+    n = (nl == NULL) ? b->end - b->pos : (size_t)(nl + 1 - &b->buf[b->pos]);
+    gt = (const char*)memchr( &b->buf[b->pos], '>', n );
+    if ( gt != NULL ) {
+      n = gt - &b->buf[b->pos];
+    }
+    if ( n > MAX_SEQ_LEN - 1 - i ) {
+      n = MAX_SEQ_LEN - 1 - i;
+    }
+    memcpy( &chr->seq[i], &b->buf[b->pos], n );
+    b->pos += n;
+    i += squeeze_seq_line( &chr->seq[i], n );
+  }
+  chr->seq[i] = '\0';
+  chr->len = i;
   return 0;
 }
 
-
+/* gz_read_next_fasta
+   args 1. gzFile pointer to file to be read
+        2. ChrP to put the sequence
+   returns: FALSE (0) if no problem
+            non-zero if there is a problem
+*/
+int gz_read_next_fasta( gzFile genome_file, ChrP chr ) {
+  return read_fasta_block( genome_file, 1, chr, 0 );
+}
 
 /* read_next_fasta
    args 1. pointer to file to be read
@@ -116,85 +268,119 @@ int gz_read_next_fasta( gzFile genome_file, ChrP chr ) {
             non-zero if there is a problem
 */
 int read_next_fasta( FILE* genome_file, ChrP chr ) {
-  char c;
-  size_t i;
-  c = fgetc( genome_file );
-  if ( c == EOF ) return -1;
-  if ( c != '>' ) return -1;
+  return read_fasta_block( genome_file, 0, chr, -1 );
+}
 
-  // get id
-  i = 0;
-  while( (!isspace( c=fgetc( genome_file ) ) &&
-	  (i < MAX_ID_LEN) ) ) {
-    if ( c == EOF ) {
-      return -1;
-    }
-    chr->id[i] = c;
-    i++;
-    if ( i == MAX_ID_LEN ) {
-      //id is too long - truncate it
-      chr->id[i] = '\0';
-    }
+/* open_fasta_map
+   Args: FastaMapP fm - where to keep the map
+         const char* fn - plain fasta file
+   Returns: 0 if fn was mapped, -1 if it can't be
+*/
+int open_fasta_map( FastaMapP fm, const char* fn ) {
+  struct stat st;
+  void* map;
+  int fd;
+
+  fd = open( fn, O_RDONLY );
+  if ( fd < 0 ) {
+    return -1;
+  }
+  if ( (fstat( fd, &st ) != 0) || !S_ISREG( st.st_mode ) ) {
+    close( fd );
+    return -1;
+  }
+  fm->size = (size_t)st.st_size;
+  fm->off  = 0;
+  if ( fm->size == 0 ) { // can't map nothing; there are no records
+    fm->data = NULL;
+    close( fd );
+    return 0;
+  }
+  map = mmap( NULL, fm->size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd ); // the mapping stays
+  if ( map == MAP_FAILED ) {
+    return -1;
+  }
+  /* It's read front to back once, so read well ahead and let the
+     pages go behind */
+  madvise( map, fm->size, MADV_SEQUENTIAL );
+  fm->data = (const char*)map;
+  return 0;
+}
+
+/* next_fasta_view
+   Args: FastaMapP fm - map from open_fasta_map
+         FastaViewP fv - gets the views of the next record
+   Returns: FALSE (0) if there was one, non-zero when done, like
+            read_next_fasta. The id is what read_next_fasta would
+            put in chr->id. The sequence runs up to the next line
+            that starts with '>', and isn't cut at MAX_SEQ_LEN.
+*/
+int next_fasta_view( FastaMapP fm, FastaViewP fv ) {
+  const char* p;
+  const char* end = fm->data + fm->size;
+  const char* line;
+
+  if ( (fm->off >= fm->size) || (fm->data[fm->off] != '>') ) {
+    return -1;
   }
-  chr->id[i] = '\0';
+  p = fm->data + fm->off + 1;
 
-  // everything else on this line is description, if there is anything
-  if ( c == '\n' ) {
-    ;
+  /* The id is up to the first whitespace; the rest of the header
+     line is description */
+  fv->id = p;
+  while( (p < end) && !isspace( (unsigned char)*p ) ) {
+    p++;
   }
-  else { // not end of line, so skip past the stupid whitespace...
-    while( (c != '\n') &&
-	   (isspace(c)) ) {
-      c = fgetc( genome_file );
-    }
-    ///...everthing else is description
-    i = 0;
-    ungetc( c, genome_file );
-    while ( c != '\n' ) {
-      c = fgetc( genome_file );
-    }
+  fv->id_len = p - fv->id;
+  if ( fv->id_len > MAX_ID_LEN ) {
+    fv->id_len = MAX_ID_LEN;
   }
+  p = memchr( p, '\n', end - p );
+  p = (p == NULL) ? end : p + 1;
 
-  // read sequence
-  i = 0;
-  c = fgetc( genome_file );
-  while ( ( c != '>' ) &&
-          ( c != EOF ) &&
-	  (i < MAX_SEQ_LEN) ) {
-    if ( isspace(c) ) {
-      ;
+  /* The sequence ends at a '>' that starts a line. '>' almost never
+     turns up anywhere else, so memchr can go a block at a time */
+  fv->seq = p;
+  line = p;
+  while( (p < end) && ((p = memchr( p, '>', end - p )) != NULL) ) {
+    if ( (p == line) || (p[-1] == '\n') ) {
+      break;
     }
-    else {
-      c = toupper( c );
-      chr->seq[i++] = c;
-    }
-    c = fgetc( genome_file );
+    p++;
   }
-  chr->seq[i] = '\0';
-
-  chr->len = i;
+  if ( p == NULL ) {
+    p = end;
+  }
+  fv->seq_len = p - fv->seq;
+  fm->off = p - fm->data;
+  return 0;
+}
 
-  if ( c == '>' ) {
-    ungetc( '>', genome_file );
-    return 0;
+/* close_fasta_map
+   Unmaps fm's file; views from it can't be used after this
+*/
+void close_fasta_map( FastaMapP fm ) {
+  if ( fm->data != NULL ) {
+    munmap( (void*)fm->data, fm->size );
   }
+  fm->data = NULL;
+}
 
-  /* Run up against the sequence length limit so truncate it here,
-     wind through the genome_file filehandle, and return this guy */
-  if ( i == MAX_SEQ_LEN ) {
-    while ( (c != '>') &&
-	    (c != EOF) ) {
-      c = fgetc( genome_file );
-    }
-    if ( c == '>' ) {
-      ungetc( '>', genome_file );
-    }
-    fprintf( stderr, "%s is longer than allowed length: %d\n",
-	     chr->id, MAX_SEQ_LEN );
+/* fasta_size_hint
+   Returns: about how many bases the fasta file fn holds, judging
+   by its size on disk (gzipped files are taken to be 1/4 of their
+   real size). 0 if the file can't be looked at
+*/
+size_t fasta_size_hint( const char* fn ) {
+  struct stat st;
+  if ( stat( fn, &st ) != 0 ) {
     return 0;
   }
-
-  return 0;
+  if ( is_gz( fn ) ) {
+    return (size_t)st.st_size * 4;
+  }
+  return (size_t)st.st_size;
 }
 
 /* is_gz
@@ -1,3 +1,5 @@
+#ifndef FILE_IO_H
+#define FILE_IO_H
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -29,6 +31,27 @@ typedef struct sqp {
   size_t rlen;
 } Sqp;
 typedef struct sqp* SQP;
+
+/* A plain (not gzipped) fasta file mapped into memory. Its records
+   are handed out as views into the map, so nothing is copied and
+   there's no Chr to hold the biggest sequence */
+typedef struct fasta_map {
+  const char* data; // the whole file
+  size_t size;      // its length
+  size_t off;       // where the next record starts
+} FastaMap;
+typedef struct fasta_map* FastaMapP;
+
+/* One record of a FastaMap. The id is not null-terminated, and the
+   sequence is its lines as they are in the file, line ends and all
+   (the kmer iterator steps over those) */
+typedef struct fasta_view {
+  const char* id;
+  size_t id_len;
+  const char* seq;
+  size_t seq_len;
+} FastaView;
+typedef struct fasta_view* FastaViewP;
   
 ChrP newSeq( void );
 
@@ -40,14 +63,20 @@ FILE * fileOpen(const char *name, char access_mode[]);
         2. ChrP to put the sequence
    returns: FALSE (0) if no problem
             non-zero if there is a problem
+   Reads ahead of the record, in big blocks; the file should be read
+   with these alone, till one returns non-zero, before it's closed.
 */
 int read_next_fasta( FILE* genome_file, ChrP chr );
 int gz_read_next_fasta( gzFile genome_file, ChrP chr );
+int open_fasta_map( FastaMapP fm, const char* fn );
+int next_fasta_view( FastaMapP fm, FastaViewP fv );
+void close_fasta_map( FastaMapP fm );
 int is_gz( const char* fq_fn );
+size_t fasta_size_hint( const char* fn );
 int read_next_fastqs( FILE* ffq, FILE* rfq, SQP fqpair );
 int gz_read_next_fastqs( gzFile gzffq, gzFile gzrfq, SQP fqpair );
 int read_fastq( FILE* fastq, char id[],
 		char seq[], char qual[], size_t* len );
 int gzread_fastq( gzFile fastq, char id[],
 		  char seq[], char qual[], size_t* len );
-
+#endif
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include "kmer.h"
+#include "file_io.h"
+#include "kmer_db.h"
+
+#define MAX_COUNTS (511)
+
+void help( void ) {
+  printf( "kmer-db-merge [-o <merged db>] [-p <presence file>] [-n <sharing file>] <db> <db> ...\n" );
+  printf( " Merges kmer count databases (from fasta-hkc -w or fasta-kmer-spectrum -w),\n" );
+  printf( " for example from different samples, reading each straight through.\n" );
+  printf( " Writes the joint histogram (of counts summed over all inputs) to stdout.\n" );
+  printf( " -o writes the merged counts to a new database.\n" );
+  printf( " -p writes each kmer, its merged count, and which inputs have it, as a\n" );
+  printf( " hex bitset with input 1 in the lowest bit.\n" );
+  printf( " -n writes how many kmers are in exactly 1, 2, ... of the inputs.\n" );
+  exit( 0 );
+}
+
+/* Writes presence as hex, the last input's bits first */
+static void write_presence( FILE* fp, const uint64_t* presence, int n_srcs ) {
+  int d;
+  for( d = (n_srcs + 3) / 4 - 1; d >= 0; d-- ) {
+    fputc( "0123456789abcdef"[ (presence[d / 16] >> (4 * (d % 16))) & 15 ],
+	   fp );
+  }
+}
+
+int main ( int argc, char* argv[] ) {
+  extern char* optarg;
+  extern int optind;
+
+  int ich, s, n_srcs, n_words;
+  size_t i, k, n_merged, count, n_present;
+  size_t hist[MAX_COUNTS];
+  size_t* sharing;
+  uint32_t flags = 0;
+  pkmer kmer;
+  uint64_t* presence;
+  char* kmer_str;
+  char* merged_fn   = NULL;
+  char* presence_fn = NULL;
+  char* sharing_fn  = NULL;
+  FILE* presence_fp = NULL;
+  FILE* sharing_fp;
+  KDBP* dbs;
+  KDBMergeP m;
+  KDBWriterP w = NULL;
+
+  while( (ich=getopt( argc, argv, "ho:p:n:" )) != -1 ) {
+    switch(ich) {
+    case 'o' :
+      merged_fn = optarg;
+      break;
+    case 'p' :
+      presence_fn = optarg;
+      break;
+    case 'n' :
+      sharing_fn = optarg;
+      break;
+    default :
+      help();
+    }
+  }
+  n_srcs = argc - optind;
+  if ( n_srcs < 1 ) {
+    help();
+  }
+
+  dbs = (KDBP*)malloc(sizeof(KDBP) * n_srcs);
+  for( s = 0; s < n_srcs; s++ ) {
+    dbs[s] = open_kmer_db( argv[optind + s] );
+    if ( dbs[s] == NULL ) {
+      fprintf( stderr, "ERROR: Can't read kmer count database %s\n",
+	       argv[optind + s] );
+      exit( 1 );
+    }
+    if ( dbs[s]->k != dbs[0]->k ) {
+      fprintf( stderr, "ERROR: %s has k = %lu, but %s has k = %lu\n",
+	       argv[optind + s], dbs[s]->k, argv[optind], dbs[0]->k );
+      exit( 1 );
+    }
+    if ( dbs[s]->hdr->flags & KDB_ONLY_REPEATS ) {
+      fprintf( stderr, "WARNING: %s has no kmers seen once\n",
+	       argv[optind + s] );
+    }
+    flags |= dbs[s]->hdr->flags;
+    kdb_sequential( dbs[s] );
+  }
+  k = dbs[0]->k;
+  n_words = (n_srcs + 63) / 64;
+  presence = (uint64_t*)malloc(sizeof(uint64_t) * n_words);
+  sharing = (size_t*)calloc( n_srcs + 1, sizeof(size_t) );
+  kmer_str = (char*)malloc(sizeof(char) * (k + 1));
+  kmer_str[k] = '\0';
+
+  /* The merged database has to know how many kmers it'll have
+     before it can be laid out, so that takes a pass of its own */
+  if ( merged_fn != NULL ) {
+    fprintf( stderr, "[Counting merged kmers]\n" );
+    n_merged = 0;
+    m = init_kdb_merge( dbs, n_srcs );
+    while( next_kdb_merged( m, &kmer, &count, NULL ) ) {
+      n_merged++;
+    }
+    free_kdb_merge( m );
+    w = init_kdb_writer( merged_fn, k, n_merged, flags );
+    if ( w == NULL ) {
+      fprintf( stderr, "ERROR: Can't write kmer count database %s\n",
+	       merged_fn );
+      exit( 1 );
+    }
+  }
+  if ( presence_fn != NULL ) {
+    presence_fp = fileOpen( presence_fn, "w" );
+    if ( presence_fp == NULL ) {
+      exit( 1 );
+    }
+  }
+
+  fprintf( stderr, "[Merging %d kmer count databases]\n", n_srcs );
+  memset( hist, 0, sizeof(size_t) * MAX_COUNTS );
+  m = init_kdb_merge( dbs, n_srcs );
+  while( next_kdb_merged( m, &kmer, &count, presence ) ) {
+    if ( count < MAX_COUNTS ) {
+      hist[count]++;
+    }
+    n_present = 0;
+    for( s = 0; s < n_words; s++ ) {
+      n_present += __builtin_popcountll( presence[s] );
+    }
+    sharing[n_present]++;
+    if ( w != NULL ) {
+      kdb_writer_add( w, kmer, count );
+    }
+    if ( presence_fp != NULL ) {
+      pkmer2kmer( kmer, k, kmer_str );
+      fprintf( presence_fp, "%s\t%lu\t", kmer_str, count );
+      write_presence( presence_fp, presence, n_srcs );
+      fputc( '\n', presence_fp );
+    }
+  }
+  free_kdb_merge( m );
+
+  if ( (w != NULL) && (finish_kdb_writer( w ) != 0) ) {
+    fprintf( stderr, "ERROR: Can't write kmer count database %s\n",
+	     merged_fn );
+    exit( 1 );
+  }
+  if ( presence_fp != NULL ) {
+    fclose( presence_fp );
+  }
+  if ( sharing_fn != NULL ) {
+    sharing_fp = fileOpen( sharing_fn, "w" );
+    if ( sharing_fp == NULL ) {
+      exit( 1 );
+    }
+    for( s = 1; s <= n_srcs; s++ ) {
+      fprintf( sharing_fp, "%d %lu\n", s, sharing[s] );
+    }
+    fclose( sharing_fp );
+  }
+
+  fprintf( stderr, "[Writing histogram]\n" );
+  for( i = 0; i < MAX_COUNTS; i++ ) {
+    printf( "%lu %lu\n", i, hist[i] );
+  }
+
+  for( s = 0; s < n_srcs; s++ ) {
+    close_kmer_db( dbs[s] );
+  }
+  free( dbs );
+  free( presence );
+  free( sharing );
+  free( kmer_str );
+  return 0;
+}
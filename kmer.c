@@ -3,23 +3,1815 @@
 #include <ctype.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "kmer.h"
+#include "kmer_hash.h"
+#include "kmer_sketch.h"
+
+/* Lookup table for the 2-bit base codes. Everything that isn't
+   A, C, G, or T (upper or lower case) maps to 4 */
+const unsigned char base2bits[256] = {
+  [0 ... 255] = BASE_BAD,
+  ['A'] = 0, ['C'] = 1, ['G'] = 2, ['T'] = 3,
+  ['a'] = 0, ['c'] = 1, ['g'] = 2, ['t'] = 3,
+  [' '] = BASE_SKIP, ['\t'] = BASE_SKIP, ['\n'] = BASE_SKIP,
+  ['\v'] = BASE_SKIP, ['\f'] = BASE_SKIP, ['\r'] = BASE_SKIP
+};
+
+/* The 2-bit code of the base at position pos (0 is the first,
+   most significant, base) of a packed kmer of length k */
+static inline unsigned int pkmer_base( pkmer kmer, size_t k, size_t pos ) {
+  return (unsigned int)(kmer >> (2 * (k - 1 - pos))) & 3;
+}
+
+/* Index into ks->ka for the first ks->k_ar_size bases of kmer */
+static inline size_t pkmer_ka_inx( pkmer kmer, KSP ks ) {
+  return (size_t)(kmer >> (2 * (ks->k - ks->k_ar_size)));
+}
+
+/* Notes that ka[inx] is getting a tree. Atomic, since threads
+   building at once can share a word of ka_occ */
+static inline void mark_ka( KSP ks, size_t inx ) {
+  uint64_t bit = (uint64_t)1 << (inx % 64);
+  if ( !(__atomic_fetch_or( &ks->ka_occ[inx / 64], bit,
+			    __ATOMIC_RELAXED ) & bit) ) {
+    __atomic_fetch_add( &ks->ka_used, 1, __ATOMIC_RELAXED );
+  }
+}
+
+static const KSpec* find_kspec( size_t k );
+
+/* Notes a new node at level (0 is right below the array part) for
+   ksp_stats. Only called when a node is made, so the atomic add
+   is cheap next to the rest of that */
+static inline void count_level( KSP ks, size_t level ) {
+  __atomic_fetch_add( &ks->level_nodes[level], 1, __ATOMIC_RELAXED );
+}
+
+/* Tree and leaf nodes, from a KSP's pools */
+static inline ktnP new_ktn( NpoolP pool ) {
+  ktnP new_ktn;
+  new_ktn = (ktnP)pool_alloc( pool );
+  new_ktn->Ap = NULL;
+  new_ktn->Cp = NULL;
+  new_ktn->Gp = NULL;
+  new_ktn->Tp = NULL;
+  return new_ktn;
+}
+
+static inline klnP new_kln( KSP ks ) {
+  klnP new_kln;
+  new_kln = (klnP)pool_alloc( &ks->kln_pool );
+  new_kln->data = NULL;
+  return new_kln;
+}
+
+/* Chain nodes (see kcn) are told apart by a tag bit in the pointer */
+#define IS_CHAIN( p ) ((uintptr_t)(p) & CHAIN_TAG)
+#define CHAIN_OF( p ) ((kcnP)((uintptr_t)(p) & ~(uintptr_t)CHAIN_TAG))
+#define TAG_CHAIN( c ) ((void*)((uintptr_t)(c) | CHAIN_TAG))
+
+/* A chain node from pool (one for tree nodes) for the len bases in
+   label, with next below it */
+static inline kcnP new_kcn( KSP ks, NpoolP pool, pkmer label, size_t len,
+			    void* next ) {
+  kcnP new_kcn;
+  new_kcn = (kcnP)pool_alloc( pool );
+  new_kcn->label = label;
+  new_kcn->len = (uint32_t)len;
+  new_kcn->next = next;
+  __atomic_fetch_add( &ks->n_chains, 1, __ATOMIC_RELAXED );
+  return new_kcn;
+}
+
+/* The len bases of kmer from position pos on, packed */
+static inline pkmer pkmer_bases( pkmer kmer, size_t k, size_t pos,
+				 size_t len ) {
+  return (kmer >> (2 * (k - pos - len))) & (((pkmer)1 << (2 * len)) - 1);
+}
+
+/* Position of the highest set bit of x, which isn't 0 */
+static inline size_t pkmer_top_bit( pkmer x ) {
+#if MAX_K <= 32
+  return 63 - __builtin_clzll( x );
+#else
+  uint64_t hi = (uint64_t)(x >> 64);
+  if ( hi != 0 ) {
+    return 127 - __builtin_clzll( hi );
+  }
+  return 63 - __builtin_clzll( (uint64_t)x );
+#endif
+}
 
 KSP init_KSP( int k ) {
+  return init_KSP_opts( k, NULL );
+}
+
+/* choose_k_ar_size
+   Picks how many leading bases of each kmer the array part
+   handles. With no idea of the size, that's K_AR_SIZE. Otherwise,
+   it's just wide enough to have about one slot per expected kmer,
+   so small jobs get a small array. Either way at least one base
+   is left for the tree part.
+*/
+static size_t choose_k_ar_size( size_t k, size_t expected ) {
+  size_t k_ar_size = K_AR_SIZE;
+  if ( expected > 0 ) {
+    k_ar_size = 1;
+    while( (k_ar_size < K_AR_SIZE) &&
+	   (((size_t)1 << (2 * k_ar_size)) < expected) ) {
+      k_ar_size++;
+    }
+  }
+  if ( k_ar_size > k - 1 ) {
+    k_ar_size = (k > 1) ? k - 1 : 0;
+  }
+  return k_ar_size;
+}
+
+/* Singleton screen: a blocked bloom filter. Each kmer's bits are
+   all in one cache line block, so a lookup is one cache miss */
+static void init_bloom( KSP ks, size_t bytes ) {
+  size_t blocks = 1;
+  while( 2 * blocks * BLOOM_BLOCK * sizeof(uint64_t) <= bytes ) {
+    blocks *= 2;
+  }
+  if ( posix_memalign( (void**)&ks->bloom, 64,
+		       blocks * BLOOM_BLOCK * sizeof(uint64_t) ) ) {
+    fprintf( stderr, "ERROR: Cannot allocate bloom filter of %lu bytes\n",
+	     bytes );
+    exit( 1 );
+  }
+  memset( ks->bloom, 0, blocks * BLOOM_BLOCK * sizeof(uint64_t) );
+  ks->bloom_mask = blocks - 1;
+}
+
+/* Murmur3 finalizer */
+static inline uint64_t mix64( uint64_t h ) {
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* All bits of the packed kmer mixed into 64. The high half of a
+   128-bit kmer is mixed on its own first: just multiplying it in
+   only carries its changes up, so kmers that differ only near the
+   top of both halves could come out the same */
+static inline uint64_t bloom_hash( pkmer kmer ) {
+#if MAX_K <= 32
+  return mix64( kmer );
+#else
+  return mix64( (uint64_t)kmer ^ mix64( (uint64_t)(kmer >> 64) ) );
+#endif
+}
+
+/* Block of kmer, and its BLOOM_HASHES bits in there: 9 bits of the
+   hash each, from the top down, since the low bits pick the block */
+#define BLOOM_BIT( h, j ) (((h) >> (64 - 9 * ((j) + 1))) & 511)
+
+/* Returns: TRUE if kmer may have been seen before (all its bits are
+   set), FALSE if it surely hasn't */
+static inline int bloom_test( KSP ks, pkmer kmer ) {
+  uint64_t h = bloom_hash( kmer );
+  uint64_t* block = &ks->bloom[ (h & ks->bloom_mask) * BLOOM_BLOCK ];
+  size_t j, bit;
+  for( j = 0; j < BLOOM_HASHES; j++ ) {
+    bit = BLOOM_BIT( h, j );
+    if ( !(block[bit >> 6] & ((uint64_t)1 << (bit & 63))) ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Sets kmer's bits. Returns: TRUE if they were all set already.
+   With mt TRUE, the block is locked while its bits are looked at and
+   set, so that of threads adding the same new kmer at once, exactly
+   one gets FALSE (its bits are in more than one word, so atomic ORs
+   of each wouldn't do). The lock is only held for a few
+   instructions. */
+static inline int bloom_test_and_set( KSP ks, pkmer kmer, int mt ) {
+  uint64_t h = bloom_hash( kmer );
+  uint64_t* block = &ks->bloom[ (h & ks->bloom_mask) * BLOOM_BLOCK ];
+  char* lock = &ks->bloom_locks[ (h & ks->bloom_mask) % BLOOM_LOCKS ];
+  uint64_t bit_mask;
+  size_t j, bit;
+  int seen = 1;
+  if ( mt ) {
+    while( __atomic_test_and_set( lock, __ATOMIC_ACQUIRE ) ) {
+      sched_yield(); // the holder may be off the CPU
+    }
+  }
+  for( j = 0; j < BLOOM_HASHES; j++ ) {
+    bit = BLOOM_BIT( h, j );
+    bit_mask = (uint64_t)1 << (bit & 63);
+    if ( !(block[bit >> 6] & bit_mask) ) {
+      block[bit >> 6] |= bit_mask;
+      seen = 0;
+    }
+  }
+  if ( mt ) {
+    __atomic_clear( lock, __ATOMIC_RELEASE );
+  }
+  return seen;
+}
+
+/* set_default_KSPOpts
+   Fills in opts with what init_KSP uses: a KSP_TRIE with leaf nodes
+   (no counting mode) and no size hint. Counting mode KSPs for small
+   enough k are made KSP_DENSE
+*/
+void set_default_KSPOpts( KSPOptsP opts ) {
+  opts->backend    = KSP_TRIE;
+  opts->expected   = 0;
+  opts->count_bits = 0;
+  opts->dense_bytes = DENSE_MAX_BYTES;
+  opts->threads    = 1;
+  opts->sketch_bytes = SKETCH_BYTES;
+  opts->bloom_bytes = 0;
+  opts->compress   = 0;
+}
+
+/* init_KSP_opts
+   Args: int k - length of kmers
+         KSPOptsP opts - which backend and how big; NULL for the
+                         defaults (see set_default_KSPOpts)
+   Returns: pointer to a new, empty kmer structure
+   The KSP_HASH and KSP_DENSE backends and the counting mode of
+   KSP_TRIE (opts->count_bits of 8, 16, or 32) only support the
+   packed counting calls: increment_or_insert_pkmer, get_pkmer_count,
+   remove_pkmer, and count_hist. They have no leaf nodes to hang
+   other data on.
+   8-bit counters take a quarter of the memory of 32-bit ones and
+   lose nothing: a kmer seen more than 255 times has the rest of
+   its count kept in a small hash table on the side.
+   When every possible kmer's counter fits in opts->dense_bytes, a
+   counting mode KSP_TRIE is made a KSP_DENSE instead: no tree at
+   all, just one array indexed by the packed kmer.
+   A KSP_SKETCH takes opts->sketch_bytes of memory up front and
+   never more. Its counts are estimates (see kmer_sketch.h) and it
+   can't list its kmers, so count_hist and remove_pkmer don't work
+   on it.
+   With opts->bloom_bytes, the first sighting of each kmer only
+   goes in a bloom filter and the kmer is added (with a count of 2)
+   on its second. Most kmers of noisy data are seen once, so this
+   keeps most of them out of the tree or table. get_pkmer_count
+   and count_hist still see them, as far as the filter's false
+   positives go: those are counted one higher than they should be.
+   With opts->compress, a counting mode KSP_TRIE keeps each run of
+   tree levels below which there is only one kmer (or one shared
+   stretch of kmers) as a single chain node, split only when a
+   second branch shows up. For big k that's most of the tree: far
+   fewer nodes, and fewer pointers to follow for each kmer. The
+   _mt calls take a lock on such a KSP; build it partitioned
+   (init_kscatter) to use threads.
+*/
+KSP init_KSP_opts( int k, const KSPOptsP opts ) {
   KSP ks;
-  size_t i, len;
-  len = 1<<(K_AR_SIZE*2); // Length of the array for the array part
+  int i;
   ks = (KSP)malloc(sizeof(Kmers));
-  
-  ks->k_ar_size = K_AR_SIZE;
+
   ks->k = k;
-  ks->ka = (ktnP*)malloc(sizeof(ktnP) * len);
-  for( i = 0; i < len; i++ ) {
-    ks->ka[i] = NULL;
+  ks->k_ar_size = 0;
+  ks->ka_len = 0;
+  ks->ka = NULL;
+  ks->ka_occ = NULL;
+  ks->ka_used = 0;
+  memset( ks->level_nodes, 0, sizeof(ks->level_nodes) );
+  ks->compress = 0;
+  ks->n_chains = 0;
+  ks->spec = find_kspec( k );
+  ks->ht = NULL;
+  ks->cms = NULL;
+  ks->ovf = NULL;
+  ks->bloom = NULL;
+  ks->bloom_mask = 0;
+  memset( ks->bloom_locks, 0, sizeof(ks->bloom_locks) );
+  ks->bloom_new = 0;
+  ks->bloom_promoted = 0;
+  ks->backend = (opts == NULL) ? KSP_TRIE : opts->backend;
+  ks->count_bits = (opts == NULL) ? 0 : opts->count_bits;
+  if ( (ks->count_bits != 0) && (ks->count_bits != 8) &&
+       (ks->count_bits != 16) && (ks->count_bits != 32) ) {
+    fprintf( stderr, "ERROR: Counters must be 8, 16, or 32 bits, not %d\n",
+	     ks->count_bits );
+    exit( 1 );
+  }
+  ks->owns_data = 0;
+  ks->dense = NULL;
+  ks->dense_len = 0;
+  ks->n_threads = (opts == NULL) ? 1 : opts->threads;
+  if ( ks->n_threads < 1 ) {
+    ks->n_threads = 1;
+  }
+  ks->thread_pools = (NpoolP)malloc(sizeof(Npool) * 2 * ks->n_threads);
+  for( i = 0; i < ks->n_threads; i++ ) {
+    init_pool( &ks->thread_pools[2*i], sizeof(ktn) );
+    init_pool( &ks->thread_pools[2*i + 1], 4 * ks->count_bits / 8 );
+  }
+  pthread_mutex_init( &ks->lock, NULL );
+  init_pool( &ks->ktn_pool, sizeof(ktn) );
+  init_pool( &ks->kln_pool, sizeof(kln) );
+  init_pool( &ks->data_pool, sizeof(size_t) );
+  init_pool( &ks->cnt_pool, 4 * ks->count_bits / 8 );
+
+  if ( (opts != NULL) && (opts->bloom_bytes > 0) ) {
+    init_bloom( ks, opts->bloom_bytes );
+  }
+
+  if ( ks->backend == KSP_HASH ) {
+    ks->ht = init_kht( opts->expected );
+    return ks;
+  }
+  if ( ks->backend == KSP_SKETCH ) {
+    free( ks->bloom ); // a sketch is already fixed size
+    ks->bloom = NULL;
+    if ( ks->count_bits == 0 ) {
+      ks->count_bits = 16;
+    }
+    ks->cms = init_kcms( opts->sketch_bytes, ks->count_bits );
+    return ks;
+  }
+  if ( ks->count_bits == 8 ) {
+    ks->ovf = init_kht( 0 );
+  }
+
+  if ( (ks->backend == KSP_TRIE) && ks->count_bits &&
+       (2 * k < sizeof(size_t) * CHAR_BIT) &&
+       (((size_t)1 << (2 * k)) <= opts->dense_bytes / (ks->count_bits / 8)) ) {
+    ks->backend = KSP_DENSE;
+  }
+  if ( ks->backend == KSP_DENSE ) {
+    free( ks->bloom ); // nothing to save when every kmer has a counter
+    ks->bloom = NULL;
+    if ( ks->count_bits == 0 ) {
+      ks->count_bits = 32;
+    }
+    ks->dense_len = (size_t)1 << (2 * k);
+    /* Like the array part below, untouched pages stay untouched */
+    ks->dense = calloc( ks->dense_len, ks->count_bits / 8 );
+    if ( ks->dense == NULL ) {
+      fprintf( stderr, "ERROR: Cannot allocate %lu kmer counters\n",
+	       ks->dense_len );
+      exit( 1 );
+    }
+    return ks;
+  }
+
+  ks->compress = (opts != NULL) && opts->compress && ks->count_bits;
+  ks->k_ar_size = choose_k_ar_size( k, (opts == NULL) ? 0 : opts->expected );
+  ks->ka_len = (size_t)1 << (ks->k_ar_size * 2);
+  /* Big callocs come straight from fresh (anonymous mmap) pages that
+     are already zero, so only the slots that get used are ever
+     touched. No loop setting everything to NULL. */
+  ks->ka = (ktnP*)calloc( ks->ka_len, sizeof(ktnP) );
+  if ( ks->ka == NULL ) {
+    fprintf( stderr, "ERROR: Cannot allocate kmer array of %lu slots\n",
+	     ks->ka_len );
+    exit( 1 );
+  }
+  ks->ka_occ = (uint64_t*)calloc( (ks->ka_len + 63) / 64, sizeof(uint64_t) );
+  if ( ks->ka_occ == NULL ) {
+    fprintf( stderr, "ERROR: Cannot allocate occupancy bitmap of %lu slots\n",
+	     ks->ka_len );
+    exit( 1 );
+  }
+  return ks;
+}
+
+/* free_KSP
+   Gives back all the memory of ks: the array part, the hash table,
+   and every tree and leaf node, a slab at a time. Data that the
+   caller hung on leaf nodes (kln->data) is not freed; counts from
+   increment_or_insert_pkmer are.
+*/
+void free_KSP( KSP ks ) {
+  int i;
+  if ( ks == NULL ) {
+    return;
+  }
+  for( i = 0; i < 2 * ks->n_threads; i++ ) {
+    free_pool( &ks->thread_pools[i] );
+  }
+  free( ks->thread_pools );
+  pthread_mutex_destroy( &ks->lock );
+  free_pool( &ks->ktn_pool );
+  free_pool( &ks->kln_pool );
+  free_pool( &ks->data_pool );
+  free_pool( &ks->cnt_pool );
+  free_kht( ks->ht );
+  free_kht( ks->ovf );
+  free_kcms( ks->cms );
+  free( ks->bloom );
+  free( ks->dense );
+  free( ks->ka );
+  free( ks->ka_occ );
+  free( ks );
+}
+
+/* Counting mode: the last level of the tree is a block of four
+   counters (one per final base) of ks->count_bits bits each. Zero
+   means the kmer is not there. Counters stick at their max. The
+   same calls work on the KSP_DENSE array, indexed by packed kmer */
+static inline size_t cnt_get( KSP ks, void* cnts, size_t base ) {
+  switch( ks->count_bits ) {
+  case 8 :
+    return ((uint8_t*)cnts)[base];
+  case 16 :
+    return ((uint16_t*)cnts)[base];
+  default :
+    return ((uint32_t*)cnts)[base];
+  }
+}
+
+static inline void cnt_clear( KSP ks, void* cnts, size_t base ) {
+  switch( ks->count_bits ) {
+  case 8 :
+    ((uint8_t*)cnts)[base] = 0;
+    break;
+  case 16 :
+    ((uint16_t*)cnts)[base] = 0;
+    break;
+  default :
+    ((uint32_t*)cnts)[base] = 0;
+  }
+}
+
+static inline size_t cnt_increment( KSP ks, void* cnts, size_t base ) {
+  switch( ks->count_bits ) {
+  case 8 :
+    if ( ((uint8_t*)cnts)[base] < UINT8_MAX ) {
+      ((uint8_t*)cnts)[base]++;
+    }
+    return ((uint8_t*)cnts)[base];
+  case 16 :
+    if ( ((uint16_t*)cnts)[base] < UINT16_MAX ) {
+      ((uint16_t*)cnts)[base]++;
+    }
+    return ((uint16_t*)cnts)[base];
+  default :
+    if ( ((uint32_t*)cnts)[base] < UINT32_MAX ) {
+      ((uint32_t*)cnts)[base]++;
+    }
+    return ((uint32_t*)cnts)[base];
+  }
+}
+
+/* 8-bit counters keep exact counts anyway: a counter at UINT8_MAX
+   means the rest of the count, past UINT8_MAX, is in the overflow
+   table ks->ovf. Few kmers are ever seen that often, so the table
+   stays small and the common counts cost a byte each */
+static inline size_t cnt_count( KSP ks, void* cnts, size_t base,
+				pkmer kmer ) {
+  size_t count = cnt_get( ks, cnts, base );
+  if ( (count == UINT8_MAX) && (ks->ovf != NULL) ) {
+    count += kht_get( ks->ovf, kmer );
+  }
+  return count;
+}
+
+/* Adds one to the count past UINT8_MAX of kmer. shared => other
+   threads may be doing the same, so it takes ks->lock */
+static size_t ovf_increment( KSP ks, pkmer kmer, int shared ) {
+  size_t count;
+  if ( shared ) {
+    pthread_mutex_lock( &ks->lock );
+  }
+  count = UINT8_MAX + kht_increment( ks->ovf, kmer );
+  if ( shared ) {
+    pthread_mutex_unlock( &ks->lock );
+  }
+  return count;
+}
+
+/* cnt_increment, going on into ks->ovf once the counter is full.
+   shared => other threads may be adding to other counters of ks
+   (not this one) at the same time */
+static inline size_t cnt_add( KSP ks, void* cnts, size_t base,
+			      pkmer kmer, int shared ) {
+  if ( (ks->ovf != NULL) && (((uint8_t*)cnts)[base] == UINT8_MAX) ) {
+    return ovf_increment( ks, kmer, shared );
+  }
+  return cnt_increment( ks, cnts, base );
+}
+
+/* Zeroes a counter, and what it had in ks->ovf */
+static inline void cnt_remove( KSP ks, void* cnts, size_t base,
+			       pkmer kmer ) {
+  if ( (ks->ovf != NULL) && (((uint8_t*)cnts)[base] == UINT8_MAX) ) {
+    kht_remove( ks->ovf, kmer );
+  }
+  cnt_clear( ks, cnts, base );
+}
+
+static inline void* new_cnts( NpoolP pool ) {
+  void* cnts;
+  cnts = pool_alloc( pool );
+  memset( cnts, 0, pool->node_size );
+  return cnts;
+}
+
+/* Splits chain c, in *slot and starting at position pos of the
+   kmers under it, where a new kmer leaves it after same bases: a
+   tree node goes where the run branches, with what's left of the
+   run below it. Nodes come from pool.
+   Returns: the slot the new tree node is in */
+static void** split_chain( KSP ks, void** slot, kcnP c, size_t pos,
+			   size_t same, NpoolP pool ) {
+  ktnP branch;
+  void* tail;
+  size_t rest = c->len - same - 1; // bases of the run below the branch
+  unsigned int base = (unsigned int)(c->label >> (2 * rest)) & 3;
+
+  branch = new_ktn( pool );
+  count_level( ks, pos + same - ks->k_ar_size );
+  /* c itself is kept for the part above the branch, or else for
+     the part below it */
+  if ( same > 0 ) {
+    tail = (rest > 0) ?
+      TAG_CHAIN( new_kcn( ks, pool, pkmer_bases( c->label, c->len,
+						 same + 1, rest ),
+			  rest, c->next ) ) :
+      c->next;
+    c->label >>= 2 * (rest + 1);
+    c->len = same;
+    c->next = branch;
+    branch->np[base] = tail;
+    return &c->next;
+  }
+  if ( rest > 0 ) {
+    c->label = pkmer_bases( c->label, c->len, 1, rest );
+    c->len = rest;
+    branch->np[base] = TAG_CHAIN( c );
+  }
+  else {
+    branch->np[base] = c->next;
+    pool_free( pool, c );
+    __atomic_fetch_sub( &ks->n_chains, 1, __ATOMIC_RELAXED );
+  }
+  *slot = branch;
+  return slot;
+}
+
+/* find_cnts for a KSP with compress: the same walk, but a chain
+   node takes a whole run of bases in one step. A new kmer gets a
+   chain for all of its bases below the last branch it shares.
+   Returns: the slot the counter block is in, NULL if the kmer's
+            path isn't there (and nothing was to be added) */
+static void** find_cnts_slot_chained( pkmer kmer, KSP ks,
+				      NpoolP ktn_pool, NpoolP cnt_pool ) {
+  size_t kmer_pos, inx, same;
+  size_t last = ks->k - 1;
+  void** slot;
+  void* node;
+  kcnP c;
+  pkmer bases;
+
+  inx = pkmer_ka_inx( kmer, ks );
+  slot = (void**)&ks->ka[inx];
+  if ( (*slot == NULL) && (cnt_pool != NULL) ) {
+    mark_ka( ks, inx );
+  }
+  kmer_pos = ks->k_ar_size;
+  while( kmer_pos < last ) {
+    node = *slot;
+    if ( node == NULL ) {
+      if ( ktn_pool == NULL ) {
+	return NULL;
+      }
+      c = new_kcn( ks, ktn_pool, pkmer_bases( kmer, ks->k, kmer_pos,
+					      last - kmer_pos ),
+		   last - kmer_pos, NULL );
+      *slot = TAG_CHAIN( c );
+      slot = &c->next;
+      break;
+    }
+    if ( !IS_CHAIN( node ) ) {
+      slot = &((ktnP)node)->np[ pkmer_base( kmer, ks->k, kmer_pos ) ];
+      kmer_pos++;
+      continue;
+    }
+    c = CHAIN_OF( node );
+    bases = pkmer_bases( kmer, ks->k, kmer_pos, c->len );
+    if ( bases == c->label ) {
+      slot = &c->next;
+      kmer_pos += c->len;
+      continue;
+    }
+    if ( ktn_pool == NULL ) {
+      return NULL;
+    }
+    /* The first base that differs is the highest set pair of bits */
+    same = c->len - 1 - pkmer_top_bit( bases ^ c->label ) / 2;
+    slot = split_chain( ks, slot, c, kmer_pos, same, ktn_pool );
+    kmer_pos += same; // *slot is the branch node for this base
+  }
+  if ( (*slot == NULL) && (cnt_pool != NULL) ) {
+    *slot = new_cnts( cnt_pool );
+    count_level( ks, last - ks->k_ar_size );
+  }
+  return slot;
+}
+
+/* pkmer_base when k may be a constant: a kmer of k <= 32 is all in
+   the low word, so 64-bit shifts will do */
+static inline unsigned int kmer_base_k( pkmer kmer, size_t k, size_t pos ) {
+  if ( k <= 32 ) {
+    return (unsigned int)((uint64_t)kmer >> (2 * (k - 1 - pos))) & 3;
+  }
+  return pkmer_base( kmer, k, pos );
+}
+
+/* The walk of find_cnts (without compress) for kmers of length k.
+   Always inlined, so each caller that passes a constant k gets its
+   own copy with the shifts and the loop end worked out */
+static inline __attribute__((always_inline))
+void* find_cnts_k( pkmer kmer, KSP ks, NpoolP ktn_pool, NpoolP cnt_pool,
+		   const size_t k ) {
+  size_t kmer_pos, inx;
+  void** slot;
+
+  inx = (k <= 32) ? (size_t)((uint64_t)kmer >> (2 * (k - ks->k_ar_size))) :
+    pkmer_ka_inx( kmer, ks );
+  slot = (void**)&ks->ka[inx];
+  if ( (*slot == NULL) && (cnt_pool != NULL) ) {
+    mark_ka( ks, inx );
+  }
+  for( kmer_pos = ks->k_ar_size; kmer_pos < k - 1; kmer_pos++ ) {
+    if ( *slot == NULL ) {
+      if ( ktn_pool == NULL ) {
+	return NULL;
+      }
+      *slot = new_ktn( ktn_pool );
+      count_level( ks, kmer_pos - ks->k_ar_size );
+    }
+    slot = &((ktnP)*slot)->np[ kmer_base_k( kmer, k, kmer_pos ) ];
+  }
+  if ( (*slot == NULL) && (cnt_pool != NULL) ) {
+    *slot = new_cnts( cnt_pool );
+    count_level( ks, kmer_pos - ks->k_ar_size );
+  }
+  return *slot;
+}
+
+/* Walks down to the counter block for kmer in a counting mode
+   KSP_TRIE. Any missing nodes on the way are made from ktn_pool
+   and cnt_pool; if those are NULL, nothing is added.
+   Returns: the counter block, NULL if it isn't there (and nothing
+            was to be added) */
+static inline void* find_cnts( pkmer kmer, KSP ks,
+			       NpoolP ktn_pool, NpoolP cnt_pool ) {
+  void** slot;
+
+  if ( ks->compress ) {
+    slot = find_cnts_slot_chained( kmer, ks, ktn_pool, cnt_pool );
+    return (slot == NULL) ? NULL : *slot;
+  }
+  if ( ks->spec != NULL ) {
+    return ks->spec->find_cnts( kmer, ks, ktn_pool, cnt_pool );
+  }
+  return find_cnts_k( kmer, ks, ktn_pool, cnt_pool, ks->k );
+}
+
+/* next_canonical_kmer for kmers of length k <= 32, in 64-bit words
+   and with the iterator's state in registers until a kmer comes
+   out. Always inlined, like find_cnts_k */
+static inline __attribute__((always_inline))
+int next_kmer_k( KIterP it, pkmer* kmer, size_t* pos, const size_t k ) {
+  const uint64_t mask = (k == 32) ? ~(uint64_t)0 :
+    ((uint64_t)1 << (2 * k)) - 1;
+  const char* seq = it->seq;
+  size_t i = it->i, len = it->len, clean = it->clean;
+  size_t skipped = it->skipped;
+  uint64_t fwd = (uint64_t)it->fwd, rev = (uint64_t)it->rev, code;
+  int found = 0;
+
+  while( i < len ) {
+    code = base2bits[ (unsigned char)seq[ i++ ] ];
+    if ( code > 3 ) {
+      if ( code == BASE_SKIP ) {
+	skipped++;
+      }
+      else {
+	clean = 0;
+      }
+      continue;
+    }
+    fwd = ((fwd << 2) | code) & mask;
+    rev = (rev >> 2) | ((3 - code) << (2 * (k - 1)));
+    if ( ++clean >= k ) {
+      *kmer = rev < fwd ? rev : fwd;
+      *pos  = i - skipped - k;
+      found = 1;
+      break;
+    }
+  }
+  it->i       = i;
+  it->clean   = clean;
+  it->skipped = skipped;
+  it->fwd   = fwd;
+  it->rev   = rev;
+  return found;
+}
+
+/* Copies of the hot loops for each k in KSPEC_LIST, where the
+   compiler knows k. init_KSP_opts and init_kmer_iter pick them up
+   from kspecs; every other k takes the general code */
+#define KSPEC_LIST( X ) X( 21 ) X( 25 ) X( 27 ) X( 31 )
+
+#define KSPEC_FUNCS( K )						\
+  static void* find_cnts_##K( pkmer kmer, KSP ks,			\
+			      NpoolP ktn_pool, NpoolP cnt_pool ) {	\
+    return find_cnts_k( kmer, ks, ktn_pool, cnt_pool, K );		\
+  }									\
+  static int next_kmer_##K( KIterP it, pkmer* kmer, size_t* pos ) {	\
+    return next_kmer_k( it, kmer, pos, K );				\
+  }
+KSPEC_LIST( KSPEC_FUNCS )
+
+#define KSPEC_ENTRY( K ) { K, find_cnts_##K, next_kmer_##K },
+static const KSpec kspecs[] = { KSPEC_LIST( KSPEC_ENTRY ) };
+
+/* Returns: the specialized code for kmers of length k, NULL if
+   there isn't any */
+static const KSpec* find_kspec( size_t k ) {
+  size_t i;
+  for( i = 0; i < sizeof(kspecs) / sizeof(KSpec); i++ ) {
+    if ( kspecs[i].k == k ) {
+      return &kspecs[i];
+    }
+  }
+  return NULL;
+}
+
+/* The KSP part of increment_or_insert_pkmer, past the bloom filter */
+static size_t increment_pkmer_ksp( pkmer kmer, KSP ks ) {
+  klnP leaf;
+  if ( ks->backend == KSP_HASH ) {
+    return kht_increment( ks->ht, kmer );
+  }
+  if ( ks->backend == KSP_SKETCH ) {
+    return kcms_increment( ks->cms, kmer );
+  }
+  if ( ks->backend == KSP_DENSE ) {
+    return cnt_add( ks, ks->dense, (size_t)kmer, kmer, 0 );
+  }
+  if ( ks->count_bits ) {
+    return cnt_add( ks, find_cnts( kmer, ks, &ks->ktn_pool, &ks->cnt_pool ),
+		    pkmer_base( kmer, ks->k, ks->k - 1 ), kmer, 0 );
+  }
+  leaf = add_pkmer( kmer, ks );
+  if ( leaf->data == NULL ) {
+    leaf->data = pool_alloc( &ks->data_pool );
+    *(size_t*)leaf->data = 0;
+    ks->owns_data = 1;
+  }
+  return ++*(size_t*)leaf->data;
+}
+
+/* increment_or_insert_pkmer
+   Adds one to the count of this (packed) kmer, adding the kmer
+   with a count of 1 if it was not there yet. Either way, it is
+   one trip down the tree. In a KSP_TRIE without counting mode the
+   count lives in the leaf node's data, so don't mix this with
+   setting kln->data yourself.
+   Returns: the new count
+*/
+size_t increment_or_insert_pkmer( pkmer kmer, KSP ks ) {
+  size_t count;
+  if ( ks->bloom == NULL ) {
+    return increment_pkmer_ksp( kmer, ks );
+  }
+  /* Everything in the KSP is in the filter, so a kmer the filter
+     hasn't seen is a first sighting: that's all it gets */
+  if ( !bloom_test_and_set( ks, kmer, 0 ) ) {
+    ks->bloom_new++;
+    return 1;
+  }
+  count = increment_pkmer_ksp( kmer, ks );
+  if ( count == 1 ) { // second sighting; count the first one too
+    count = increment_pkmer_ksp( kmer, ks );
+    ks->bloom_promoted++;
+  }
+  return count;
+}
+
+/* Prefetches where each of n kmers is counted (its counter, hash
+   table slot, bloom filter block, or prefix array slot and the node
+   under it), for increment_or_insert_pkmers */
+static void prefetch_counted( const pkmer* kmers, size_t n, KSP ks ) {
+  size_t i;
+  void* top;
+
+  if ( ks->bloom != NULL ) {
+    for( i = 0; i < n; i++ ) {
+      __builtin_prefetch( &ks->bloom[ (bloom_hash( kmers[i] ) &
+				       ks->bloom_mask) * BLOOM_BLOCK ], 1, 1 );
+    }
+  }
+  else if ( ks->backend == KSP_HASH ) {
+    for( i = 0; i < n; i++ ) {
+      kht_prefetch( ks->ht, kmers[i] );
+    }
+  }
+  else if ( ks->backend == KSP_DENSE ) {
+    for( i = 0; i < n; i++ ) {
+      __builtin_prefetch( (char*)ks->dense +
+			  (size_t)kmers[i] * (ks->count_bits / 8), 1, 1 );
+    }
+  }
+  else if ( ks->backend == KSP_TRIE ) {
+    for( i = 0; i < n; i++ ) {
+      __builtin_prefetch( &ks->ka[ pkmer_ka_inx( kmers[i], ks ) ], 0, 1 );
+    }
+    for( i = 0; i < n; i++ ) {
+      top = ks->ka[ pkmer_ka_inx( kmers[i], ks ) ];
+      __builtin_prefetch( CHAIN_OF( top ), 0, 1 ); // NULL is fine
+    }
+  }
+}
+
+/* increment_or_insert_pkmers
+   Args: const pkmer* kmers - n (packed) kmers, like a block from
+                              next_canonical_kmers
+         size_t n - how many
+         KSP ks - where to count them
+   increment_or_insert_pkmer for each of kmers, with where each one
+   is counted prefetched first, so that their cache misses overlap
+   instead of adding up (like get_kmers_batch)
+*/
+void increment_or_insert_pkmers( const pkmer* kmers, size_t n, KSP ks ) {
+  size_t i;
+  prefetch_counted( kmers, n, ks );
+  for( i = 0; i < n; i++ ) {
+    increment_or_insert_pkmer( kmers[i], ks );
+  }
+}
+
+/* The KSP part of get_pkmer_count */
+static size_t get_pkmer_count_ksp( pkmer kmer, KSP ks ) {
+  klnP leaf;
+  void* cnts;
+  if ( ks->backend == KSP_HASH ) {
+    return kht_get( ks->ht, kmer );
+  }
+  if ( ks->backend == KSP_SKETCH ) {
+    return kcms_get( ks->cms, kmer );
+  }
+  if ( ks->backend == KSP_DENSE ) {
+    return cnt_count( ks, ks->dense, (size_t)kmer, kmer );
+  }
+  if ( ks->count_bits ) {
+    cnts = find_cnts( kmer, ks, NULL, NULL );
+    if ( cnts == NULL ) {
+      return 0;
+    }
+    return cnt_count( ks, cnts, pkmer_base( kmer, ks->k, ks->k - 1 ), kmer );
+  }
+  leaf = get_pkmer( kmer, ks );
+  if ( leaf == NULL ) {
+    return 0;
+  }
+  return *(size_t*)leaf->data;
+}
+
+/* get_pkmer_count
+   Returns: the count for this (packed) kmer, 0 if never seen
+*/
+size_t get_pkmer_count( pkmer kmer, KSP ks ) {
+  size_t count = get_pkmer_count_ksp( kmer, ks );
+  if ( (count == 0) && (ks->bloom != NULL) && bloom_test( ks, kmer ) ) {
+    return 1; // seen once, as far as the filter knows
+  }
+  return count;
+}
+
+/* The rest of get_kmers_batch for m kmers of a KSP with compress,
+   from the array part (cur) down. Each kmer goes its own number of
+   steps, so they go down together one node at a time instead of a
+   level at a time */
+static void batch_chained( KSP ks, const pkmer* kmers, size_t m,
+			   void** cur, size_t* counts ) {
+  size_t pos[LOOKUP_BATCH];
+  size_t j, moved;
+  size_t last = ks->k - 1;
+  kcnP c;
+
+  for( j = 0; j < m; j++ ) {
+    pos[j] = ks->k_ar_size;
+  }
+  do {
+    moved = 0;
+    for( j = 0; j < m; j++ ) {
+      if ( (cur[j] == NULL) || (pos[j] == last) ) {
+	continue;
+      }
+      if ( IS_CHAIN( cur[j] ) ) {
+	c = CHAIN_OF( cur[j] );
+	cur[j] = (pkmer_bases( kmers[j], ks->k, pos[j], c->len ) == c->label) ?
+	  c->next : NULL;
+	pos[j] += c->len;
+      }
+      else {
+	cur[j] = ((ktnP)cur[j])->np[ pkmer_base( kmers[j], ks->k, pos[j] ) ];
+	pos[j]++;
+      }
+      __builtin_prefetch( CHAIN_OF( cur[j] ), 0, 1 );
+      moved++;
+    }
+  } while( moved > 0 );
+  for( j = 0; j < m; j++ ) {
+    counts[j] = (cur[j] == NULL) ? 0 :
+      cnt_count( ks, cur[j], pkmer_base( kmers[j], ks->k, last ), kmers[j] );
+  }
+}
+
+/* get_kmers_batch
+   Args: KSP ks - kmers counted with increment_or_insert_pkmer
+         const pkmer* kmers - n (packed) kmers to look up
+         size_t n - how many
+         size_t* counts - counts[i] gets get_pkmer_count( kmers[i] )
+   Each get_pkmer_count is a chain of loads that each wait on the
+   one before, so a lookup mostly waits on cache misses. Here up to
+   LOOKUP_BATCH kmers go down the tree together, a level at a time,
+   and each node is prefetched a whole round before it is needed.
+   That way their cache misses overlap instead of adding up.
+*/
+void get_kmers_batch( KSP ks, const pkmer* kmers, size_t n, size_t* counts ) {
+  void* cur[LOOKUP_BATCH];
+  size_t i, j, m, kmer_pos, last;
+  klnP leaf;
+
+  for( i = 0; i < n; i += m ) {
+    m = (n - i < LOOKUP_BATCH) ? n - i : LOOKUP_BATCH;
+    if ( ks->backend == KSP_HASH ) {
+      for( j = 0; j < m; j++ ) {
+	kht_prefetch( ks->ht, kmers[i+j] );
+      }
+    }
+    else if ( ks->backend == KSP_DENSE ) {
+      for( j = 0; j < m; j++ ) {
+	__builtin_prefetch( (char*)ks->dense +
+			    (size_t)kmers[i+j] * (ks->count_bits / 8), 0, 1 );
+      }
+    }
+    if ( ks->backend != KSP_TRIE ) {
+      for( j = 0; j < m; j++ ) {
+	counts[i+j] = get_pkmer_count_ksp( kmers[i+j], ks );
+      }
+      continue;
+    }
+
+    for( j = 0; j < m; j++ ) {
+      __builtin_prefetch( &ks->ka[ pkmer_ka_inx( kmers[i+j], ks ) ], 0, 1 );
+    }
+    for( j = 0; j < m; j++ ) {
+      cur[j] = ks->ka[ pkmer_ka_inx( kmers[i+j], ks ) ];
+      __builtin_prefetch( CHAIN_OF( cur[j] ), 0, 1 ); // NULL is fine
+    }
+    if ( ks->compress ) {
+      batch_chained( ks, &kmers[i], m, cur, &counts[i] );
+      continue;
+    }
+    for( kmer_pos = ks->k_ar_size; kmer_pos < ks->k - 1; kmer_pos++ ) {
+      for( j = 0; j < m; j++ ) {
+	if ( cur[j] != NULL ) {
+	  cur[j] = ((ktnP)cur[j])->np[ pkmer_base( kmers[i+j], ks->k,
+						   kmer_pos ) ];
+	  __builtin_prefetch( cur[j], 0, 1 );
+	}
+      }
+    }
+    /* cur is the counter block, or the last tree node above the
+       leaf */
+    for( j = 0; j < m; j++ ) {
+      last = pkmer_base( kmers[i+j], ks->k, ks->k - 1 );
+      if ( cur[j] == NULL ) {
+	counts[i+j] = 0;
+      }
+      else if ( ks->count_bits ) {
+	counts[i+j] = cnt_count( ks, cur[j], last, kmers[i+j] );
+      }
+      else {
+	leaf = ((ktnP)cur[j])->np[last];
+	counts[i+j] = (leaf == NULL) ? 0 : *(size_t*)leaf->data;
+      }
+    }
+  }
+
+  if ( ks->bloom != NULL ) {
+    for( i = 0; i < n; i++ ) {
+      if ( (counts[i] == 0) && bloom_test( ks, kmers[i] ) ) {
+	counts[i] = 1;
+      }
+    }
+  }
+}
+
+/* Atomic version of cnt_increment */
+#define ATOMIC_SATURATING_INCREMENT( p, max ) do {			\
+    __typeof__(*(p)) old = __atomic_load_n( (p), __ATOMIC_RELAXED );	\
+    do {								\
+      if ( old == (max) ) {						\
+	return old;							\
+      }									\
+    } while( !__atomic_compare_exchange_n( (p), &old, old + 1, 1,	\
+					   __ATOMIC_RELAXED,		\
+					   __ATOMIC_RELAXED ) );	\
+    return old + 1;							\
+  } while( 0 )
+
+static inline size_t cnt_increment_mt( KSP ks, void* cnts, size_t base ) {
+  switch( ks->count_bits ) {
+  case 8 :
+    ATOMIC_SATURATING_INCREMENT( &((uint8_t*)cnts)[base], UINT8_MAX );
+  case 16 :
+    ATOMIC_SATURATING_INCREMENT( &((uint16_t*)cnts)[base], UINT16_MAX );
+  default :
+    ATOMIC_SATURATING_INCREMENT( &((uint32_t*)cnts)[base], UINT32_MAX );
+  }
+}
+
+/* cnt_increment_mt for 8-bit counters with an overflow table: the
+   counter goes up atomically until it is full, and from then on
+   the rest of the count goes in ks->ovf under the lock */
+static size_t cnt_add_mt( KSP ks, void* cnts, size_t base, pkmer kmer ) {
+  uint8_t* p = &((uint8_t*)cnts)[base];
+  uint8_t old = __atomic_load_n( p, __ATOMIC_RELAXED );
+  do {
+    if ( old == UINT8_MAX ) {
+      return ovf_increment( ks, kmer, 1 );
+    }
+  } while( !__atomic_compare_exchange_n( p, &old, old + 1, 1,
+					 __ATOMIC_RELAXED,
+					 __ATOMIC_RELAXED ) );
+  return old + 1;
+}
+
+/* Installs node, at level of the tree, in *slot unless some other
+   thread got there first.
+   Returns: whichever node ended up in *slot; node goes back to pool
+            if it lost */
+static inline void* install_node( KSP ks, void** slot, void* node,
+				  NpoolP pool, size_t level ) {
+  void* expected = NULL;
+  if ( __atomic_compare_exchange_n( slot, &expected, node, 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE ) ) {
+    count_level( ks, level );
+    return node;
+  }
+  pool_free( pool, node );
+  return expected;
+}
+
+/* The KSP part of increment_or_insert_pkmer_mt */
+static size_t increment_pkmer_ksp_mt( pkmer kmer, KSP ks, int tid ) {
+  size_t kmer_pos, count, inx;
+  void** slot;
+  void* node;
+  NpoolP ktn_pool = &ks->thread_pools[2*tid];
+  NpoolP cnt_pool = &ks->thread_pools[2*tid + 1];
+
+  if ( ks->backend == KSP_DENSE ) {
+    return (ks->ovf != NULL) ?
+      cnt_add_mt( ks, ks->dense, (size_t)kmer, kmer ) :
+      cnt_increment_mt( ks, ks->dense, (size_t)kmer );
+  }
+  if ( (ks->backend == KSP_HASH) || (ks->backend == KSP_SKETCH) ||
+       (ks->count_bits == 0) || ks->compress ) {
+    pthread_mutex_lock( &ks->lock );
+    count = increment_pkmer_ksp( kmer, ks );
+    pthread_mutex_unlock( &ks->lock );
+    return count;
+  }
+
+  inx = pkmer_ka_inx( kmer, ks );
+  slot = (void**)&ks->ka[inx];
+  if ( __atomic_load_n( slot, __ATOMIC_ACQUIRE ) == NULL ) {
+    mark_ka( ks, inx );
+  }
+  for( kmer_pos = ks->k_ar_size; kmer_pos < ks->k - 1; kmer_pos++ ) {
+    node = __atomic_load_n( slot, __ATOMIC_ACQUIRE );
+    if ( node == NULL ) {
+      node = install_node( ks, slot, new_ktn( ktn_pool ), ktn_pool,
+			   kmer_pos - ks->k_ar_size );
+    }
+    slot = &((ktnP)node)->np[ pkmer_base( kmer, ks->k, kmer_pos ) ];
+  }
+  node = __atomic_load_n( slot, __ATOMIC_ACQUIRE );
+  if ( node == NULL ) {
+    node = install_node( ks, slot, new_cnts( cnt_pool ), cnt_pool,
+			 kmer_pos - ks->k_ar_size );
+  }
+  if ( ks->ovf != NULL ) {
+    return cnt_add_mt( ks, node, pkmer_base( kmer, ks->k, ks->k - 1 ), kmer );
+  }
+  return cnt_increment_mt( ks, node, pkmer_base( kmer, ks->k, ks->k - 1 ) );
+}
+
+/* increment_or_insert_pkmer_mt
+   Thread-safe increment_or_insert_pkmer. Any number of threads can
+   call this on the same KSP at the same time, as long as each uses
+   its own tid, from 0 to opts->threads - 1 (new nodes come from
+   per-thread pools). Missing tree nodes are put in place with
+   compare-and-swap and counters go up atomically, so a counting
+   mode KSP_TRIE or a KSP_DENSE never takes a lock. A KSP_HASH, a
+   KSP_SKETCH, a KSP_TRIE without counting mode, or one with chain
+   nodes (KSPOpts compress) just takes a lock per call.
+   Don't mix it with other calls that change ks while threads are
+   running.
+   Returns: the new count
+*/
+size_t increment_or_insert_pkmer_mt( pkmer kmer, KSP ks, int tid ) {
+  size_t count;
+  if ( ks->bloom == NULL ) {
+    return increment_pkmer_ksp_mt( kmer, ks, tid );
+  }
+  if ( !bloom_test_and_set( ks, kmer, 1 ) ) {
+    __atomic_fetch_add( &ks->bloom_new, 1, __ATOMIC_RELAXED );
+    return 1;
+  }
+  count = increment_pkmer_ksp_mt( kmer, ks, tid );
+  if ( count == 1 ) {
+    count = increment_pkmer_ksp_mt( kmer, ks, tid );
+    __atomic_fetch_add( &ks->bloom_promoted, 1, __ATOMIC_RELAXED );
+  }
+  return count;
+}
+
+/* increment_or_insert_pkmers_mt
+   Same as increment_or_insert_pkmers, with
+   increment_or_insert_pkmer_mt
+*/
+void increment_or_insert_pkmers_mt( const pkmer* kmers, size_t n,
+				    KSP ks, int tid ) {
+  size_t i;
+  prefetch_counted( kmers, n, ks );
+  for( i = 0; i < n; i++ ) {
+    increment_or_insert_pkmer_mt( kmers[i], ks, tid );
+  }
+}
+
+/* Partitioned building: kmers are put in one bucket per thread by
+   the top bits of their prefix. Partitions are dealt out to the
+   threads round robin, so each thread owns many small, scattered
+   ranges of the array part (canonical kmers are far from evenly
+   spread over the prefixes). Each thread then adds its own bucket,
+   touching only its own subtrees and its own pools: nothing is
+   shared, so no locks and no atomics. */
+#define SCATTER_PART_BITS (12) // up to 4096 partitions
+
+/* init_kscatter
+   Args: KSP ks - where the kmers are going
+         int threads - number of building threads; no more than
+                       ks was made for (KSPOpts threads)
+         size_t cap - how many kmers each bucket holds before all
+                      of them get added to ks
+   Returns: pointer to a new, empty scatter buffer
+   Only a counting mode KSP_TRIE or a KSP_DENSE, with no bloom
+   filter, can be built in parallel. For anything else, kscatter_add
+   just adds the kmer.
+*/
+KScatterP init_kscatter( KSP ks, int threads, size_t cap ) {
+  KScatterP sc;
+  size_t prefix_bits;
+  int i;
+
+  sc = (KScatterP)malloc(sizeof(KScatter));
+  sc->ks = ks;
+  if ( threads > ks->n_threads ) {
+    threads = ks->n_threads;
+  }
+  if ( (ks->backend == KSP_HASH) || (ks->backend == KSP_SKETCH) ||
+       (ks->bloom != NULL) ||
+       ((ks->backend == KSP_TRIE) && (ks->count_bits == 0)) ) {
+    threads = 1;
+  }
+  sc->threads = threads;
+  sc->cap = cap;
+  sc->n = (size_t*)calloc( threads, sizeof(size_t) );
+  sc->buckets = (pkmer**)malloc(sizeof(pkmer*) * threads);
+  for( i = 0; i < threads; i++ ) {
+    sc->buckets[i] = (pkmer*)malloc(sizeof(pkmer) * cap);
+  }
+  /* Partition by the array part's prefix (or the whole kmer for
+     KSP_DENSE), so that a partition never splits a subtree */
+  prefix_bits = 2 * ((ks->backend == KSP_DENSE) ? ks->k : ks->k_ar_size);
+  sc->part_shift = 2 * ks->k - prefix_bits;
+  if ( prefix_bits > SCATTER_PART_BITS ) {
+    sc->part_shift += prefix_bits - SCATTER_PART_BITS;
+  }
+  return sc;
+}
+
+/* What each building thread gets */
+typedef struct scatter_worker {
+  KScatterP sc;
+  int tid;
+} ScatterWorker;
+
+static void* scatter_worker( void* arg ) {
+  ScatterWorker* w = (ScatterWorker*)arg;
+  KSP ks = w->sc->ks;
+  pkmer* bucket = w->sc->buckets[w->tid];
+  size_t i, n = w->sc->n[w->tid];
+  NpoolP ktn_pool = &ks->thread_pools[2*w->tid];
+  NpoolP cnt_pool = &ks->thread_pools[2*w->tid + 1];
+
+  if ( ks->backend == KSP_DENSE ) {
+    for( i = 0; i < n; i++ ) {
+      cnt_add( ks, ks->dense, (size_t)bucket[i], bucket[i], 1 );
+    }
+    return NULL;
+  }
+  for( i = 0; i < n; i++ ) {
+    cnt_add( ks, find_cnts( bucket[i], ks, ktn_pool, cnt_pool ),
+	     pkmer_base( bucket[i], ks->k, ks->k - 1 ), bucket[i], 1 );
+  }
+  return NULL;
+}
+
+/* kscatter_flush
+   Adds everything in the buckets to the KSP, one thread per bucket,
+   and empties them
+*/
+void kscatter_flush( KScatterP sc ) {
+  ScatterWorker* workers;
+  pthread_t* tids;
+  size_t i;
+  int t;
+
+  if ( sc->threads == 1 ) { // just do it here
+    increment_or_insert_pkmers( sc->buckets[0], sc->n[0], sc->ks );
+    sc->n[0] = 0;
+    return;
+  }
+  workers = (ScatterWorker*)malloc(sizeof(ScatterWorker) * sc->threads);
+  tids = (pthread_t*)malloc(sizeof(pthread_t) * sc->threads);
+  for( t = 0; t < sc->threads; t++ ) {
+    workers[t].sc  = sc;
+    workers[t].tid = t;
+    pthread_create( &tids[t], NULL, scatter_worker, &workers[t] );
+  }
+  for( t = 0; t < sc->threads; t++ ) {
+    pthread_join( tids[t], NULL );
+    sc->n[t] = 0;
+  }
+  free( workers );
+  free( tids );
+}
+
+/* kscatter_add
+   Puts kmer in the bucket of the thread that owns its partition,
+   adding all the buckets to the KSP first if that one is full.
+   Call kscatter_flush when there are no more kmers.
+*/
+void kscatter_add( KScatterP sc, pkmer kmer ) {
+  int owner;
+  owner = (int)((size_t)(kmer >> sc->part_shift) % sc->threads);
+  if ( sc->n[owner] == sc->cap ) {
+    kscatter_flush( sc );
+  }
+  sc->buckets[owner][ sc->n[owner]++ ] = kmer;
+}
+
+/* free_kscatter
+   Frees sc; anything still in the buckets is dropped, so flush
+   first
+*/
+void free_kscatter( KScatterP sc ) {
+  int i;
+  for( i = 0; i < sc->threads; i++ ) {
+    free( sc->buckets[i] );
+  }
+  free( sc->buckets );
+  free( sc->n );
+  free( sc );
+}
+
+/* Calls fn for the four counters of a counting mode counter block
+   whose kmers start with prefix */
+static inline void foreach_cnts( KSP ks, void* cnts, pkmer prefix,
+				 KVisitFn fn, void* arg ) {
+  unsigned int base;
+  size_t count;
+  for( base = 0; base < 4; base++ ) {
+    count = cnt_count( ks, cnts, base, (prefix << 2) | base );
+    if ( count != 0 ) {
+      fn( (prefix << 2) | base, count, arg );
+    }
+  }
+}
+
+/* Stack for ksp_foreach's walk down a tree: node[d] is a tree node
+   at level[d] (0 is right below the array part), prefix[d] the
+   bases of the kmers under it so far, and next[d] the next of its
+   children to look at */
+typedef struct foreach_stack {
+  ktnP node[MAX_K];
+  pkmer prefix[MAX_K];
+  size_t level[MAX_K];
+  unsigned int next[MAX_K];
+  size_t n;
+} ForeachStack;
+
+/* Takes node, at level with prefix, in the walk: past any chain
+   nodes, then a leaf or counter block is visited, and a tree node
+   pushed on st to be gone through */
+static inline void foreach_node( KSP ks, void* node, size_t level,
+				 pkmer prefix, KVisitFn fn, void* arg,
+				 ForeachStack* st ) {
+  size_t n_levels = ks->k - ks->k_ar_size;
+  size_t count;
+  kcnP c;
+
+  while( IS_CHAIN( node ) ) {
+    c = CHAIN_OF( node );
+    prefix = (prefix << (2 * c->len)) | c->label;
+    level += c->len;
+    node = c->next;
+    if ( node == NULL ) { // its kmers were all removed
+      return;
+    }
+  }
+  if ( level == n_levels ) { // a leaf node
+    count = ks->owns_data ? *(size_t*)((klnP)node)->data : 1;
+    fn( prefix, count, arg );
+  }
+  else if ( ks->count_bits && (level == n_levels - 1) ) {
+    foreach_cnts( ks, node, prefix, fn, arg );
+  }
+  else {
+    st->node[st->n] = (ktnP)node;
+    st->prefix[st->n] = prefix;
+    st->level[st->n] = level;
+    st->next[st->n] = 0;
+    st->n++;
+  }
+}
+
+/* ksp_foreach for the tree under one slot of the array part: root
+   is the slot's node and prefix its bases. Walks down with a stack
+   of its own, not by recursion. */
+static void foreach_tree( KSP ks, void* root, pkmer prefix,
+			  KVisitFn fn, void* arg ) {
+  ForeachStack st;
+  unsigned int base;
+  size_t d;
+  void* child;
+
+  st.n = 0;
+  foreach_node( ks, root, 0, prefix, fn, arg, &st );
+  while( st.n > 0 ) {
+    d = st.n - 1;
+    if ( st.next[d] == 4 ) { // done with this node; back up
+      st.n--;
+      continue;
+    }
+    base = st.next[d]++;
+    child = st.node[d]->np[base];
+    if ( child != NULL ) {
+      foreach_node( ks, child, st.level[d] + 1,
+		    (st.prefix[d] << 2) | base, fn, arg, &st );
+    }
+  }
+}
+
+/* Nonzero byte masks: bit j of what each returns is set if byte j
+   of the 64 at p isn't zero. For the scan of a KSP_DENSE with 8-bit
+   counters, one version for each SIMD_ level, each built for its
+   own target so that a plain build has all of them. simd_level
+   picks one. */
+static uint64_t nonzero_bytes_scalar( const uint8_t* p ) {
+  const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+  uint64_t w, hi, mask = 0;
+  int j;
+  for( j = 0; j < 8; j++ ) {
+    memcpy( &w, p + 8 * j, sizeof(uint64_t) );
+    hi = (((w & low7) + low7) | w) & ~low7; // top bit of each nonzero byte
+    mask |= ((hi >> 7) * 0x0102040810204080ULL >> 56) << (8 * j);
+  }
+  return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static uint64_t nonzero_bytes_sse2( const uint8_t* p ) {
+  const __m128i zero = _mm_setzero_si128();
+  uint64_t mask = 0;
+  int j;
+  for( j = 0; j < 4; j++ ) {
+    mask |= (uint64_t)(uint16_t)~_mm_movemask_epi8(
+      _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i*)(p + 16 * j) ),
+		      zero ) ) << (16 * j);
+  }
+  return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t nonzero_bytes_avx2( const uint8_t* p ) {
+  const __m256i zero = _mm256_setzero_si256();
+  uint32_t lo, hi;
+  lo = ~(uint32_t)_mm256_movemask_epi8(
+    _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i*)p ), zero ) );
+  hi = ~(uint32_t)_mm256_movemask_epi8(
+    _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i*)(p + 32) ),
+		       zero ) );
+  return ((uint64_t)hi << 32) | lo;
+}
+
+__attribute__((target("avx512bw")))
+static uint64_t nonzero_bytes_avx512( const uint8_t* p ) {
+  __m512i v = _mm512_loadu_si512( (const void*)p );
+  return _mm512_test_epi8_mask( v, v );
+}
+
+static uint64_t (* const nonzero_bytes[])( const uint8_t* p ) = {
+  nonzero_bytes_scalar, nonzero_bytes_sse2, nonzero_bytes_avx2,
+  nonzero_bytes_avx512
+};
+#else
+static uint64_t (* const nonzero_bytes[])( const uint8_t* p ) = {
+  nonzero_bytes_scalar
+};
+#endif
+
+/* How many slots ksp_foreach goes through: of the array part, the
+   hash table, or the dense array */
+static size_t foreach_len( KSP ks ) {
+  switch( ks->backend ) {
+  case KSP_HASH :
+    return ks->ht->size;
+  case KSP_DENSE :
+    return ks->dense_len;
+  default :
+    return ks->ka_len;
+  }
+}
+
+/* ksp_foreach over slots lo up to (not including) hi */
+static void foreach_range( KSP ks, size_t lo, size_t hi,
+			   KVisitFn fn, void* arg ) {
+  size_t i, j, end, count, chunk;
+  const uint64_t* words;
+  uint64_t bits, any;
+  uint64_t (*nonzero)( const uint8_t* p );
+  kheP e;
+
+  if ( ks->backend == KSP_HASH ) {
+    for( i = lo; i < hi; i++ ) {
+      e = &ks->ht->slots[i];
+      if ( e->count != 0 ) {
+	fn( e->key, e->count, arg );
+      }
+    }
+    return;
+  }
+
+  if ( (ks->backend == KSP_DENSE) && (ks->count_bits == 8) ) {
+    /* Most of the array is zero (never more than about half of it
+       is used, since only canonical kmers get counted), so each
+       64 counter chunk becomes a mask of the nonzero ones, and only
+       those get looked at: no branch on every counter */
+    nonzero = nonzero_bytes[ simd_level() ];
+    for( i = lo; i < hi; i = end ) {
+      end = (i / 64 + 1) * 64;
+      if ( end > hi ) {
+	end = hi;
+      }
+      if ( (i % 64 == 0) && (end - i == 64) ) {
+	bits = nonzero( (const uint8_t*)ks->dense + i );
+      }
+      else { // a ragged end of the range
+	for( bits = 0, j = i; j < end; j++ ) {
+	  bits |= (uint64_t)(((uint8_t*)ks->dense)[j] != 0) << (j - i);
+	}
+      }
+      while( bits != 0 ) {
+	j = i + __builtin_ctzll( bits );
+	bits &= bits - 1;
+	fn( (pkmer)j, cnt_count( ks, ks->dense, j, (pkmer)j ), arg );
+      }
+    }
+    return;
+  }
+
+  if ( ks->backend == KSP_DENSE ) {
+    /* Wider counters: whole 64 byte chunks that are zero get
+       skipped. The OR across the chunk is simple enough for the
+       compiler to vectorize. */
+    words = (const uint64_t*)ks->dense;
+    chunk = 8 * (64 / ks->count_bits); // counters per chunk
+    for( i = lo; i < hi; i = end ) {
+      end = (i / chunk + 1) * chunk;
+      if ( end > hi ) {
+	end = hi;
+      }
+      if ( (i % chunk == 0) && (end - i == chunk) ) {
+	any = 0;
+	for( j = 0; j < 8; j++ ) {
+	  any |= words[ i / (chunk / 8) + j ];
+	}
+	if ( any == 0 ) {
+	  continue;
+	}
+      }
+      for( ; i < end; i++ ) {
+	count = cnt_count( ks, ks->dense, i, (pkmer)i );
+	if ( count != 0 ) {
+	  fn( (pkmer)i, count, arg );
+	}
+      }
+    }
+    return;
+  }
+
+  /* KSP_TRIE: only the slots marked in ka_occ, 64 at a time */
+  i = lo;
+  while( i < hi ) {
+    bits = ks->ka_occ[i / 64] >> (i % 64);
+    if ( bits == 0 ) {
+      i = (i / 64 + 1) * 64;
+      continue;
+    }
+    i += __builtin_ctzll( bits );
+    if ( i >= hi ) {
+      return;
+    }
+    if ( ks->ka[i] != NULL ) {
+      foreach_tree( ks, ks->ka[i], (pkmer)i, fn, arg );
+    }
+    i++;
+  }
+}
+
+/* ksp_foreach
+   Args: KSP ks - the kmers
+         KVisitFn fn - called as fn( kmer, count, arg ) for every kmer
+         void* arg - passed along to fn
+   A KSP_TRIE or KSP_DENSE goes in sorted (packed kmer) order; a
+   KSP_HASH in no particular order. A KSP_TRIE with no counts (not
+   built with increment_or_insert_pkmer) gives each kmer a count of
+   1. Kmers that are only in the bloom filter, and anything in a
+   KSP_SKETCH, can't be listed.
+*/
+void ksp_foreach( KSP ks, KVisitFn fn, void* arg ) {
+  if ( ks->backend == KSP_SKETCH ) {
+    fprintf( stderr, "ERROR: A count-min sketch can't list its kmers.\n" );
+    exit( 1 );
+  }
+  foreach_range( ks, 0, foreach_len( ks ), fn, arg );
+}
+
+/* What each ksp_foreach_mt thread gets */
+typedef struct foreach_job {
+  KSP ks;
+  KVisitFn fn;
+  void* arg;     // this thread's own
+  size_t* next;  // next slot no thread has taken yet; shared
+  size_t len;
+} ForeachJob;
+
+static void* foreach_worker( void* arg ) {
+  ForeachJob* job = (ForeachJob*)arg;
+  size_t lo, hi;
+  while( (lo = __atomic_fetch_add( job->next, FOREACH_BLOCK,
+				   __ATOMIC_RELAXED )) < job->len ) {
+    hi = (lo + FOREACH_BLOCK < job->len) ? lo + FOREACH_BLOCK : job->len;
+    foreach_range( job->ks, lo, hi, job->fn, job->arg );
+  }
+  return NULL;
+}
+
+/* ksp_foreach_mt
+   Args: KSP ks - the kmers
+         int threads - how many threads to split the walk over
+         KVisitFn fn - called as fn( kmer, count, args[t] ) for every
+                       kmer, from thread t
+         void** args - one for each thread, so fn needs no locks;
+                       the caller puts the threads' results together
+                       after
+   Same as ksp_foreach, but the threads take FOREACH_BLOCK slots at
+   a time until they're all done (the kmers are far from evenly
+   spread), so the kmers come in no particular order. ks must not
+   change while this runs.
+*/
+void ksp_foreach_mt( KSP ks, int threads, KVisitFn fn, void** args ) {
+  ForeachJob* jobs;
+  pthread_t* tids;
+  size_t next = 0;
+  int t;
+
+  if ( threads <= 1 ) {
+    ksp_foreach( ks, fn, args[0] );
+    return;
+  }
+  if ( ks->backend == KSP_SKETCH ) {
+    fprintf( stderr, "ERROR: A count-min sketch can't list its kmers.\n" );
+    exit( 1 );
+  }
+  jobs = (ForeachJob*)malloc(sizeof(ForeachJob) * threads);
+  tids = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+  for( t = 0; t < threads; t++ ) {
+    jobs[t].ks   = ks;
+    jobs[t].fn   = fn;
+    jobs[t].arg  = args[t];
+    jobs[t].next = &next;
+    jobs[t].len  = foreach_len( ks );
+    pthread_create( &tids[t], NULL, foreach_worker, &jobs[t] );
+  }
+  for( t = 0; t < threads; t++ ) {
+    pthread_join( tids[t], NULL );
+  }
+  free( jobs );
+  free( tids );
+}
+
+/* One thread's histogram, for count_hist */
+typedef struct hist_part {
+  size_t* hist;
+  size_t hist_len;
+} HistPart;
+
+static void hist_kmer( pkmer kmer, size_t count, void* arg ) {
+  HistPart* hp = (HistPart*)arg;
+  if ( count < hp->hist_len ) {
+    hp->hist[count]++;
+  }
+}
+
+/* count_hist
+   Args: KSP ks - kmers counted with increment_or_insert_pkmer
+         size_t* hist - hist[i] gets the number of kmers seen i times
+         size_t hist_len - length of hist; kmers seen hist_len or
+                           more times are not in it
+   hist is zeroed first. A KSP made for more than one thread
+   (KSPOpts threads) is gone through with that many.
+*/
+void count_hist( KSP ks, size_t* hist, size_t hist_len ) {
+  HistPart* parts;
+  void** args;
+  size_t i;
+  int t;
+
+  if ( ks->backend == KSP_SKETCH ) {
+    fprintf( stderr, "ERROR: A count-min sketch can't list its kmers. "
+	     "Make its histogram from another pass over the input.\n" );
+    exit( 1 );
   }
-  return ks;
+  parts = (HistPart*)malloc(sizeof(HistPart) * ks->n_threads);
+  args = (void**)malloc(sizeof(void*) * ks->n_threads);
+  for( t = 0; t < ks->n_threads; t++ ) {
+    parts[t].hist = (size_t*)calloc( hist_len, sizeof(size_t) );
+    parts[t].hist_len = hist_len;
+    args[t] = &parts[t];
+  }
+  ksp_foreach_mt( ks, ks->n_threads, hist_kmer, args );
+  memset( hist, 0, sizeof(size_t) * hist_len );
+  for( t = 0; t < ks->n_threads; t++ ) {
+    for( i = 0; i < hist_len; i++ ) {
+      hist[i] += parts[t].hist[i];
+    }
+    free( parts[t].hist );
+  }
+  free( parts );
+  free( args );
+
+  /* Kmers only in the bloom filter were seen once. False positives
+     are promoted without ever being new; with a filter that is far
+     too small, there can be more of those than singletons */
+  if ( (ks->bloom != NULL) && (hist_len > 1) &&
+       (ks->bloom_new > ks->bloom_promoted) ) {
+    hist[1] += ks->bloom_new - ks->bloom_promoted;
+  }
+}
+
+
+/* ksp_stats
+   Args: KSP ks - the kmers
+         KSPStatsP st - filled in with how many of each kind of node
+                        ks has and where its memory goes
+   Cheap enough to call any time: it only adds up counters that are
+   kept as ks is built, and doesn't look at the kmers. It shouldn't
+   be called while other threads are adding to ks.
+*/
+void ksp_stats( KSP ks, KSPStatsP st ) {
+  size_t i, node_bytes, children;
+  int t;
+
+  memset( st, 0, sizeof(KSPStats) );
+  st->backend = ks->backend;
+  /* Nodes made by one thread can be given back to another pool,
+     so only the sums over all the pools mean anything */
+  st->tree_nodes  = ks->ktn_pool.n_used;
+  st->cnt_blocks  = ks->cnt_pool.n_used;
+  st->pool_bytes  = (ks->ktn_pool.n_slabs + ks->kln_pool.n_slabs +
+		     ks->data_pool.n_slabs + ks->cnt_pool.n_slabs) * SLAB_SIZE;
+  for( t = 0; t < ks->n_threads; t++ ) {
+    st->tree_nodes += ks->thread_pools[2*t].n_used;
+    st->cnt_blocks += ks->thread_pools[2*t + 1].n_used;
+    st->pool_bytes += (ks->thread_pools[2*t].n_slabs +
+		       ks->thread_pools[2*t + 1].n_slabs) * SLAB_SIZE;
+  }
+  st->chain_nodes = ks->n_chains; // from the tree node pools
+  st->tree_nodes -= st->chain_nodes;
+  st->leaf_nodes  = ks->kln_pool.n_used;
+  st->data_blocks = ks->data_pool.n_used;
+
+  if ( ks->ka != NULL ) {
+    st->n_levels = ks->k - ks->k_ar_size;
+    for( i = 0; i < st->n_levels; i++ ) {
+      st->level_nodes[i] = ks->level_nodes[i];
+      node_bytes = (ks->count_bits && (i == st->n_levels - 1)) ?
+	ks->cnt_pool.node_size : sizeof(ktn);
+      st->level_bytes[i] = st->level_nodes[i] * node_bytes;
+    }
+    /* Every node but the ones in the array part is the child of a
+       tree node, or of a chain node, which only has the one */
+    children = st->tree_nodes + st->cnt_blocks + st->leaf_nodes;
+    children = (children > ks->ka_used) ? children - ks->ka_used : 0;
+    st->branching = (st->tree_nodes > 0) ?
+      (double)children / st->tree_nodes : 0.0;
+    st->ka_slots = ks->ka_len;
+    st->ka_used  = ks->ka_used;
+    st->ka_bytes = ks->ka_len * sizeof(ktnP) + (ks->ka_len + 63) / 64 * 8;
+  }
+  if ( ks->ht != NULL ) {
+    st->table_bytes = ks->ht->size * sizeof(khe);
+    st->n_kmers = ks->ht->n;
+  }
+  if ( ks->dense != NULL ) {
+    st->table_bytes = ks->dense_len * (ks->count_bits / 8);
+  }
+  if ( ks->ovf != NULL ) {
+    st->ovf_kmers = ks->ovf->n;
+    st->ovf_bytes = ks->ovf->size * sizeof(khe);
+  }
+  if ( ks->cms != NULL ) {
+    st->table_bytes = ks->cms->width * ks->cms->depth *
+      (ks->cms->count_bits / 8);
+  }
+  if ( ks->bloom != NULL ) {
+    st->bloom_bytes = (ks->bloom_mask + 1) * BLOOM_BLOCK * sizeof(uint64_t);
+  }
+  st->total_bytes = sizeof(Kmers) + st->ka_bytes + st->pool_bytes +
+    st->table_bytes + st->ovf_bytes + st->bloom_bytes;
+}
+
+#define MB( x ) ((double)(x) / (1 << 20))
+
+/* print_ksp_stats
+   Writes what ksp_stats finds for ks to fp, for people to read
+*/
+void print_ksp_stats( KSP ks, FILE* fp ) {
+  static const char* backends[] = { "tree", "hash table", "dense array",
+				    "count-min sketch" };
+  KSPStats st;
+  size_t i;
+
+  ksp_stats( ks, &st );
+  fprintf( fp, "[KSP stats: k = %lu, %s]\n", ks->k, backends[st.backend] );
+  if ( st.ka_slots > 0 ) {
+    fprintf( fp, " array part: %lu of %lu slots used (%.1f%%), %.1f MB\n",
+	     st.ka_used, st.ka_slots, 100.0 * st.ka_used / st.ka_slots,
+	     MB( st.ka_bytes ) );
+    fprintf( fp, " tree nodes: %lu, chain nodes: %lu, leaf nodes: %lu, "
+	     "data: %lu, counter blocks: %lu\n", st.tree_nodes,
+	     st.chain_nodes, st.leaf_nodes, st.data_blocks, st.cnt_blocks );
+    fprintf( fp, " node pools: %.1f MB, average branching %.2f\n",
+	     MB( st.pool_bytes ), st.branching );
+    for( i = 0; i < st.n_levels; i++ ) {
+      fprintf( fp, "  level %2lu: %lu nodes, %.1f MB\n",
+	       i, st.level_nodes[i], MB( st.level_bytes[i] ) );
+    }
+  }
+  if ( st.table_bytes > 0 ) {
+    fprintf( fp, " table: %.1f MB\n", MB( st.table_bytes ) );
+  }
+  if ( st.ovf_bytes > 0 ) {
+    fprintf( fp, " overflow table: %lu kmers seen more than %d times, "
+	     "%.1f MB\n", st.ovf_kmers, UINT8_MAX, MB( st.ovf_bytes ) );
+  }
+  if ( st.n_kmers > 0 ) {
+    fprintf( fp, " distinct kmers: %lu (%.1f bytes each)\n", st.n_kmers,
+	     (double)st.total_bytes / st.n_kmers );
+  }
+  if ( st.bloom_bytes > 0 ) {
+    fprintf( fp, " bloom filter: %.1f MB, %lu kmers seen once or more, "
+	     "%lu twice or more\n", MB( st.bloom_bytes ),
+	     ks->bloom_new, ks->bloom_promoted );
+  }
+  fprintf( fp, " total: %.1f MB\n", MB( st.total_bytes ) );
 }
 
+
 /* add_kmer
    This function takes a kmer as input and returns the data
    associated with that kmer.
@@ -29,99 +1821,59 @@ KSP init_KSP( int k ) {
             NULL if the kmer is bad or couldn't be added
 */
 klnP add_kmer( const char* kmer, KSP ks ) {
+  pkmer pk;
+  if ( kmer2pkmer( kmer, ks->k, &pk ) ) {
+    return add_pkmer( pk, ks );
+  }
+  // not a good base, not a good kmer, we're done
+  return NULL;
+}
+
+/* add_pkmer
+   Just like add_kmer, but the kmer is already packed, so there
+   is no character parsing to do. Each level of the tree is
+   picked by the next 2 bits of the packed kmer.
+   Args: pkmer kmer - packed kmer
+         KSP ks - pointer the kmer structure
+   Returns: klnP - pointer to the (possibly new) leaf node
+*/
+klnP add_pkmer( pkmer kmer, KSP ks ) {
   size_t inx;
-  size_t i;
-  ktnP curr_node;
-  ktnP next_node;
-  klnP last_node;
-  //ktnP curr_node, next_node;
   size_t kmer_pos;
-  char next_base;
-
-  /* Find what the index position is for the first K_AR_SIZE
-     bases in this kmer */
-  if ( kmer2inx( kmer, ks->k_ar_size, &inx ) ) {
-  
-    /* Start at the index position of the first ks->k_ar_size bases */
-    curr_node = (ktnP)ks->ka[inx];
-    
-    /* If we've never seen that before, then initialize it */
-    if ( curr_node == NULL ) {
-      curr_node = (ktnP)init_ktn();
-      ks->ka[inx] = curr_node;
-    }
-    
-    kmer_pos = ks->k_ar_size;
-    
-    while( kmer_pos < ks->k - 1 ) {
-      next_base = toupper(kmer[kmer_pos]);
-      switch( next_base ) {
-      case 'A' :
-        if ( curr_node->Ap == NULL ) {
-          curr_node->Ap =  (ktnP)init_ktn();
-        }
-        next_node = curr_node->Ap;
-        break;
-      case 'C' :
-        if ( curr_node->Cp == NULL ) {
-          curr_node->Cp = (ktnP)init_ktn();
-        }
-        next_node = curr_node->Cp;
-        break;
-      case 'G' :
-        if ( curr_node->Gp == NULL ) {
-          curr_node->Gp = (ktnP)init_ktn();
-        }
-        next_node = curr_node->Gp;
-        break;
-      case 'T' :
-        if ( curr_node->Tp == NULL ) {
-          curr_node->Tp = (ktnP)init_ktn();
-        }
-        next_node = curr_node->Tp;
-        break;
-      default :
-        // not a good base, not a good kmer, we're done
-        return NULL;
-      }
-      curr_node = next_node;
-      kmer_pos++;
-    }
-    /* Now, the final base => leaf node */
-    next_base = toupper(kmer[kmer_pos]);
-    switch(next_base) {
-    case 'A':
-      if ( curr_node->Ap == NULL ) {
-        curr_node->Ap = (klnP)init_kln();
-      }
-      last_node = curr_node->Ap;
-      break;
-    case 'C' :
-      if ( curr_node->Cp == NULL ) {
-        curr_node->Cp = (klnP)init_ktn();
-      }
-      last_node = curr_node->Cp;
-      break;
-    case 'G' :
-      if ( curr_node->Gp == NULL ) {
-        curr_node->Gp = (klnP)init_ktn();
-      }
-      last_node = curr_node->Gp;
-      break;
-    case 'T' :
-      if ( curr_node->Tp == NULL ) {
-        curr_node->Tp = (klnP)init_ktn();
-      }
-      last_node = curr_node->Tp;
-      break;
-    default : // not a good base
-      return NULL;
+  unsigned int base;
+  ktnP curr_node;
+
+  if ( (ks->backend != KSP_TRIE) || ks->count_bits ) {
+    return NULL; // no leaf nodes to give out
+  }
+
+  /* Start at the index position of the first ks->k_ar_size bases */
+  inx = pkmer_ka_inx( kmer, ks );
+  curr_node = ks->ka[inx];
+
+  /* If we've never seen that before, then initialize it */
+  if ( curr_node == NULL ) {
+    curr_node = new_ktn( &ks->ktn_pool );
+    ks->ka[inx] = curr_node;
+    mark_ka( ks, inx );
+    count_level( ks, 0 );
+  }
+
+  for( kmer_pos = ks->k_ar_size; kmer_pos < ks->k - 1; kmer_pos++ ) {
+    base = pkmer_base( kmer, ks->k, kmer_pos );
+    if ( curr_node->np[base] == NULL ) {
+      curr_node->np[base] = new_ktn( &ks->ktn_pool );
+      count_level( ks, kmer_pos - ks->k_ar_size + 1 );
     }
-    return last_node;
+    curr_node = curr_node->np[base];
   }
-  else {
-    return NULL;
+
+  /* Now, the final base => leaf node */
+  base = pkmer_base( kmer, ks->k, kmer_pos );
+  if ( curr_node->np[base] == NULL ) {
+    curr_node->np[base] = new_kln( ks );
   }
+  return curr_node->np[base];
 }
 
 /* Just like add_kmer, except...
@@ -133,16 +1885,11 @@ klnP add_kmer( const char* kmer, KSP ks ) {
    the not reverse complemented form.
 */
 klnP add_canonical_kmer( const char* kmer, KSP ks ) {
-  char revcom_kmer_str[ MAX_K + 1];
-  strncpy( revcom_kmer_str, kmer, ks->k );
-  revcom_kmer( revcom_kmer_str, ks->k );
-
-  if ( strcmp( kmer, revcom_kmer_str ) < 0 ) {
-    return add_kmer( kmer, ks );
-  }
-  else {
-    return add_kmer( revcom_kmer_str, ks );
+  pkmer pk;
+  if ( kmer2pkmer( kmer, ks->k, &pk ) ) {
+    return add_pkmer( canonical_pkmer( pk, ks->k ), ks );
   }
+  return NULL;
 }
 
 
@@ -153,94 +1900,48 @@ klnP add_canonical_kmer( const char* kmer, KSP ks ) {
    a bad kmer or never seen
 */
 klnP get_kmer( const char* kmer, KSP ks ) {
-  size_t inx;
-  size_t i;
-  ktnP curr_node;
-  ktnP next_node;
-  klnP last_node;
-  //ktnP curr_node, next_node;
+  pkmer pk;
+  if ( kmer2pkmer( kmer, ks->k, &pk ) ) {
+    return get_pkmer( pk, ks );
+  }
+  return NULL;
+}
+
+/* get_pkmer
+   Packed version of get_kmer. NULL if the kmer was never seen
+*/
+klnP get_pkmer( pkmer kmer, KSP ks ) {
   size_t kmer_pos;
-  char next_base;
-
-  /* Find what the index position is for the first K_AR_SIZE
-     bases in this kmer */
-  if ( kmer2inx( kmer, ks->k_ar_size, &inx ) ) {
-  
-    /* Start at the index position of the first ks->k_ar_size bases */
-    curr_node = (ktnP)ks->ka[inx];
-    
-    /* If we've never seen that before, then this kmer is not
-       present => return NULL, we're done */
+  ktnP curr_node;
+
+  if ( (ks->backend != KSP_TRIE) || ks->count_bits ) {
+    return NULL;
+  }
+
+  /* Start at the index position of the first ks->k_ar_size bases */
+  curr_node = ks->ka[ pkmer_ka_inx( kmer, ks ) ];
+
+  /* If we've never seen that before, then this kmer is not
+     present => return NULL, we're done */
+  for( kmer_pos = ks->k_ar_size; kmer_pos < ks->k - 1; kmer_pos++ ) {
     if ( curr_node == NULL ) {
       return NULL;
     }
-    kmer_pos = ks->k_ar_size;
-
-    while( kmer_pos < ks->k - 1 ) {
-      next_base = toupper(kmer[kmer_pos]);
-      switch( next_base ) {
-      case 'A' :
-        if ( curr_node->Ap == NULL ) {
-	  return NULL;
-        }
-        next_node = curr_node->Ap;
-        break;
-      case 'C' :
-        if ( curr_node->Cp == NULL ) {
-	  return NULL;
-        }
-        next_node = curr_node->Cp;
-        break;
-      case 'G' :
-        if ( curr_node->Gp == NULL ) {
-	  return NULL;
-        }
-        next_node = curr_node->Gp;
-        break;
-      case 'T' :
-        if ( curr_node->Tp == NULL ) {
-	  return NULL;
-        }
-        next_node = curr_node->Tp;
-        break;
-      default :
-        // not a good base, not a good kmer, we're done
-        return NULL;
-      }
-      curr_node = next_node;
-      kmer_pos++;
-    }
-    /* Now, the final base => leaf node */
-    next_base = toupper(kmer[kmer_pos]);
-    switch(next_base) {
-    case 'A':
-      return curr_node->Ap;
-    case 'C' :
-      return curr_node->Cp;
-    case 'G' :
-      return curr_node->Gp;
-    case 'T' :
-      return curr_node->Tp;
-    default :
-      return NULL;
-    }
+    curr_node = curr_node->np[ pkmer_base( kmer, ks->k, kmer_pos ) ];
   }
-  else { // didn't even see the beginning part of the kmer
+  if ( curr_node == NULL ) {
     return NULL;
   }
+  /* Now, the final base => leaf node */
+  return curr_node->np[ pkmer_base( kmer, ks->k, kmer_pos ) ];
 }
 
 klnP get_canonical_kmer( const char* kmer, KSP ks ) {
-  char revcom_kmer_str[ MAX_K + 1];
-  strncpy( revcom_kmer_str, kmer, ks->k );
-  revcom_kmer( revcom_kmer_str, ks->k );
-
-  if ( strcmp( kmer, revcom_kmer_str ) < 0 ) {
-    return get_kmer( kmer, ks );
-  }
-  else {
-    return get_kmer( revcom_kmer_str, ks );
+  pkmer pk;
+  if ( kmer2pkmer( kmer, ks->k, &pk ) ) {
+    return get_pkmer( canonical_pkmer( pk, ks->k ), ks );
   }
+  return NULL;
 }
 
 
@@ -248,95 +1949,258 @@ klnP get_canonical_kmer( const char* kmer, KSP ks ) {
            1 => was never there!
 */
 int remove_kmer( const char* kmer, KSP ks ) {
-  size_t inx;
-  size_t i;
+  pkmer pk;
+  if ( kmer2pkmer( kmer, ks->k, &pk ) ) {
+    return remove_pkmer( pk, ks );
+  }
+  return 1;
+}
+
+/* remove_pkmer for a counting mode KSP_TRIE: zero the counter,
+   and give back the counter block once all four are zero */
+static int remove_counted_pkmer( pkmer kmer, KSP ks ) {
+  size_t kmer_pos;
+  unsigned int base;
+  void** slot;
+  void* cnts;
+
+  if ( ks->compress ) {
+    slot = find_cnts_slot_chained( kmer, ks, NULL, NULL );
+    if ( slot == NULL ) {
+      return 1;
+    }
+  }
+  else {
+    slot = (void**)&ks->ka[ pkmer_ka_inx( kmer, ks ) ];
+    for( kmer_pos = ks->k_ar_size; kmer_pos < ks->k - 1; kmer_pos++ ) {
+      if ( *slot == NULL ) {
+	return 1;
+      }
+      slot = &((ktnP)*slot)->np[ pkmer_base( kmer, ks->k, kmer_pos ) ];
+    }
+  }
+  cnts = *slot;
+  base = pkmer_base( kmer, ks->k, ks->k - 1 );
+  if ( (cnts == NULL) || (cnt_get( ks, cnts, base ) == 0) ) {
+    return 1;
+  }
+  cnt_remove( ks, cnts, base, kmer );
+  if ( (cnt_get( ks, cnts, 0 ) | cnt_get( ks, cnts, 1 ) |
+	cnt_get( ks, cnts, 2 ) | cnt_get( ks, cnts, 3 )) == 0 ) {
+    pool_free( &ks->cnt_pool, cnts );
+    *slot = NULL;
+    ks->level_nodes[ ks->k - 1 - ks->k_ar_size ]--;
+  }
+  return 0;
+}
+
+/* remove_pkmer
+   Packed version of remove_kmer.
+   Returns 0 => was present, now it's gone
+           1 => was never there!
+*/
+int remove_pkmer( pkmer kmer, KSP ks ) {
+  size_t kmer_pos;
+  unsigned int base;
   ktnP curr_node;
-  ktnP next_node;
   klnP last_node;
-  //ktnP curr_node, next_node;
-  size_t kmer_pos;
-  char next_base;
-
-  /* Find what the index position is for the first K_AR_SIZE
-     bases in this kmer */
-  if ( kmer2inx( kmer, ks->k_ar_size, &inx ) ) {
-  
-    /* Start at the index position of the first ks->k_ar_size bases */
-    curr_node = (ktnP)ks->ka[inx];
-    
-    /* If we've never seen that before, then we're done */
+
+  if ( ks->backend == KSP_HASH ) {
+    return kht_remove( ks->ht, kmer );
+  }
+  if ( ks->backend == KSP_SKETCH ) {
+    return 1; // can't be taken out
+  }
+  if ( ks->backend == KSP_DENSE ) {
+    if ( cnt_get( ks, ks->dense, (size_t)kmer ) == 0 ) {
+      return 1;
+    }
+    cnt_remove( ks, ks->dense, (size_t)kmer, kmer );
+    return 0;
+  }
+  if ( ks->count_bits ) {
+    return remove_counted_pkmer( kmer, ks );
+  }
+
+  /* Start at the index position of the first ks->k_ar_size bases */
+  curr_node = ks->ka[ pkmer_ka_inx( kmer, ks ) ];
+
+  for( kmer_pos = ks->k_ar_size; kmer_pos < ks->k - 1; kmer_pos++ ) {
     if ( curr_node == NULL ) {
       return 1;
     }
-    kmer_pos = ks->k_ar_size;
-
-    while( kmer_pos < ks->k - 1 ) {
-      next_base = toupper(kmer[kmer_pos]);
-      switch( next_base ) {
-      case 'A' :
-        if ( curr_node->Ap == NULL ) {
-	  return 1;
-        }
-        next_node = curr_node->Ap;
-        break;
-      case 'C' :
-        if ( curr_node->Cp == NULL ) {
-	  return 1;
-        }
-        next_node = curr_node->Cp;
-        break;
-      case 'G' :
-        if ( curr_node->Gp == NULL ) {
-	  return 1;
-        }
-        next_node = curr_node->Gp;
-        break;
-      case 'T' :
-        if ( curr_node->Tp == NULL ) {
-	  return 1;
-        }
-        next_node = curr_node->Tp;
-        break;
-      default :
-        // not a good base, not a good kmer, we're done
-        return 1;
-      }
-      curr_node = next_node;
-      kmer_pos++;
+    curr_node = curr_node->np[ pkmer_base( kmer, ks->k, kmer_pos ) ];
+  }
+  if ( curr_node == NULL ) {
+    return 1;
+  }
+  /* Now, the final base => leaf node */
+  base = pkmer_base( kmer, ks->k, kmer_pos );
+  last_node = curr_node->np[base];
+  if ( last_node == NULL ) {
+    return 1;
+  }
+  curr_node->np[base] = NULL;
+  if ( ks->owns_data ) {
+    pool_free( &ks->data_pool, last_node->data );
+  }
+  else {
+    free_kln_data( last_node );
+  }
+  pool_free( &ks->kln_pool, last_node );
+  return 0;
+}
+
+/* ksp_prune for the tree below node, on level (0 is right below
+   the array part), whose kmers start with prefix: takes out the
+   kmers with counts outside min to
+   max, adding how many to *removed, and gives back every node that
+   has nothing left under it.
+   Returns: what goes where node was: node, or NULL if it's gone */
+static void* prune_node( KSP ks, void* node, size_t level, pkmer prefix,
+			 size_t min, size_t max, size_t* removed ) {
+  size_t n_levels = ks->k - ks->k_ar_size;
+  size_t count;
+  unsigned int base;
+  int any = 0;
+  ktnP tree_node;
+  klnP leaf;
+  kcnP c;
+
+  if ( IS_CHAIN( node ) ) {
+    c = CHAIN_OF( node );
+    if ( c->next != NULL ) {
+      c->next = prune_node( ks, c->next, level + c->len,
+			    (prefix << (2 * c->len)) | c->label,
+			    min, max, removed );
     }
-    /* Now, the final base => leaf node */
-    next_base = toupper(kmer[kmer_pos]);
-    switch(next_base) {
-    case 'A':
-      last_node = curr_node->Ap;
-      curr_node->Ap = NULL;
-      break;
-    case 'C' :
-      last_node = curr_node->Cp;
-      curr_node->Cp = NULL;
-      break;
-    case 'G' :
-      last_node = curr_node->Gp;
-      curr_node->Gp = NULL;
-      break;
-    case 'T' :
-      last_node = curr_node->Tp;
-      curr_node->Tp = NULL;
-      break;
-    default :
-      last_node = NULL;
+    if ( c->next != NULL ) {
+      return node;
     }
-    if ( last_node == NULL ) {
-      return 1;
+    pool_free( &ks->ktn_pool, c );
+    ks->n_chains--;
+    return NULL;
+  }
+  if ( level == n_levels ) { // a leaf node
+    leaf = (klnP)node;
+    count = ks->owns_data ? *(size_t*)leaf->data : 1;
+    if ( (count >= min) && (count <= max) ) {
+      return node;
+    }
+    if ( ks->owns_data ) {
+      pool_free( &ks->data_pool, leaf->data );
     }
     else {
-      free_kln_data( last_node );
-      free( last_node );
+      free_kln_data( leaf );
     }
+    pool_free( &ks->kln_pool, leaf );
+    (*removed)++;
+    return NULL;
   }
-  else { // didn't even see the beginning part of the kmer
-    return 1;
+  if ( ks->count_bits && (level == n_levels - 1) ) { // a counter block
+    for( base = 0; base < 4; base++ ) {
+      count = cnt_count( ks, node, base, (prefix << 2) | base );
+      if ( count == 0 ) {
+	continue;
+      }
+      if ( (count >= min) && (count <= max) ) {
+	any = 1;
+      }
+      else {
+	cnt_remove( ks, node, base, (prefix << 2) | base );
+	(*removed)++;
+      }
+    }
+    if ( any ) {
+      return node;
+    }
+    pool_free( &ks->cnt_pool, node );
+    ks->level_nodes[level]--;
+    return NULL;
+  }
+
+  tree_node = (ktnP)node;
+  for( base = 0; base < 4; base++ ) {
+    if ( tree_node->np[base] != NULL ) {
+      tree_node->np[base] = prune_node( ks, tree_node->np[base], level + 1,
+					(prefix << 2) | base, min, max,
+					removed );
+      any |= (tree_node->np[base] != NULL);
+    }
   }
+  if ( any ) {
+    return node;
+  }
+  pool_free( &ks->ktn_pool, node );
+  ks->level_nodes[level]--;
+  return NULL;
+}
+
+/* ksp_prune
+   Args: KSP ks - the kmers
+         size_t min_count, max_count - counts of the kmers to keep
+   Takes out every kmer with a count below min_count or above
+   max_count, and in a KSP_TRIE gives back every tree node (and
+   chain node) left with nothing under it, for new kmers to use.
+   Counts are as in ksp_foreach, so a KSP_TRIE whose leaf data
+   isn't counts has 1 for everything. Kmers that are only in the
+   bloom filter can't be taken out (and count_hist still sees
+   them), and nothing in a KSP_SKETCH can. ks must not be changed
+   by other threads while this runs, but it can be called between
+   chunks of input, to shed kmers that won't matter and keep a long
+   count in less memory.
+   Returns: number of kmers taken out
+*/
+size_t ksp_prune( KSP ks, size_t min_count, size_t max_count ) {
+  size_t i, j, count, removed = 0;
+  uint64_t bits;
+  kheP e;
+
+  if ( ks->backend == KSP_SKETCH ) {
+    fprintf( stderr, "ERROR: A count-min sketch can't list its kmers.\n" );
+    exit( 1 );
+  }
+  if ( ks->backend == KSP_HASH ) {
+    i = 0;
+    while( i < ks->ht->size ) {
+      e = &ks->ht->slots[i];
+      if ( (e->count != 0) &&
+	   ((e->count < min_count) || (e->count > max_count)) ) {
+	kht_remove( ks->ht, e->key );
+	removed++;
+	continue; // something else may have moved up into slot i
+      }
+      i++;
+    }
+    return removed;
+  }
+  if ( ks->backend == KSP_DENSE ) {
+    for( i = 0; i < ks->dense_len; i++ ) {
+      count = cnt_count( ks, ks->dense, i, (pkmer)i );
+      if ( (count != 0) && ((count < min_count) || (count > max_count)) ) {
+	cnt_remove( ks, ks->dense, i, (pkmer)i );
+	removed++;
+      }
+    }
+    return removed;
+  }
+
+  for( i = 0; i < ks->ka_len; i += 64 ) {
+    bits = ks->ka_occ[i / 64];
+    while( bits != 0 ) {
+      j = i + __builtin_ctzll( bits );
+      bits &= bits - 1;
+      if ( ks->ka[j] != NULL ) {
+	ks->ka[j] = prune_node( ks, ks->ka[j], 0, (pkmer)j,
+				min_count, max_count, &removed );
+      }
+      if ( ks->ka[j] == NULL ) { // nothing left in this slot
+	ks->ka_occ[j / 64] &= ~((uint64_t)1 << (j % 64));
+	ks->ka_used--;
+      }
+    }
+  }
+  return removed;
 }
 
 void free_kln_data( klnP kp ) {
@@ -356,7 +2220,7 @@ void free_kln_data( klnP kp ) {
          (3) pointer to size_t to put the index
    Returns: TRUE if the index was set, FALSE if it could not
             be set because of some non A,C,G,T character
-   Uses the formula A=>00, C=>01, G=>11, T=>11 to make a
+   Uses the formula A=>00, C=>01, G=>10, T=>11 to make a
    bit string for the kmer. Any other character is not allowed
    and will cause an error.
    The bit string is constructed by reading the kmer from left
@@ -367,34 +2231,155 @@ int kmer2inx( const char* kmer,
               const size_t kmer_len,
               size_t* inx ) {
   size_t l_inx  = 0;
-  int i = 0;
-  char curr_char;
+  size_t i = 0;
+  unsigned char code;
 
   while( i < kmer_len ) {
-    l_inx = l_inx << 2;
-    curr_char = toupper(kmer[i]); // Upper case it in case it is not
-    switch( curr_char ) {
-    case 'A' :
-      l_inx += 0;
-      break;
-    case 'C' :
-      l_inx += 1;
-      break;
-    case 'G' :
-      l_inx += 2;
-      break;
-    case 'T' :
-      l_inx += 3;
-      break;
-    default :
+    code = base2bits[ (unsigned char)kmer[i] ];
+    if ( code > 3 ) {
       return 0; // not valid!
     }
+    l_inx = (l_inx << 2) | code;
     i++;
   }
   *inx = l_inx;
   return 1; // valid!
 }
 
+/* kmer2pkmer
+   Args: (1) pointer to the kmer characters; need not be
+             null-terminated
+         (2) k, the length of the kmer
+         (3) pointer to the pkmer to fill in
+   Returns: TRUE if the kmer was packed, FALSE if it contains
+            some non A,C,G,T character
+   Same encoding as kmer2inx, but for the whole kmer
+*/
+int kmer2pkmer( const char* kmer, size_t k, pkmer* pk ) {
+  pkmer l_pk = 0;
+  size_t i;
+  unsigned char code;
+
+  for( i = 0; i < k; i++ ) {
+    code = base2bits[ (unsigned char)kmer[i] ];
+    if ( code > 3 ) {
+      return 0;
+    }
+    l_pk = (l_pk << 2) | code;
+  }
+  *pk = l_pk;
+  return 1;
+}
+
+/* pkmer2kmer
+   Unpacks pk into the k upper case characters at kmer and
+   null-terminates it, so kmer must have room for k+1 chars
+*/
+void pkmer2kmer( pkmer pk, size_t k, char* kmer ) {
+  static const char bases[4] = { 'A', 'C', 'G', 'T' };
+  size_t i;
+  for( i = 0; i < k; i++ ) {
+    kmer[i] = bases[ pkmer_base( pk, k, i ) ];
+  }
+  kmer[k] = '\0';
+}
+
+/* pkmer_mask
+   Returns the pkmer with the low 2*k bits set, i.e., all the
+   bits that a packed kmer of length k can use
+*/
+pkmer pkmer_mask( size_t k ) {
+  if ( 2 * k >= sizeof(pkmer) * CHAR_BIT ) {
+    return ~(pkmer)0;
+  }
+  return ((pkmer)1 << (2 * k)) - 1;
+}
+
+/* Reverses the order of the 32 2-bit groups in a 64-bit word */
+static inline uint64_t reverse_2bit_64( uint64_t x ) {
+  x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+  x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return __builtin_bswap64( x );
+}
+
+/* revcom_pkmer
+   Packed version of revcom_kmer. Complementing is just flipping
+   every bit (A<->T, C<->G); reversing the 2-bit groups across the
+   whole word leaves the kmer at the top, so shift it back down.
+*/
+pkmer revcom_pkmer( pkmer pk, size_t k ) {
+  pkmer rc;
+#if MAX_K <= 32
+  rc = reverse_2bit_64( ~pk );
+#else
+  rc = ((pkmer)reverse_2bit_64( (uint64_t)~pk ) << 64) |
+    reverse_2bit_64( (uint64_t)(~pk >> 64) );
+#endif
+  return rc >> (sizeof(pkmer) * CHAR_BIT - 2 * k);
+}
+
+/* canonical_pkmer
+   Returns whichever of pk and its reverse complement is smaller.
+   Since A<C<G<T in the encoding, this is the same choice that
+   strcmp makes in add_canonical_kmer
+*/
+pkmer canonical_pkmer( pkmer pk, size_t k ) {
+  pkmer rc;
+  rc = revcom_pkmer( pk, k );
+  return rc < pk ? rc : pk;
+}
+
+/* next_canonical_kmer for any k: what init_kmer_iter gives it->next
+   when there's no copy just for k. See next_canonical_kmer */
+static int next_kmer_any( KIterP it, pkmer* kmer, size_t* pos ) {
+  unsigned char code;
+  size_t top = 2 * (it->k - 1); // bit position of the first base
+
+  while( it->i < it->len ) {
+    code = base2bits[ (unsigned char)it->seq[ it->i++ ] ];
+    if ( code > 3 ) {
+      if ( code == BASE_SKIP ) {
+	it->skipped++;
+      }
+      else {
+	it->clean = 0;
+      }
+      continue;
+    }
+    it->fwd = ((it->fwd << 2) | code) & it->mask;
+    it->rev = (it->rev >> 2) | ((pkmer)(3 - code) << top);
+    if ( ++it->clean >= it->k ) {
+      *kmer = it->rev < it->fwd ? it->rev : it->fwd;
+      *pos  = it->i - it->skipped - it->k;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* init_kmer_iter
+   Sets up it to walk the kmers of the len characters at seq.
+   Use it like this:
+     init_kmer_iter( &it, chr->seq, chr->len, ks->k );
+     while( next_canonical_kmer( &it, &kmer, &pos ) ) {
+       ...
+     }
+*/
+void init_kmer_iter( KIterP it, const char* seq, size_t len, size_t k ) {
+  const KSpec* spec;
+  it->seq     = seq;
+  it->len     = len;
+  it->k       = k;
+  it->i       = 0;
+  it->clean   = 0;
+  it->skipped = 0;
+  it->fwd     = 0;
+  it->rev     = 0;
+  it->mask    = pkmer_mask( k );
+  spec = find_kspec( k );
+  it->next    = (spec == NULL) ? next_kmer_any : spec->next_kmer;
+}
+
 void revcom_kmer( char* kmer, size_t k ) {
   char tmp;
   size_t i;
@@ -463,3 +2448,145 @@ klnP init_kln( void ) {
   new_kln->data = NULL;
   return new_kln;
 }
+
+/* init_ktn and init_kln make stand-alone nodes with malloc. Nodes
+   inside a KSP come from its pools (see pool_alloc) instead */
+
+/* init_pool
+   Sets up an empty pool of node_size byte nodes. No memory is
+   taken until the first pool_alloc
+*/
+void init_pool( NpoolP pool, size_t node_size ) {
+  if ( node_size < sizeof(void*) ) { // need room for the free list link
+    node_size = sizeof(void*);
+  }
+  pool->node_size = node_size;
+  pool->next      = NULL;
+  pool->end       = NULL;
+  pool->free_list = NULL;
+  pool->slabs     = NULL;
+  pool->n_slabs   = 0;
+  pool->n_used    = 0;
+}
+
+/* pool_alloc
+   Returns: pointer to an uninitialized node from pool. Recycled
+            nodes come first, then the next one in the current slab;
+            a new slab is started when that one runs out
+*/
+void* pool_alloc( NpoolP pool ) {
+  void* node;
+  void* slab;
+  if ( pool->free_list != NULL ) {
+    node = pool->free_list;
+    pool->free_list = *(void**)node;
+    pool->n_used++;
+    return node;
+  }
+  if ( pool->next + pool->node_size > pool->end ) {
+    if ( posix_memalign( &slab, SLAB_HEADER, SLAB_SIZE ) ) {
+      fprintf( stderr, "ERROR: Out of memory for kmer nodes\n" );
+      exit( 1 );
+    }
+    *(void**)slab = pool->slabs;
+    pool->slabs = slab;
+    pool->n_slabs++;
+    pool->next = (char*)slab + SLAB_HEADER;
+    pool->end  = (char*)slab + SLAB_SIZE;
+  }
+  node = pool->next;
+  pool->next += pool->node_size;
+  pool->n_used++;
+  return node;
+}
+
+/* pool_free
+   Puts node back in pool to be handed out again by pool_alloc
+*/
+void pool_free( NpoolP pool, void* node ) {
+  if ( node == NULL ) {
+    return;
+  }
+  *(void**)node = pool->free_list;
+  pool->free_list = node;
+  pool->n_used--;
+}
+
+/* free_pool
+   Frees every slab of pool, and with them every node that ever
+   came from it. The pool is empty (but usable) afterward
+*/
+void free_pool( NpoolP pool ) {
+  void* slab;
+  void* prev;
+  slab = pool->slabs;
+  while( slab != NULL ) {
+    prev = *(void**)slab;
+    free( slab );
+    slab = prev;
+  }
+  init_pool( pool, pool->node_size );
+}
+
+/* What simd_level returns; -1 till it has looked */
+static int simd_use = -1;
+
+/* The best SIMD_ level this CPU has (cpuid) */
+static int simd_cpu_level( void ) {
+  int max = SIMD_SCALAR;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "sse2" ) ) {
+    max = SIMD_SSE2;
+  }
+  if ( __builtin_cpu_supports( "avx2" ) ) {
+    max = SIMD_AVX2;
+  }
+  if ( __builtin_cpu_supports( "avx512bw" ) ) {
+    max = SIMD_AVX512;
+  }
+#endif
+  return max;
+}
+
+/* simd_level
+   Returns: the SIMD_ level of the kernels to use: the best this CPU
+            has, found once (with cpuid) and remembered. The
+            KMER_SIMD environment variable (scalar, sse2, avx2, or
+            avx512) can set it lower, to try the other kernels
+*/
+int simd_level( void ) {
+  const char* cap;
+  int i, max;
+
+  if ( simd_use >= 0 ) {
+    return simd_use;
+  }
+  max = simd_cpu_level();
+  cap = getenv( "KMER_SIMD" );
+  if ( cap != NULL ) {
+    for( i = SIMD_SCALAR; i < max; i++ ) {
+      if ( strcmp( cap, simd_level_name( i ) ) == 0 ) {
+	max = i;
+      }
+    }
+  }
+  simd_use = max; // threads that get here at once all find the same
+  return simd_use;
+}
+
+/* set_simd_level
+   Args: int level - SIMD_ level of the kernels to use from now on
+   Returns: the level that will be used: level, or the best this CPU
+            has if that's lower. For trying each kernel in turn
+*/
+int set_simd_level( int level ) {
+  int max = simd_cpu_level();
+  simd_use = (level < max) ? level : max;
+  return simd_use;
+}
+
+const char* simd_level_name( int level ) {
+  static const char* names[] = { "scalar", "sse2", "avx2", "avx512" };
+  return names[level];
+}
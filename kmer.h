@@ -1,16 +1,68 @@
+#ifndef KMER_H
+#define KMER_H
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#ifndef MAX_K
 #define MAX_K (63) // biggest K we can deal with
-#define K_AR_SIZE (14) // default length of the array size of the kmer structure
+#endif
+#define K_AR_SIZE (14) // default (and biggest) length of the array size of the kmer structure
 #define MAX_HKC_PER_K (64) // biggest number of HKC that a k can point to
 
+/* Backends for a KSP, chosen at init_KSP_opts time */
+#define KSP_TRIE (0) // array of 4-ary trees; the default
+#define KSP_HASH (1) // open addressing hash table with inline counts
+#define KSP_DENSE (2) // flat array with a counter for every possible kmer
+#define KSP_SKETCH (3) // count-min sketch: approximate counts, fixed memory
+
+#define DENSE_MAX_BYTES (1<<28) // default memory budget for KSP_DENSE
+#define SKETCH_BYTES (1<<28)    // default memory for KSP_SKETCH
+#define BLOOM_BLOCK (8)   // 64-bit words per bloom filter block (a cache line)
+#define BLOOM_HASHES (4)  // bits set in a block for each kmer
+#define BLOOM_LOCKS (4096) // spin locks for the _mt calls, each for many blocks
+#define LOOKUP_BATCH (16) // kmers get_kmers_batch walks down together
+#define FOREACH_BLOCK (1<<16) // slots a ksp_foreach_mt thread takes at a time
+
+/* SIMD levels of the kernels that come in more than one version,
+   from worst to best. All are in every build; simd_level picks
+   what this CPU can run */
+#define SIMD_SCALAR (0)
+#define SIMD_SSE2   (1) // every x86-64
+#define SIMD_AVX2   (2)
+#define SIMD_AVX512 (3) // AVX-512BW
+
+/* Packed k-mers: two bits per base, A=>00, C=>01, G=>10, T=>11,
+   with the first base of the kmer in the most significant bits.
+   A 64-bit word holds any k <= 32; build with -DMAX_K=32 to get
+   that narrower (faster) type. Otherwise we need 128 bits. */
+#if MAX_K <= 32
+typedef uint64_t pkmer;
+#else
+typedef unsigned __int128 pkmer;
+#endif
+
+/* 2-bit code for each character; BASE_BAD for anything that is not
+   A, C, G, or T (either case), except whitespace, which is BASE_SKIP
+   so that the kmer iterator can walk fasta lines as they are in the
+   file, line ends and all */
+extern const unsigned char base2bits[256];
+#define BASE_BAD  (4)
+#define BASE_SKIP (5)
+
+/* Children are indexed by 2-bit base code via np[], or by name */
 typedef struct kmer_tree_node {
-  void* Ap;
-  void* Cp;
-  void* Gp;
-  void* Tp;
+  union {
+    struct {
+      void* Ap;
+      void* Cp;
+      void* Gp;
+      void* Tp;
+    };
+    void* np[4];
+  };
 } ktn;
 typedef struct kmer_tree_node* ktnP;
 
@@ -20,21 +72,244 @@ typedef struct kmer_leaf_node {
 } kln;
 typedef struct kmer_leaf_node* klnP;
 
+/* A run of tree levels that each have just one child, squeezed into
+   one node (see KSPOpts compress). It comes from the same pool as
+   tree nodes and is no bigger. Pointers to one have CHAIN_TAG set,
+   so they can sit in a tree node or the array part like any other
+   child. */
+typedef struct kmer_chain_node {
+  pkmer label;  // the bases of the run, packed, the last one lowest
+  void* next;   // the node right below the run
+  uint32_t len; // number of bases (levels) in the run
+} kcn;
+typedef struct kmer_chain_node* kcnP;
+#define CHAIN_TAG (1)
+
+/* Slab allocator for the fixed size nodes of a KSP. Nodes are cut
+   from big slabs one after another; removed nodes go on a free list
+   (linked through their first word) to be handed out again. The
+   slabs are chained through their first word, so freeing the whole
+   pool is one free per slab. */
+typedef struct node_pool {
+  size_t node_size;
+  char* next;      // next unused node in the current slab
+  char* end;       // end of the current slab
+  void* free_list; // nodes given back by pool_free
+  void* slabs;     // most recent slab; each points to the one before
+  size_t n_slabs;
+  size_t n_used;   // nodes handed out and not given back
+} Npool;
+typedef struct node_pool* NpoolP;
+
+#define SLAB_SIZE (1<<20) // bytes per slab
+#define SLAB_HEADER (64)  // keeps nodes cache line aligned
+
+/* Code made for one k (see KSPEC_LIST in kmer.c), so that the
+   compiler could unroll and simplify it */
+struct kmers;
+struct kmer_iter;
+typedef struct kmer_spec {
+  size_t k;
+  void* (*find_cnts)( pkmer kmer, struct kmers* ks,
+		      NpoolP ktn_pool, NpoolP cnt_pool );
+  int (*next_kmer)( struct kmer_iter* it, pkmer* kmer, size_t* pos );
+} KSpec;
+
 typedef struct kmers {
   size_t k; // length of kmers
   size_t k_ar_size ; // length of kmer part that we'll handle in the array
                  // and not the tree
   ktnP* ka; // the array part;
+  size_t ka_len; // number of slots in ka, 4^k_ar_size
+  uint64_t* ka_occ; // bit i set => ka[i] has (or had) a tree, so
+                    // walks can skip the empty stretches of ka
+  size_t ka_used;   // number of bits set in ka_occ
+  size_t level_nodes[MAX_K]; // tree nodes (or counter blocks) made at
+                             // each level below the array part
+  int backend; // KSP_TRIE, KSP_HASH, KSP_DENSE, or KSP_SKETCH
+  struct kmer_hash* ht; // the table, for KSP_HASH
+  struct kmer_cms* cms; // the sketch, for KSP_SKETCH
+  struct kmer_hash* ovf; // 8-bit counters: counts past UINT8_MAX
+  void* dense;     // KSP_DENSE: 4^k counters indexed by packed kmer
+  size_t dense_len;
+  Npool ktn_pool;  // tree nodes
+  Npool kln_pool;  // leaf nodes
+  Npool data_pool; // counts of increment_or_insert_pkmer
+  int owns_data;   // TRUE => leaf data are counts from data_pool
+  int count_bits;  // 0, or counter width for counting mode
+  Npool cnt_pool;  // counting mode: blocks of 4 counters
+  int compress;    // TRUE => unary runs of the tree are chain nodes
+  const KSpec* spec; // code just for this k, or NULL
+  size_t n_chains; // chain nodes in use
+  int n_threads;   // for increment_or_insert_pkmer_mt
+  NpoolP thread_pools; // tree node and counter pools for each thread
+  pthread_mutex_t lock; // for _mt calls that can't do without one
+  uint64_t* bloom;      // singleton screen, or NULL; BLOOM_BLOCK
+                        // bit blocks
+  size_t bloom_mask;    // number of blocks - 1
+  char bloom_locks[BLOOM_LOCKS]; // block b is locked by b % BLOOM_LOCKS
+  size_t bloom_new;     // kmers that were new to the bloom filter
+  size_t bloom_promoted; // kmers put in the KSP on their 2nd sighting
 } Kmers;
 typedef struct kmers* KSP;
 
+/* Options for init_KSP_opts */
+typedef struct ksp_opts {
+  int backend;     // KSP_TRIE, KSP_HASH, KSP_DENSE, or KSP_SKETCH
+  size_t expected; // expected number of distinct kmers; 0 => no idea.
+                   // Sizes the array part of a KSP_TRIE or the table
+                   // of a KSP_HASH
+  int count_bits;  // KSP_TRIE: 8, 16, or 32 => counting mode with
+                   // counters this wide in place of leaf nodes (8
+                   // bit ones go on in an overflow table, so counts
+                   // are still exact);
+                   // KSP_SKETCH: counter width (default 16)
+  size_t dense_bytes; // a counting KSP_TRIE becomes KSP_DENSE if
+                      // 4^k counters fit in this many bytes
+  int threads;     // number of threads that will call the _mt
+                   // functions at once
+  size_t sketch_bytes; // memory for the counters of a KSP_SKETCH
+  size_t bloom_bytes; // > 0 => kmers seen once only go in a bloom
+                      // filter this big (not for KSP_DENSE or
+                      // KSP_SKETCH)
+  int compress;    // counting mode KSP_TRIE: TRUE => runs of tree
+                   // nodes with one child each are one chain node
+} KSPOpts;
+typedef struct ksp_opts* KSPOptsP;
+
+/* Where the memory of a KSP goes, from ksp_stats. The node counts
+   are kept up to date as the KSP is built, so getting them costs
+   next to nothing */
+typedef struct ksp_stats {
+  int backend;
+  size_t tree_nodes;  // inner nodes (ktn) in use
+  size_t chain_nodes; // chain nodes (kcn) in use
+  size_t leaf_nodes;  // leaf nodes (kln) in use
+  size_t data_blocks; // counts hung on leaves by increment_or_insert_pkmer
+  size_t cnt_blocks;  // counting mode blocks of 4 counters
+  size_t n_levels;    // levels of tree below the array part
+  size_t level_nodes[MAX_K]; // nodes at each level (not chain nodes);
+                             // the last level of a counting mode KSP
+                             // is counter blocks
+  size_t level_bytes[MAX_K];
+  double branching;   // average children of a tree node
+  size_t ka_slots;    // slots in the array part
+  size_t ka_used;     // slots that have (or had) a tree
+  size_t ka_bytes;
+  size_t pool_bytes;  // slabs of every node pool, used or not
+  size_t table_bytes; // KSP_HASH table, KSP_DENSE array, or sketch
+  size_t bloom_bytes;
+  size_t ovf_kmers;   // kmers in the overflow table of 8-bit counters
+  size_t ovf_bytes;
+  size_t n_kmers;     // distinct kmers when that's known for free
+                      // (KSP_HASH), 0 otherwise
+  size_t total_bytes;
+} KSPStats;
+typedef struct ksp_stats* KSPStatsP;
+
+/* Buffer that scatters kmers into one bucket per thread by prefix,
+   so that a KSP can be built in parallel with no shared writes.
+   See init_kscatter */
+typedef struct kmer_scatter {
+  struct kmers* ks;
+  int threads;
+  pkmer** buckets; // one for each thread
+  size_t* n;       // number of kmers in each bucket
+  size_t cap;      // room in each bucket
+  size_t part_shift; // kmer >> part_shift is the partition number
+} KScatter;
+typedef struct kmer_scatter* KScatterP;
+
+#define SCATTER_CAP (1<<20) // good bucket size for init_kscatter
+
+/* Iterator over the canonical kmers of a sequence. Keeps the
+   forward and reverse complement packed kmers up to date one base
+   at a time, so each step is O(1) instead of O(k) */
+typedef struct kmer_iter {
+  const char* seq; // sequence being walked, e.g., ChrP->seq
+  size_t len;      // length of seq
+  size_t k;
+  size_t i;        // next position in seq to read
+  size_t clean;    // number of good bases just before i
+  size_t skipped;  // whitespace characters passed so far
+  pkmer fwd;       // last (up to) k bases, as read
+  pkmer rev;       // reverse complement of fwd
+  pkmer mask;      // pkmer_mask( k )
+  int (*next)( struct kmer_iter* it, pkmer* kmer, size_t* pos );
+                   // does next_canonical_kmer, in a copy just for k
+                   // if there is one
+} KIter;
+typedef struct kmer_iter* KIterP;
+
+/* next_canonical_kmer
+   Args: KIterP it - iterator from init_kmer_iter
+         pkmer* kmer - where to put the next canonical packed kmer
+         size_t* pos - where to put its start position in the sequence
+   Returns: TRUE if a kmer was found, FALSE when the sequence is done
+   Kmers that overlap a non A,C,G,T base are skipped: the iterator
+   just starts over and needs k more good bases before the next
+   kmer comes out. Whitespace (like line ends) is stepped over as if
+   it weren't there, and isn't counted in pos.
+*/
+static inline int next_canonical_kmer( KIterP it, pkmer* kmer, size_t* pos ) {
+  return it->next( it, kmer, pos );
+}
+
+/* next_canonical_kmers
+   Args: KIterP it - iterator from init_kmer_iter
+         pkmer* kmers - where to put the next kmers
+         size_t max - room in kmers
+   Returns: how many kmers it got, 0 when the sequence is done.
+   The same kmers as next_canonical_kmer, a block at a time, for
+   increment_or_insert_pkmers
+*/
+static inline size_t next_canonical_kmers( KIterP it, pkmer* kmers,
+					   size_t max ) {
+  size_t n, pos;
+  for( n = 0; (n < max) && it->next( it, &kmers[n], &pos ); n++ )
+    ;
+  return n;
+}
+
+/* What ksp_foreach calls for each kmer */
+typedef void (*KVisitFn)( pkmer kmer, size_t count, void* arg );
+
 /* Function prototypes */
 KSP init_KSP( int k );
+void set_default_KSPOpts( KSPOptsP opts );
+KSP init_KSP_opts( int k, const KSPOptsP opts );
+void free_KSP( KSP ks );
+size_t increment_or_insert_pkmer( pkmer kmer, KSP ks );
+void increment_or_insert_pkmers( const pkmer* kmers, size_t n, KSP ks );
+size_t increment_or_insert_pkmer_mt( pkmer kmer, KSP ks, int tid );
+void increment_or_insert_pkmers_mt( const pkmer* kmers, size_t n,
+				    KSP ks, int tid );
+KScatterP init_kscatter( KSP ks, int threads, size_t cap );
+void kscatter_add( KScatterP sc, pkmer kmer );
+void kscatter_flush( KScatterP sc );
+void free_kscatter( KScatterP sc );
+size_t get_pkmer_count( pkmer kmer, KSP ks );
+void get_kmers_batch( KSP ks, const pkmer* kmers, size_t n, size_t* counts );
+void count_hist( KSP ks, size_t* hist, size_t hist_len );
+void ksp_foreach( KSP ks, KVisitFn fn, void* arg );
+void ksp_foreach_mt( KSP ks, int threads, KVisitFn fn, void** args );
+void ksp_stats( KSP ks, KSPStatsP st );
+void print_ksp_stats( KSP ks, FILE* fp );
 klnP add_kmer( const char* kmer, KSP ks );
 klnP add_canonical_kmer( const char* kmer, KSP ks );
 klnP get_kmer( const char* kmer, KSP ks );
 klnP get_canonical_kmer( const char* kmer, KSP ks );
 int remove_kmer( const char* kmer, KSP ks );
+klnP add_pkmer( pkmer kmer, KSP ks );
+klnP get_pkmer( pkmer kmer, KSP ks );
+int remove_pkmer( pkmer kmer, KSP ks );
+size_t ksp_prune( KSP ks, size_t min_count, size_t max_count );
+int kmer2pkmer( const char* kmer, size_t k, pkmer* pk );
+void pkmer2kmer( pkmer pk, size_t k, char* kmer );
+pkmer revcom_pkmer( pkmer pk, size_t k );
+pkmer canonical_pkmer( pkmer pk, size_t k );
+pkmer pkmer_mask( size_t k );
+void init_kmer_iter( KIterP it, const char* seq, size_t len, size_t k );
 int kmer2inx( const char* kmer,
               const size_t kmer_len,
               size_t* inx );
@@ -43,3 +318,11 @@ char revcom_base( char c );
 ktnP init_ktn( void );
 klnP init_kln( void );
 void free_kln_data( klnP kp );
+void init_pool( NpoolP pool, size_t node_size );
+void* pool_alloc( NpoolP pool );
+void pool_free( NpoolP pool, void* node );
+void free_pool( NpoolP pool );
+int simd_level( void );
+int set_simd_level( int level );
+const char* simd_level_name( int level );
+#endif
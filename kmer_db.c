@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "kmer_db.h"
+#include "kmer_hash.h"
+
+#define KDB_ROUND_UP( x ) (((x) + KDB_ALIGN - 1) & ~(uint64_t)(KDB_ALIGN - 1))
+
+/* What write_kmer_db's ksp_foreach calls share */
+typedef struct db_tally {
+  size_t n_kmers;
+  khe* pairs;       // KSP_HASH: everything, to be sorted first
+  size_t n_pairs;
+} DBTally;
+
+/* init_kdb_writer
+   Args: const char* fn - file to write
+         size_t k - kmer length
+         size_t n_kmers - exactly how many kmers will be added
+         uint32_t flags - for the header, e.g., KDB_ONLY_REPEATS
+   Returns: a writer to give the kmers to with kdb_writer_add, NULL
+            if fn can't be written
+*/
+KDBWriterP init_kdb_writer( const char* fn, size_t k, size_t n_kmers,
+			    uint32_t flags ) {
+  KDBWriterP w;
+  size_t index_len;
+
+  w = (KDBWriterP)malloc(sizeof(KDBWriter));
+  memset( &w->hdr, 0, sizeof(KDBHeader) );
+  memcpy( w->hdr.magic, KDB_MAGIC, sizeof(KDB_MAGIC) );
+  w->hdr.k = k;
+  w->hdr.key_bytes = sizeof(pkmer);
+  w->hdr.count_bits = 32;
+  w->hdr.flags = flags;
+  w->hdr.n_kmers = n_kmers;
+  w->n_added = 0;
+  w->fn = strdup( fn );
+
+  /* Enough index slots for a short search in each (at least two,
+     so shift is less than 2k) */
+  w->hdr.index_bits = 1;
+  while( (w->hdr.index_bits < KDB_MAX_INDEX_BITS) &&
+	 (w->hdr.index_bits < 2 * k) &&
+	 (((uint64_t)KDB_PER_SLOT << w->hdr.index_bits) < n_kmers) ) {
+    w->hdr.index_bits++;
+  }
+  w->shift = 2 * k - w->hdr.index_bits;
+  index_len = (size_t)1 << w->hdr.index_bits;
+  w->hdr.index_off  = KDB_ROUND_UP( sizeof(KDBHeader) );
+  w->hdr.keys_off   = KDB_ROUND_UP( w->hdr.index_off +
+				    (index_len + 1) * sizeof(uint64_t) );
+  w->hdr.counts_off = KDB_ROUND_UP( w->hdr.keys_off +
+				    n_kmers * sizeof(pkmer) );
+  w->hdr.file_len   = w->hdr.counts_off + n_kmers * sizeof(uint32_t);
+
+  /* Keys and counts both get written in order, through two handles
+     on the same file */
+  w->keys_fp = fopen( fn, "wb" );
+  w->counts_fp = (w->keys_fp == NULL) ? NULL : fopen( fn, "r+b" );
+  if ( w->counts_fp == NULL ) {
+    if ( w->keys_fp != NULL ) {
+      fclose( w->keys_fp );
+    }
+    free( w->fn );
+    free( w );
+    return NULL;
+  }
+  fseek( w->keys_fp, w->hdr.keys_off, SEEK_SET );
+  fseek( w->counts_fp, w->hdr.counts_off, SEEK_SET );
+  w->index = (uint64_t*)calloc( index_len + 1, sizeof(uint64_t) );
+  return w;
+}
+
+/* kdb_writer_add
+   Adds kmer with its count; kmers must come in sorted order
+*/
+void kdb_writer_add( KDBWriterP w, pkmer kmer, size_t count ) {
+  uint32_t c = (count > UINT32_MAX) ? UINT32_MAX : (uint32_t)count;
+  fwrite( &kmer, sizeof(pkmer), 1, w->keys_fp );
+  fwrite( &c, sizeof(uint32_t), 1, w->counts_fp );
+  w->index[ (size_t)(kmer >> w->shift) + 1 ]++;
+  w->hdr.total += count;
+  w->n_added++;
+}
+
+/* finish_kdb_writer
+   Writes the header and the index, closes the file, and frees w
+   Returns: 0 if all went well, -1 if not (including if the number
+            of kmers added isn't what init_kdb_writer was told)
+*/
+int finish_kdb_writer( KDBWriterP w ) {
+  size_t index_len, i;
+  int ok;
+
+  /* Counts per slot => where each slot starts */
+  index_len = (size_t)1 << w->hdr.index_bits;
+  for( i = 0; i < index_len; i++ ) {
+    w->index[i+1] += w->index[i];
+  }
+  fseek( w->keys_fp, 0, SEEK_SET );
+  fwrite( &w->hdr, sizeof(KDBHeader), 1, w->keys_fp );
+  fseek( w->keys_fp, w->hdr.index_off, SEEK_SET );
+  fwrite( w->index, sizeof(uint64_t), index_len + 1, w->keys_fp );
+
+  ok = (w->n_added == w->hdr.n_kmers);
+  ok = (fclose( w->counts_fp ) == 0) && ok;
+  ok = (fclose( w->keys_fp ) == 0) && ok;
+  /* Make sure the end is there even with no kmers after the gaps */
+  ok = ok && (truncate( w->fn, w->hdr.file_len ) == 0);
+  free( w->index );
+  free( w->fn );
+  free( w );
+  return ok ? 0 : -1;
+}
+
+/* First pass: how many */
+static void tally_kmer( pkmer kmer, size_t count, void* arg ) {
+  ((DBTally*)arg)->n_kmers++;
+}
+
+/* Second pass: the kmers come in sorted, so they go straight out */
+static void write_kmer( pkmer kmer, size_t count, void* arg ) {
+  kdb_writer_add( (KDBWriterP)arg, kmer, count );
+}
+
+/* Second pass for a KSP_HASH, which isn't in order */
+static void gather_kmer( pkmer kmer, size_t count, void* arg ) {
+  DBTally* t = (DBTally*)arg;
+  t->pairs[t->n_pairs].key = kmer;
+  t->pairs[t->n_pairs].count = (count > UINT32_MAX) ? UINT32_MAX : count;
+  t->n_pairs++;
+}
+
+static int pair_cmp( const void* a, const void* b ) {
+  pkmer ka = ((const khe*)a)->key;
+  pkmer kb = ((const khe*)b)->key;
+  return (ka > kb) - (ka < kb);
+}
+
+/* write_kmer_db
+   Args: KSP ks - counted kmers (not a KSP_SKETCH)
+         const char* fn - file to write
+         uint32_t flags - KDB_ONLY_REPEATS if ks only has the kmers
+                          seen more than once. Kmers that are only
+                          in a bloom filter can't go in the file,
+                          so that flag is set for those on its own.
+   Returns: 0 if all went well, -1 if fn couldn't be written
+*/
+int write_kmer_db( KSP ks, const char* fn, uint32_t flags ) {
+  DBTally t;
+  KDBWriterP w;
+  size_t i;
+
+  memset( &t, 0, sizeof(DBTally) );
+  ksp_foreach( ks, tally_kmer, &t );
+  if ( ks->bloom != NULL ) {
+    flags |= KDB_ONLY_REPEATS;
+  }
+  w = init_kdb_writer( fn, ks->k, t.n_kmers, flags );
+  if ( w == NULL ) {
+    return -1;
+  }
+
+  if ( ks->backend == KSP_HASH ) {
+    t.pairs = (khe*)malloc(sizeof(khe) * (t.n_kmers + 1));
+    ksp_foreach( ks, gather_kmer, &t );
+    qsort( t.pairs, t.n_pairs, sizeof(khe), pair_cmp );
+    for( i = 0; i < t.n_pairs; i++ ) {
+      kdb_writer_add( w, t.pairs[i].key, t.pairs[i].count );
+    }
+    free( t.pairs );
+  }
+  else {
+    ksp_foreach( ks, write_kmer, w );
+  }
+  return finish_kdb_writer( w );
+}
+
+/* Returns: 1 if a part of n items of size bytes starting at off ends
+   at or before len, 0 if not (checked without overflowing) */
+static int kdb_part_fits( uint64_t off, uint64_t n, size_t size,
+			  uint64_t len ) {
+  return (off <= len) && (n <= (len - off) / size);
+}
+
+/* open_kmer_db
+   Args: const char* fn - file made by write_kmer_db
+   Returns: the database, mapped read-only, NULL if fn can't be
+            opened or isn't a database this build can read
+*/
+KDBP open_kmer_db( const char* fn ) {
+  KDBP db;
+  struct stat st;
+  int fd;
+  void* map;
+  const KDBHeader* hdr;
+
+  fd = open( fn, O_RDONLY );
+  if ( fd < 0 ) {
+    return NULL;
+  }
+  if ( (fstat( fd, &st ) != 0) || (st.st_size < sizeof(KDBHeader)) ) {
+    close( fd );
+    return NULL;
+  }
+  map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd ); // the mapping stays
+  if ( map == MAP_FAILED ) {
+    return NULL;
+  }
+  hdr = (const KDBHeader*)map;
+  if ( (memcmp( hdr->magic, KDB_MAGIC, sizeof(KDB_MAGIC) ) != 0) ||
+       (hdr->key_bytes != sizeof(pkmer)) ||
+       (hdr->file_len > st.st_size) ||
+       (hdr->k < 1) || (hdr->k > MAX_K) ||
+       (hdr->index_bits > 2 * hdr->k) ||
+       (hdr->index_bits > KDB_MAX_INDEX_BITS) ||
+       /* Every part has to be in the file, or lookups read past it */
+       !kdb_part_fits( hdr->index_off, ((uint64_t)1 << hdr->index_bits) + 1,
+		       sizeof(uint64_t), st.st_size ) ||
+       !kdb_part_fits( hdr->keys_off, hdr->n_kmers, sizeof(pkmer),
+		       st.st_size ) ||
+       !kdb_part_fits( hdr->counts_off, hdr->n_kmers, sizeof(uint32_t),
+		       st.st_size ) ) {
+    munmap( map, st.st_size );
+    return NULL;
+  }
+  /* Lookups jump around; don't bother reading ahead */
+  madvise( map, st.st_size, MADV_RANDOM );
+
+  db = (KDBP)malloc(sizeof(KDB));
+  db->map     = map;
+  db->map_len = st.st_size;
+  db->hdr     = hdr;
+  db->index   = (const uint64_t*)((const char*)map + hdr->index_off);
+  db->keys    = (const pkmer*)((const char*)map + hdr->keys_off);
+  db->counts  = (const uint32_t*)((const char*)map + hdr->counts_off);
+  db->k       = hdr->k;
+  db->shift   = 2 * hdr->k - hdr->index_bits;
+  return db;
+}
+
+/* Binary search of keys lo up to hi for kmer.
+   Returns: its count, 0 if it isn't there */
+static inline size_t kdb_search( KDBP db, pkmer kmer, size_t lo, size_t hi ) {
+  size_t mid;
+  while( lo < hi ) {
+    mid = lo + (hi - lo) / 2;
+    if ( db->keys[mid] < kmer ) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  if ( (lo < db->hdr->n_kmers) && (db->keys[lo] == kmer) ) {
+    return db->counts[lo];
+  }
+  return 0;
+}
+
+/* kdb_get
+   Returns: the count of (canonical, packed) kmer, 0 if it isn't in db
+*/
+size_t kdb_get( KDBP db, pkmer kmer ) {
+  size_t slot = (size_t)(kmer >> db->shift);
+  return kdb_search( db, kmer, db->index[slot], db->index[slot+1] );
+}
+
+/* kdb_get_batch
+   Same as kdb_get for each of n kmers, into counts, but with the
+   index and the first key of each search prefetched a batch at a
+   time (like get_kmers_batch)
+*/
+void kdb_get_batch( KDBP db, const pkmer* kmers, size_t n, size_t* counts ) {
+  size_t i, j, m, slot;
+  size_t lo[LOOKUP_BATCH];
+
+  for( i = 0; i < n; i += m ) {
+    m = (n - i < LOOKUP_BATCH) ? n - i : LOOKUP_BATCH;
+    for( j = 0; j < m; j++ ) {
+      __builtin_prefetch( &db->index[ (size_t)(kmers[i+j] >> db->shift) ],
+			  0, 1 );
+    }
+    for( j = 0; j < m; j++ ) {
+      lo[j] = db->index[ (size_t)(kmers[i+j] >> db->shift) ];
+      __builtin_prefetch( &db->keys[ lo[j] ], 0, 1 );
+    }
+    for( j = 0; j < m; j++ ) {
+      slot = (size_t)(kmers[i+j] >> db->shift);
+      counts[i+j] = kdb_search( db, kmers[i+j], lo[j], db->index[slot+1] );
+    }
+  }
+}
+
+/* kdb_hist
+   Same as count_hist, for the kmers in db. With KDB_ONLY_REPEATS,
+   hist[1] is 0: those kmers aren't there.
+*/
+void kdb_hist( KDBP db, size_t* hist, size_t hist_len ) {
+  size_t i;
+  memset( hist, 0, sizeof(size_t) * hist_len );
+  for( i = 0; i < db->hdr->n_kmers; i++ ) {
+    if ( db->counts[i] < hist_len ) {
+      hist[ db->counts[i] ]++;
+    }
+  }
+}
+
+/* kdb_sequential
+   Tells the system db will be read straight through, as in a merge,
+   so it reads ahead (open_kmer_db expects lookups all over)
+*/
+void kdb_sequential( KDBP db ) {
+  madvise( db->map, db->map_len, MADV_SEQUENTIAL );
+}
+
+void close_kmer_db( KDBP db ) {
+  if ( db == NULL ) {
+    return;
+  }
+  munmap( db->map, db->map_len );
+  free( db );
+}
+
+static inline pkmer src_key( KDBMergeP m, int s ) {
+  return m->srcs[s].db->keys[ m->srcs[s].i ];
+}
+
+/* Moves the input at heap position i down to where it belongs */
+static void heap_down( KDBMergeP m, int i ) {
+  int c, tmp;
+  while( (c = 2 * i + 1) < m->n ) {
+    if ( (c + 1 < m->n) &&
+	 (src_key( m, m->h[c+1] ) < src_key( m, m->h[c] )) ) {
+      c++;
+    }
+    if ( src_key( m, m->h[i] ) <= src_key( m, m->h[c] ) ) {
+      return;
+    }
+    tmp = m->h[i];
+    m->h[i] = m->h[c];
+    m->h[c] = tmp;
+    i = c;
+  }
+}
+
+/* init_kdb_merge
+   Args: KDBP* dbs - databases to merge, all with the same k
+         int n_dbs - how many
+   Returns: a merge at the start of every input, for next_kdb_merged
+*/
+KDBMergeP init_kdb_merge( KDBP* dbs, int n_dbs ) {
+  KDBMergeP m;
+  int s, i;
+
+  m = (KDBMergeP)malloc(sizeof(KDBMerge));
+  m->srcs = (KDBMergeSrc*)malloc(sizeof(KDBMergeSrc) * n_dbs);
+  m->n_srcs = n_dbs;
+  m->h = (int*)malloc(sizeof(int) * n_dbs);
+  m->n = 0;
+  for( s = 0; s < n_dbs; s++ ) {
+    m->srcs[s].db = dbs[s];
+    m->srcs[s].i = 0;
+    if ( dbs[s]->hdr->n_kmers > 0 ) {
+      m->h[m->n++] = s;
+    }
+  }
+  for( i = m->n / 2 - 1; i >= 0; i-- ) {
+    heap_down( m, i );
+  }
+  return m;
+}
+
+/* next_kdb_merged
+   Gets the smallest kmer left in any input into *kmer, its summed
+   count into *count, and the inputs that have it into presence (a
+   bit for each, (n_dbs + 63) / 64 words), if it isn't NULL.
+   Returns: FALSE when every input is done
+*/
+int next_kdb_merged( KDBMergeP m, pkmer* kmer, size_t* count,
+		     uint64_t* presence ) {
+  int s;
+  KDBMergeSrc* src;
+
+  if ( m->n == 0 ) {
+    return 0;
+  }
+  *kmer = src_key( m, m->h[0] );
+  *count = 0;
+  if ( presence != NULL ) {
+    memset( presence, 0, sizeof(uint64_t) * ((m->n_srcs + 63) / 64) );
+  }
+  while( (m->n > 0) && (src_key( m, m->h[0] ) == *kmer) ) {
+    s = m->h[0];
+    src = &m->srcs[s];
+    *count += src->db->counts[ src->i ];
+    if ( presence != NULL ) {
+      presence[s / 64] |= (uint64_t)1 << (s % 64);
+    }
+    src->i++;
+    if ( src->i == src->db->hdr->n_kmers ) { // done with this one
+      m->h[0] = m->h[--m->n];
+    }
+    heap_down( m, 0 );
+  }
+  return 1;
+}
+
+/* Frees the merge, not the databases */
+void free_kdb_merge( KDBMergeP m ) {
+  free( m->srcs );
+  free( m->h );
+  free( m );
+}
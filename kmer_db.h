@@ -0,0 +1,98 @@
+#ifndef KMER_DB_H
+#define KMER_DB_H
+#include "kmer.h"
+
+/* Kmer count database: a file with every (canonical, packed) kmer
+   of a KSP and its count, sorted by kmer, so that it can be looked
+   up straight from an mmap of the file with no loading at all.
+
+   Layout, every part starting on a KDB_ALIGN byte boundary:
+     header   KDBHeader
+     index    index_len + 1 uint64_t: the kmers whose top
+              index_bits bits are p are entries index[p] up to
+              (not including) index[p+1]
+     keys     n_kmers pkmer, sorted
+     counts   n_kmers uint32_t, counts[i] goes with keys[i]
+   Keys and counts are kept apart so the search only touches keys.
+   A file can only be read by a build with the same pkmer size. */
+typedef struct kmer_db_header {
+  char magic[8];        // KDB_MAGIC
+  uint32_t k;
+  uint32_t key_bytes;   // sizeof(pkmer) of the build that wrote it
+  uint32_t count_bits;  // counts are this wide (32)
+  uint32_t index_bits;
+  uint32_t flags;       // KDB_ONLY_REPEATS
+  uint32_t unused;
+  uint64_t n_kmers;     // distinct kmers
+  uint64_t total;       // sum of all the counts
+  uint64_t index_off;   // byte offsets of the parts in the file
+  uint64_t keys_off;
+  uint64_t counts_off;
+  uint64_t file_len;
+} KDBHeader;
+
+#define KDB_MAGIC "KMERDB1"
+#define KDB_ONLY_REPEATS (1) // kmers seen once are not in the file
+#define KDB_ALIGN (64)
+#define KDB_MAX_INDEX_BITS (26)
+#define KDB_PER_SLOT (8) // about how many kmers for each index slot
+
+/* An open (mmapped) database */
+typedef struct kmer_db {
+  void* map;
+  size_t map_len;
+  const KDBHeader* hdr;
+  const uint64_t* index;
+  const pkmer* keys;
+  const uint32_t* counts;
+  size_t k;
+  size_t shift; // kmer >> shift is its index slot
+} KDB;
+typedef struct kmer_db* KDBP;
+
+/* Writes a database a kmer at a time, in sorted order, for kmers
+   that aren't in a KSP (like merged ones). The number of kmers has
+   to be known up front to lay out the file. */
+typedef struct kdb_writer {
+  KDBHeader hdr;
+  char* fn;
+  size_t shift;
+  uint64_t* index;  // kmers in each slot, then where each slot starts
+  FILE* keys_fp;
+  FILE* counts_fp;
+  size_t n_added;
+} KDBWriter;
+typedef struct kdb_writer* KDBWriterP;
+
+/* Merges databases a kmer at a time, in sorted order, reading each
+   straight through: a min-heap of the inputs with entries left, by
+   their next kmer */
+typedef struct kdb_merge_src {
+  KDBP db;
+  size_t i; // next entry
+} KDBMergeSrc;
+
+typedef struct kdb_merge {
+  KDBMergeSrc* srcs;
+  int n_srcs;
+  int* h;   // indexes into srcs
+  int n;
+} KDBMerge;
+typedef struct kdb_merge* KDBMergeP;
+
+KDBWriterP init_kdb_writer( const char* fn, size_t k, size_t n_kmers,
+			    uint32_t flags );
+void kdb_writer_add( KDBWriterP w, pkmer kmer, size_t count );
+int finish_kdb_writer( KDBWriterP w );
+int write_kmer_db( KSP ks, const char* fn, uint32_t flags );
+KDBP open_kmer_db( const char* fn );
+size_t kdb_get( KDBP db, pkmer kmer );
+void kdb_get_batch( KDBP db, const pkmer* kmers, size_t n, size_t* counts );
+void kdb_hist( KDBP db, size_t* hist, size_t hist_len );
+void kdb_sequential( KDBP db );
+void close_kmer_db( KDBP db );
+KDBMergeP init_kdb_merge( KDBP* dbs, int n_dbs );
+int next_kdb_merged( KDBMergeP m, pkmer* kmer, size_t* count,
+		     uint64_t* presence );
+void free_kdb_merge( KDBMergeP m );
+#endif
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kmer_hash.h"
+
+/* Murmur3 finalizer */
+static inline uint64_t mix64( uint64_t h ) {
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* Mixes all the bits of the packed kmer into 64 bits; packed kmers
+   themselves are far from random. The high half of a 128-bit kmer is
+   mixed on its own first so its top bits reach the whole hash */
+static inline uint64_t hash_pkmer( pkmer key ) {
+#if MAX_K <= 32
+  return mix64( key );
+#else
+  return mix64( (uint64_t)key ^ mix64( (uint64_t)(key >> 64) ) );
+#endif
+}
+
+/* First slot of the cache line that key hashes to */
+static inline size_t kht_home( KHTP ht, pkmer key ) {
+  return (size_t)hash_pkmer( key ) & ht->mask &
+    ~(size_t)(KHT_LINE / sizeof(khe) - 1);
+}
+
+static kheP alloc_slots( size_t size ) {
+  void* slots;
+  if ( posix_memalign( &slots, KHT_LINE, size * sizeof(khe) ) ) {
+    fprintf( stderr, "ERROR: Cannot allocate kmer hash table of %lu slots\n",
+	     size );
+    exit( 1 );
+  }
+  memset( slots, 0, size * sizeof(khe) );
+  return (kheP)slots;
+}
+
+/* init_kht
+   Args: size_t expected - expected number of distinct kmers,
+                           0 if there's no idea
+   Returns: pointer to a new, empty table, sized so that expected
+            kmers fit without growing
+*/
+KHTP init_kht( size_t expected ) {
+  KHTP ht;
+  size_t size = KHT_MIN_SIZE;
+  while( size - size/8 < expected ) {
+    size *= 2;
+  }
+  ht = (KHTP)malloc(sizeof(Kht));
+  ht->slots = alloc_slots( size );
+  ht->size  = size;
+  ht->mask  = size - 1;
+  ht->n     = 0;
+  ht->max_n = size - size/8; // 87.5% load is fine for Robin Hood
+  return ht;
+}
+
+void free_kht( KHTP ht ) {
+  if ( ht == NULL ) {
+    return;
+  }
+  free( ht->slots );
+  free( ht );
+}
+
+/* Puts entry e, which is not in the table yet, into slot i, where
+   e.dist must already be its distance from home. Whatever is in
+   the way either stays put or, if e is farther from home, gets
+   bumped and moves along to the next slot that will take it */
+static void kht_insert_at( KHTP ht, khe e, size_t i ) {
+  khe tmp;
+  while( ht->slots[i].count != 0 ) {
+    if ( ht->slots[i].dist < e.dist ) {
+      tmp = ht->slots[i];
+      ht->slots[i] = e;
+      e = tmp;
+    }
+    i = (i + 1) & ht->mask;
+    e.dist++;
+  }
+  ht->slots[i] = e;
+}
+
+/* Doubles the size of the table and rehashes everything */
+static void kht_grow( KHTP ht ) {
+  kheP old_slots = ht->slots;
+  size_t old_size = ht->size;
+  size_t i;
+
+  ht->size *= 2;
+  ht->mask  = ht->size - 1;
+  ht->max_n = ht->size - ht->size/8;
+  ht->slots = alloc_slots( ht->size );
+  for( i = 0; i < old_size; i++ ) {
+    if ( old_slots[i].count != 0 ) {
+      old_slots[i].dist = 0;
+      kht_insert_at( ht, old_slots[i],
+		     kht_home( ht, old_slots[i].key ) );
+    }
+  }
+  free( old_slots );
+}
+
+/* kht_increment
+   Adds one to the count of key, inserting it if it is not there.
+   Counts stick at UINT32_MAX.
+   Returns: the new count
+*/
+uint32_t kht_increment( KHTP ht, pkmer key ) {
+  size_t i;
+  uint32_t dist = 0;
+  kheP e;
+  khe new_e;
+
+  if ( ht->n >= ht->max_n ) {
+    kht_grow( ht );
+  }
+  i = kht_home( ht, key );
+  while( 1 ) {
+    e = &ht->slots[i];
+    if ( e->count == 0 ) {
+      break;
+    }
+    if ( e->key == key ) {
+      if ( e->count < UINT32_MAX ) {
+	e->count++;
+      }
+      return e->count;
+    }
+    if ( e->dist < dist ) {
+      /* key would have been here; it isn't in the table */
+      break;
+    }
+    i = (i + 1) & ht->mask;
+    dist++;
+  }
+
+  /* Not here, so it goes in slot i, and whatever was there gets
+     pushed down the line */
+  new_e.key   = key;
+  new_e.count = 1;
+  new_e.dist  = dist;
+  kht_insert_at( ht, new_e, i );
+  ht->n++;
+  return 1;
+}
+
+/* Returns: slot index of key, or ht->size if it is not there */
+static size_t kht_find( KHTP ht, pkmer key ) {
+  size_t i;
+  uint32_t dist = 0;
+  kheP e;
+
+  i = kht_home( ht, key );
+  while( 1 ) {
+    e = &ht->slots[i];
+    if ( (e->count == 0) || (e->dist < dist) ) {
+      return ht->size;
+    }
+    if ( e->key == key ) {
+      return i;
+    }
+    i = (i + 1) & ht->mask;
+    dist++;
+  }
+}
+
+/* kht_get
+   Returns: the count of key, 0 if it is not in the table
+*/
+uint32_t kht_get( KHTP ht, pkmer key ) {
+  size_t i;
+  i = kht_find( ht, key );
+  if ( i == ht->size ) {
+    return 0;
+  }
+  return ht->slots[i].count;
+}
+
+/* kht_prefetch
+   Starts loading the cache line that key's probe starts in, for a
+   kht_get of it a little later
+*/
+void kht_prefetch( KHTP ht, pkmer key ) {
+  __builtin_prefetch( &ht->slots[ kht_home( ht, key ) ], 0, 1 );
+}
+
+/* kht_remove
+   Returns 0 => was present, now it's gone
+           1 => was never there!
+   Entries after it that are not at home shift back one slot
+   (backward shift deletion), so no tombstones are needed
+*/
+int kht_remove( KHTP ht, pkmer key ) {
+  size_t i, next;
+
+  i = kht_find( ht, key );
+  if ( i == ht->size ) {
+    return 1;
+  }
+  next = (i + 1) & ht->mask;
+  while( (ht->slots[next].count != 0) &&
+	 (ht->slots[next].dist > 0) ) {
+    ht->slots[i] = ht->slots[next];
+    ht->slots[i].dist--;
+    i = next;
+    next = (next + 1) & ht->mask;
+  }
+  ht->slots[i].count = 0;
+  ht->slots[i].dist  = 0;
+  ht->n--;
+  return 0;
+}
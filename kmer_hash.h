@@ -0,0 +1,36 @@
+#ifndef KMER_HASH_H
+#define KMER_HASH_H
+#include "kmer.h"
+
+/* Open addressing hash table of packed kmers with inline counters.
+   Robin Hood linear probing: every key starts probing at the
+   beginning of the cache line its hash lands in, and an entry
+   that is closer to home gives up its slot to one that is farther
+   from home. That keeps probe sequences short and lets lookups
+   stop as soon as they pass where the key would have been. */
+typedef struct kmer_hash_entry {
+  pkmer key;
+  uint32_t count; // 0 => empty slot
+  uint32_t dist;  // how far this entry is from its home slot
+} khe;
+typedef struct kmer_hash_entry* kheP;
+
+typedef struct kmer_hash {
+  kheP slots;
+  size_t size;  // number of slots, a power of 2
+  size_t mask;  // size - 1
+  size_t n;     // number of kmers in the table
+  size_t max_n; // grow when n gets here
+} Kht;
+typedef struct kmer_hash* KHTP;
+
+#define KHT_LINE (64) // bytes per cache line
+#define KHT_MIN_SIZE (1024)
+
+KHTP init_kht( size_t expected );
+void free_kht( KHTP ht );
+uint32_t kht_increment( KHTP ht, pkmer key );
+uint32_t kht_get( KHTP ht, pkmer key );
+void kht_prefetch( KHTP ht, pkmer key );
+int kht_remove( KHTP ht, pkmer key );
+#endif
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "kmer_sketch.h"
+
+/* Two independent 64-bit hashes of key (murmur3 finalizers with
+   different seeds). Row r uses h1 + r * h2, which is as good as
+   KCMS_DEPTH separate hash functions for a count-min sketch */
+static inline uint64_t mix64( uint64_t h ) {
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline void kcms_hashes( pkmer key, uint64_t* h1, uint64_t* h2 ) {
+  uint64_t lo = (uint64_t)key;
+#if MAX_K <= 32
+  uint64_t hi = 0;
+#else
+  uint64_t hi = (uint64_t)(key >> 64);
+#endif
+  *h1 = mix64( lo ^ mix64( hi ) );
+  *h2 = mix64( hi ^ mix64( lo ^ 0x165667B19E3779F9ULL ) ) | 1;
+}
+
+static inline size_t cell_get( KCMSP cms, size_t i ) {
+  switch( cms->count_bits ) {
+  case 8 :
+    return ((uint8_t*)cms->cells)[i];
+  case 16 :
+    return ((uint16_t*)cms->cells)[i];
+  default :
+    return ((uint32_t*)cms->cells)[i];
+  }
+}
+
+static inline size_t cell_max( KCMSP cms ) {
+  switch( cms->count_bits ) {
+  case 8 :
+    return UINT8_MAX;
+  case 16 :
+    return UINT16_MAX;
+  default :
+    return UINT32_MAX;
+  }
+}
+
+static inline void cell_set( KCMSP cms, size_t i, size_t val ) {
+  switch( cms->count_bits ) {
+  case 8 :
+    ((uint8_t*)cms->cells)[i] = (uint8_t)val;
+    break;
+  case 16 :
+    ((uint16_t*)cms->cells)[i] = (uint16_t)val;
+    break;
+  default :
+    ((uint32_t*)cms->cells)[i] = (uint32_t)val;
+  }
+}
+
+/* init_kcms
+   Args: size_t bytes - memory for the counters; the sketch gets
+                        the widest power of 2 rows that fit
+         int count_bits - 8, 16, or 32 bit counters
+   Returns: pointer to a new, empty sketch
+*/
+KCMSP init_kcms( size_t bytes, int count_bits ) {
+  KCMSP cms;
+  size_t width = 1;
+
+  if ( bytes < KCMS_MIN_BYTES ) {
+    bytes = KCMS_MIN_BYTES;
+  }
+  while( 2 * width * KCMS_DEPTH * (count_bits / 8) <= bytes ) {
+    width *= 2;
+  }
+  cms = (KCMSP)malloc(sizeof(Kcms));
+  cms->width = width;
+  cms->mask  = width - 1;
+  cms->depth = KCMS_DEPTH;
+  cms->count_bits = count_bits;
+  cms->total = 0;
+  cms->cells = calloc( width * KCMS_DEPTH, count_bits / 8 );
+  if ( cms->cells == NULL ) {
+    fprintf( stderr, "ERROR: Cannot allocate count-min sketch of %lu bytes\n",
+	     width * KCMS_DEPTH * (count_bits / 8) );
+    exit( 1 );
+  }
+  return cms;
+}
+
+void free_kcms( KCMSP cms ) {
+  if ( cms == NULL ) {
+    return;
+  }
+  free( cms->cells );
+  free( cms );
+}
+
+/* kcms_increment
+   Adds one to the count of key. Only the counters that are at the
+   smallest value go up (conservative update): the others are
+   already too high, and leaving them be keeps the estimates of
+   the kmers they are shared with closer to the truth.
+   Returns: the new estimated count
+*/
+size_t kcms_increment( KCMSP cms, pkmer key ) {
+  size_t inx[KCMS_DEPTH];
+  size_t r, min = SIZE_MAX, val;
+  uint64_t h1, h2;
+
+  kcms_hashes( key, &h1, &h2 );
+  for( r = 0; r < cms->depth; r++ ) {
+    inx[r] = r * cms->width + ((h1 + r * h2) & cms->mask);
+    val = cell_get( cms, inx[r] );
+    if ( val < min ) {
+      min = val;
+    }
+  }
+  cms->total++;
+  if ( min == cell_max( cms ) ) {
+    return min;
+  }
+  for( r = 0; r < cms->depth; r++ ) {
+    if ( cell_get( cms, inx[r] ) == min ) {
+      cell_set( cms, inx[r], min + 1 );
+    }
+  }
+  return min + 1;
+}
+
+/* kcms_get
+   Returns: estimated count of key; 0 only if it was never added.
+            The most a count_bits counter holds means at least that
+*/
+size_t kcms_get( KCMSP cms, pkmer key ) {
+  size_t r, min = SIZE_MAX, val;
+  uint64_t h1, h2;
+
+  kcms_hashes( key, &h1, &h2 );
+  for( r = 0; r < cms->depth; r++ ) {
+    val = cell_get( cms, r * cms->width + ((h1 + r * h2) & cms->mask) );
+    if ( val < min ) {
+      min = val;
+    }
+  }
+  return min;
+}
+
+/* kcms_error_bound
+   Returns: how much too high any one estimate may be, e/width of
+            all the increments so far, with the chance given by
+            kcms_confidence
+*/
+size_t kcms_error_bound( KCMSP cms ) {
+  return (size_t)ceil( M_E * (double)cms->total / (double)cms->width );
+}
+
+/* kcms_confidence
+   Returns: chance that an estimate is within kcms_error_bound
+*/
+double kcms_confidence( KCMSP cms ) {
+  return 1.0 - exp( -(double)cms->depth );
+}
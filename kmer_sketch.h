@@ -0,0 +1,32 @@
+#ifndef KMER_SKETCH_H
+#define KMER_SKETCH_H
+#include "kmer.h"
+
+/* Count-min sketch of packed kmers: KCMS_DEPTH rows of saturating
+   counters. Each kmer has one counter in every row, picked by a
+   different hash; its count is the smallest of them. Counts are
+   never too low, except that they stop at the top of the counters
+   (a count there means at least that many), and only too high when
+   other kmers share all of its counters. The memory is fixed when it is made, however many
+   kmers go in. Kmers themselves are not kept, so there is no way
+   to list them or take them out. */
+typedef struct kmer_cms {
+  void* cells;     // depth rows of width counters, one row after another
+  size_t width;    // counters per row, a power of 2
+  size_t mask;     // width - 1
+  int depth;       // number of rows
+  int count_bits;  // 8, 16, or 32
+  size_t total;    // number of increments so far
+} Kcms;
+typedef struct kmer_cms* KCMSP;
+
+#define KCMS_DEPTH (4)       // failure chance of the error bound is e^-4
+#define KCMS_MIN_BYTES (4096)
+
+KCMSP init_kcms( size_t bytes, int count_bits );
+void free_kcms( KCMSP cms );
+size_t kcms_increment( KCMSP cms, pkmer key );
+size_t kcms_get( KCMSP cms, pkmer key );
+size_t kcms_error_bound( KCMSP cms );
+double kcms_confidence( KCMSP cms );
+#endif
@@ -3,11 +3,26 @@
 #include <ctype.h>
 #include <string.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "kmer.h"
 #include "file_io.h"
+#include "count_fasta.h"
+#include "disk_count.h"
+#include "kmer_sketch.h"
+#include "kmer_db.h"
 
 #define NUM_TESTS (1000000)
 #define MAX_COUNTS (511)
+#define VERIFY_SEQ_LEN (200000)
+#define VERIFY_DENSE_K (11) // for verify_dense when k is too big
+#define VERIFY_THREADS (4)
+#define VERIFY_SCATTER_CAP (1000) // small, so the buckets fill many times
+#define VERIFY_BUCKETS (16)
+#define VERIFY_SKETCH_BYTES (1<<16) // small enough for kmers to collide
+#define VERIFY_BLOOM_BYTES (1<<24)  // big enough for no false positives
+#define VERIFY_TEMP_TEMPLATE "/tmp/test_kmer.XXXXXX"
+#define VERIFY_MAX_RECORDS (VERIFY_SEQ_LEN / 2)
 typedef struct kmer_data {
   size_t count;
 } kd;
@@ -17,10 +32,41 @@ void increment_kmer_count( klnP kmer );
 void print_hist( KSP kmers );
 void search_kmer_tree( ktnP tree_node,
 		       size_t depth, size_t* hist );
+int verify_backends( size_t k );
+int verify_dense( size_t k );
+int verify_mt( size_t k );
+int verify_scatter( size_t k );
+int verify_disk( size_t k );
+int verify_sketch( size_t k );
+int verify_bloom( size_t k );
+int verify_db( size_t k );
+int verify_merge( size_t k );
+int verify_parse( size_t k );
+int verify_map( size_t k );
+int verify_blocks( size_t k );
+int verify_simd( size_t k );
 
 void help( void ) {
-  printf( "test_kmer -k <kmer length> -c [canonical kmers]\n" );
+  printf( "test_kmer -k <kmer length> -c [canonical kmers] -v [verify counting backends]\n" );
   printf( "Tests the kmer.o object\n" );
+  printf( " -v counts one made up sequence in the tree, the compressed tree,\n" );
+  printf( " and the hash table, checks every kmer's count against a sorted\n" );
+  printf( " list of them, then prunes, removes, and counts again, checking\n" );
+  printf( " after each. Exits non-zero if anything is off. The same goes for\n" );
+  printf( " the dense array (at k = %d if k is too big for it). Then %d threads\n", VERIFY_DENSE_K, VERIFY_THREADS );
+  printf( " count the sequence at once in each backend, each thread all of it,\n" );
+  printf( " and the partitioned (KScatter) build counts it in %d threads.\n", VERIFY_THREADS );
+  printf( " It's counted on disk too, in %d minimizer buckets, and in a count-min\n", VERIFY_BUCKETS );
+  printf( " sketch small enough to be off, but only as far as its error bound.\n" );
+  printf( " Last, the bloom filter has to hold back exactly the kmers seen once,\n" );
+  printf( " with one thread and with %d at once. A database written from the\n", VERIFY_THREADS );
+  printf( " repeated kmers has to read back the same, and a cut short one not at all.\n" );
+  printf( " Databases of the two halves of the sequence have to merge into its counts.\n" );
+  printf( " And the sequence written as a fasta file, in records of ragged, mixed case\n" );
+  printf( " lines with stray whitespace, has to read back the same, gzipped or not,\n" );
+  printf( " and mapped into memory. Counting a block of kmers at a time (with\n" );
+  printf( " prefetching) has to give the same counts as counting one at a time.\n" );
+  printf( " Every SIMD level this CPU has must list the dense array's kmers the same.\n" );
   exit( 0 );
 }
 
@@ -28,8 +74,9 @@ int main ( int argc, char* argv[] ) {
   extern char* optarg;
   extern int optin;
 
-  int ich, i;
+  int ich, i, fails;
   int canonical_kmer = 0;
+  int verify = 0;
   size_t k;
   char* kmer_str;
   KSP kmers;
@@ -39,7 +86,7 @@ int main ( int argc, char* argv[] ) {
   if( argc == 1 ) {
     help();
   }
-  while( (ich=getopt( argc, argv, "k:hc" )) != -1 ) {
+  while( (ich=getopt( argc, argv, "k:hcv" )) != -1 ) {
     switch(ich) {
     case 'k' :
       k = (size_t)atoi( optarg );
@@ -49,11 +96,31 @@ int main ( int argc, char* argv[] ) {
     case 'c' :
       canonical_kmer = 1;
       break;
+    case 'v' :
+      verify = 1;
+      break;
     default :
       help();
     }
   }
 
+  if ( verify ) {
+    fails = verify_backends( k );
+    fails += verify_dense( k );
+    fails += verify_mt( k );
+    fails += verify_scatter( k );
+    fails += verify_disk( k );
+    fails += verify_sketch( k );
+    fails += verify_bloom( k );
+    fails += verify_db( k );
+    fails += verify_merge( k );
+    fails += verify_parse( k );
+    fails += verify_map( k );
+    fails += verify_blocks( k );
+    fails += verify_simd( k );
+    return fails == 0 ? 0 : 1;
+  }
+
   kmer_str = (char*)malloc(sizeof(char) * k);
   kmers = init_KSP( k );
   
@@ -113,7 +180,7 @@ void print_hist( KSP kmers ) {
   for( i = 0; i < MAX_COUNTS; i++ ) {
     hist[i] = 0;
   }
-  len = 1<<(K_AR_SIZE*2);
+  len = kmers->ka_len;
   /* Look in each position of the array part */
   for( i = 0; i < len; i++ ) {
     if ( kmers->ka[i] != NULL ) {
@@ -207,3 +274,1398 @@ void make_random_kmer( char* kmer_str, size_t k ) {
 
       
  
+
+
+/* The distinct kmers of the verify sequence with their counts, in
+   packed order */
+typedef struct kmer_counts {
+  pkmer* kmers;
+  size_t* counts;
+  size_t n;
+} KCounts;
+
+static int cmp_pkmer( const void* a, const void* b ) {
+  pkmer x = *(const pkmer*)a, y = *(const pkmer*)b;
+  return (x < y) ? -1 : (x > y);
+}
+
+/* Makes a sequence with something for every part of the backends
+   to do: copies of earlier stretches with a base or two changed
+   (branches in the tree, so chains get split), a short unit
+   repeated 300 times (counts past 255, in the overflow table), runs
+   of N, and some lower case */
+static char* make_verify_seq( size_t len ) {
+  char* seq;
+  size_t i, j, n, from;
+  const char* bases = "ACGT";
+  char unit[40];
+
+  seq = (char*)malloc(sizeof(char) * len);
+  for( i = 0; i < 40; i++ ) {
+    unit[i] = bases[ rand()%4 ];
+  }
+  i = 0;
+  while( i < len ) {
+    switch( rand()%8 ) {
+    case 0 : // a copy of something earlier, with a change or two
+      n = 50 + rand()%200;
+      if ( i > n ) {
+	from = rand() % (i - n);
+	for( j = 0; (j < n) && (i < len); j++, i++ ) {
+	  seq[i] = (rand()%100 == 0) ? bases[ rand()%4 ] : seq[from + j];
+	}
+      }
+      break;
+    case 1 : // a stretch of the unit
+      if ( rand()%4 == 0 ) {
+	for( j = 0; (j < 40 * 30) && (i < len); j++, i++ ) {
+	  seq[i] = unit[j % 40];
+	}
+      }
+      break;
+    case 2 :
+      for( j = 0; (j < 1 + rand()%5) && (i < len); j++, i++ ) {
+	seq[i] = 'N';
+      }
+      break;
+    default :
+      for( j = 0; (j < 100) && (i < len); j++, i++ ) {
+	seq[i] = bases[ rand()%4 ];
+	if ( rand()%50 == 0 ) {
+	  seq[i] = tolower( seq[i] );
+	}
+      }
+    }
+  }
+  return seq;
+}
+
+/* The counts the backends should get, the slow way: every kmer of
+   seq, sorted, with runs counted */
+static void count_by_sorting( const char* seq, size_t len, size_t k,
+			      KCounts* kc ) {
+  pkmer* all;
+  size_t n = 0, i, pos;
+  pkmer pk;
+  KIter it;
+
+  all = (pkmer*)malloc(sizeof(pkmer) * len);
+  init_kmer_iter( &it, seq, len, k );
+  while( next_canonical_kmer( &it, &pk, &pos ) ) {
+    all[n++] = pk;
+  }
+  qsort( all, n, sizeof(pkmer), cmp_pkmer );
+  kc->kmers = (pkmer*)malloc(sizeof(pkmer) * (n + 1));
+  kc->counts = (size_t*)malloc(sizeof(size_t) * (n + 1));
+  kc->n = 0;
+  for( i = 0; i < n; i++ ) {
+    if ( (kc->n > 0) && (kc->kmers[kc->n - 1] == all[i]) ) {
+      kc->counts[kc->n - 1]++;
+    }
+    else {
+      kc->kmers[kc->n] = all[i];
+      kc->counts[kc->n] = 1;
+      kc->n++;
+    }
+  }
+  free( all );
+}
+
+static void add_seq_kmers( const char* seq, size_t len, KSP ks ) {
+  size_t pos;
+  pkmer pk;
+  KIter it;
+
+  init_kmer_iter( &it, seq, len, ks->k );
+  while( next_canonical_kmer( &it, &pk, &pos ) ) {
+    increment_or_insert_pkmer( pk, ks );
+  }
+}
+
+/* Checks that every kmer of kc has the count in want (0 => not
+   there), and that count_hist agrees on how many kmers there are
+   and how many times they were seen.
+   Returns: number of kmers that are off */
+static size_t check_counts( KSP ks, const KCounts* kc, const size_t* want,
+			    const char* name, const char* stage ) {
+  size_t* hist;
+  size_t i, got, bad = 0, hist_len = 2;
+  size_t n_want = 0, sum_want = 0, n_got = 0, sum_got = 0;
+  char* kmer_str;
+
+  kmer_str = (char*)malloc(sizeof(char) * (ks->k + 1));
+  for( i = 0; i < kc->n; i++ ) {
+    got = get_pkmer_count( kc->kmers[i], ks );
+    if ( got != want[i] ) {
+      if ( bad == 0 ) {
+	pkmer2kmer( kc->kmers[i], ks->k, kmer_str );
+	printf( "FAIL %s %s: %s has count %lu, not %lu\n",
+		name, stage, kmer_str, got, want[i] );
+      }
+      bad++;
+    }
+    if ( want[i] > 0 ) {
+      n_want++;
+      sum_want += want[i];
+    }
+    if ( want[i] >= hist_len ) {
+      hist_len = want[i] + 1;
+    }
+  }
+
+  /* Long enough for the biggest count, which for small k is far
+     more than any fixed length */
+  hist = (size_t*)malloc(sizeof(size_t) * hist_len);
+  count_hist( ks, hist, hist_len );
+  for( i = 1; i < hist_len; i++ ) {
+    n_got += hist[i];
+    sum_got += i * hist[i];
+  }
+  if ( (n_got != n_want) || (sum_got != sum_want) ) {
+    printf( "FAIL %s %s: histogram has %lu kmers seen %lu times, not %lu seen %lu\n",
+	    name, stage, n_got, sum_got, n_want, sum_want );
+    bad++;
+  }
+  if ( bad > 0 ) {
+    printf( "FAIL %s %s: %lu kmers off\n", name, stage, bad );
+  }
+  else {
+    printf( "PASS %s %s (%lu kmers)\n", name, stage, n_want );
+  }
+  free( hist );
+  free( kmer_str );
+  return bad;
+}
+
+/* The verify sequence and its counts for k, the slow way */
+static char* verify_input( size_t k, KCounts* kc ) {
+  char* seq;
+  srand( 17 );
+  seq = make_verify_seq( VERIFY_SEQ_LEN );
+  count_by_sorting( seq, VERIFY_SEQ_LEN, k, kc );
+  return seq;
+}
+
+static void free_kcounts( KCounts* kc ) {
+  free( kc->kmers );
+  free( kc->counts );
+}
+
+/* verify_ksp
+   Args: KSP ks - empty counting KSP
+         const char* name - what to call it in the output
+         const char* seq - the verify sequence
+         const KCounts* kc - its counts
+   Counts seq in ks and checks every kmer's count against kc. Then:
+   - prunes to the kmers seen 2 to 200 times, which frees nodes,
+     takes out whole chains, and drops counts from the overflow
+     table;
+   - removes every third survivor, one at a time (in the hash
+     table, each shifts the ones after it back);
+   - counts the whole sequence again, on top of what's left, so
+     the freed nodes get used and chains get split again.
+   All checked after each step. Last, it prunes everything and
+   checks that no node is left behind.
+   Returns: number of checks that failed
+*/
+static int verify_ksp( KSP ks, const char* name, const char* seq,
+		       const KCounts* kc ) {
+  KSPStats st;
+  size_t* want;
+  size_t i, removed, n_removed;
+  int fails = 0;
+
+  want = (size_t*)malloc(sizeof(size_t) * (kc->n + 1));
+  add_seq_kmers( seq, VERIFY_SEQ_LEN, ks );
+  memcpy( want, kc->counts, sizeof(size_t) * kc->n );
+  fails += check_counts( ks, kc, want, name, "counted" ) > 0;
+
+  n_removed = 0;
+  for( i = 0; i < kc->n; i++ ) {
+    if ( (want[i] < 2) || (want[i] > 200) ) {
+      want[i] = 0;
+      n_removed++;
+    }
+  }
+  removed = ksp_prune( ks, 2, 200 );
+  if ( removed != n_removed ) {
+    printf( "FAIL %s: pruning took out %lu kmers, not %lu\n",
+	    name, removed, n_removed );
+    fails++;
+  }
+  fails += check_counts( ks, kc, want, name, "pruned" ) > 0;
+
+  n_removed = 0;
+  for( i = 0; i < kc->n; i++ ) {
+    if ( (want[i] > 0) && (i % 3 == 0) ) {
+      n_removed += remove_pkmer( kc->kmers[i], ks ) != 0;
+      want[i] = 0;
+    }
+  }
+  if ( n_removed > 0 ) {
+    printf( "FAIL %s: %lu kmers weren't there to remove\n",
+	    name, n_removed );
+    fails++;
+  }
+  fails += check_counts( ks, kc, want, name, "removed" ) > 0;
+
+  add_seq_kmers( seq, VERIFY_SEQ_LEN, ks );
+  for( i = 0; i < kc->n; i++ ) {
+    want[i] += kc->counts[i];
+  }
+  fails += check_counts( ks, kc, want, name, "recounted" ) > 0;
+
+  /* Nothing is seen at least once and at most 0 times, so this
+     takes out everything, and every node has to go back */
+  removed = ksp_prune( ks, 1, 0 );
+  ksp_stats( ks, &st );
+  if ( (removed != kc->n) || (st.tree_nodes != 0) ||
+       (st.chain_nodes != 0) || (st.cnt_blocks != 0) ||
+       (st.ovf_kmers != 0) || (st.n_kmers != 0) ) {
+    printf( "FAIL %s emptied: took out %lu of %lu kmers, left %lu tree, %lu chain, %lu counter nodes, %lu overflow and %lu table kmers\n",
+	    name, removed, kc->n, st.tree_nodes, st.chain_nodes,
+	    st.cnt_blocks, st.ovf_kmers, st.n_kmers );
+    fails++;
+  }
+  else {
+    printf( "PASS %s emptied\n", name );
+  }
+  free( want );
+  return fails;
+}
+
+/* verify_backends
+   Args: size_t k - kmer length
+   Runs verify_ksp on the tree, the compressed tree, and the hash
+   table, each with 8-bit counters so the overflow table gets used.
+   Returns: number of checks that failed
+*/
+int verify_backends( size_t k ) {
+  const char* names[] = { "tree", "compressed", "hash" };
+  KSPOpts opts;
+  KCounts kc;
+  KSP ks;
+  char* seq;
+  int b, fails = 0;
+
+  seq = verify_input( k, &kc );
+  for( b = 0; b < 3; b++ ) {
+    set_default_KSPOpts( &opts );
+    opts.count_bits = 8;  // so counts past 255 go in the overflow table
+    opts.dense_bytes = 0; // no KSP_DENSE, even for small k
+    if ( b == 1 ) {
+      opts.compress = 1;
+    }
+    if ( b == 2 ) {
+      opts.backend = KSP_HASH;
+      opts.expected = 16; // so the table has to grow, many times
+    }
+    ks = init_KSP_opts( k, &opts );
+    fails += verify_ksp( ks, names[b], seq, &kc );
+    free_KSP( ks );
+  }
+  free_kcounts( &kc );
+  free( seq );
+  return fails;
+}
+
+/* verify_dense
+   Args: size_t k - kmer length
+   Runs verify_ksp on a KSP_DENSE, at k if 4^k 8-bit counters fit
+   in the default budget, at VERIFY_DENSE_K if not.
+   Returns: number of checks that failed
+*/
+int verify_dense( size_t k ) {
+  KSPOpts opts;
+  KCounts kc;
+  KSP ks;
+  char* seq;
+  int fails = 0;
+
+  if ( (2 * k >= sizeof(size_t) * CHAR_BIT) ||
+       (((size_t)1 << (2 * k)) > DENSE_MAX_BYTES) ) {
+    k = VERIFY_DENSE_K;
+  }
+  seq = verify_input( k, &kc );
+  set_default_KSPOpts( &opts );
+  opts.count_bits = 8;
+  ks = init_KSP_opts( k, &opts );
+  if ( ks->backend != KSP_DENSE ) {
+    printf( "FAIL dense: k = %lu wasn't made KSP_DENSE\n", k );
+    fails++;
+  }
+  else {
+    fails += verify_ksp( ks, "dense", seq, &kc );
+  }
+  free_KSP( ks );
+  free_kcounts( &kc );
+  free( seq );
+  return fails;
+}
+
+/* What each thread of count_seq_threads gets */
+typedef struct verify_job {
+  const char* seq;
+  KSP ks;
+  int tid;
+  pthread_barrier_t* start; // so they all go at once
+} VerifyJob;
+
+static void* count_seq_job( void* arg ) {
+  VerifyJob* job = (VerifyJob*)arg;
+  size_t pos;
+  pkmer pk;
+  KIter it;
+
+  pthread_barrier_wait( job->start );
+  init_kmer_iter( &it, job->seq, VERIFY_SEQ_LEN, job->ks->k );
+  while( next_canonical_kmer( &it, &pk, &pos ) ) {
+    increment_or_insert_pkmer_mt( pk, job->ks, job->tid );
+  }
+  return NULL;
+}
+
+/* Has threads threads each add every kmer of seq to ks at once,
+   with increment_or_insert_pkmer_mt */
+static void count_seq_threads( KSP ks, const char* seq, int threads ) {
+  VerifyJob jobs[VERIFY_THREADS];
+  pthread_t tids[VERIFY_THREADS];
+  pthread_barrier_t start;
+  int t;
+
+  pthread_barrier_init( &start, NULL, threads );
+  for( t = 0; t < threads; t++ ) {
+    jobs[t].seq = seq;
+    jobs[t].ks = ks;
+    jobs[t].tid = t;
+    jobs[t].start = &start;
+    pthread_create( &tids[t], NULL, count_seq_job, &jobs[t] );
+  }
+  for( t = 0; t < threads; t++ ) {
+    pthread_join( tids[t], NULL );
+  }
+  pthread_barrier_destroy( &start );
+}
+
+/* verify_mt
+   Args: size_t k - kmer length
+   Has VERIFY_THREADS threads count the verify sequence at the same
+   time, every one of them all of it, in the tree (no locks), the
+   compressed tree and the hash table (a lock each), and the dense
+   array if 4^k counters fit. Every count has to be VERIFY_THREADS
+   times what one thread gets: none lost to a race. (With one core
+   the threads mostly take turns, so races are much more likely to
+   show up on more.)
+   Returns: number of checks that failed
+*/
+int verify_mt( size_t k ) {
+  const char* names[] = { "tree _mt", "compressed _mt", "hash _mt",
+			  "dense _mt" };
+  KSPOpts opts;
+  KCounts kc;
+  KSP ks;
+  char* seq;
+  size_t* want;
+  size_t i;
+  int b, fails = 0;
+
+  seq = verify_input( k, &kc );
+  want = (size_t*)malloc(sizeof(size_t) * (kc.n + 1));
+  for( i = 0; i < kc.n; i++ ) {
+    want[i] = VERIFY_THREADS * kc.counts[i];
+  }
+  for( b = 0; b < 4; b++ ) {
+    set_default_KSPOpts( &opts );
+    opts.count_bits = 8;
+    opts.threads = VERIFY_THREADS;
+    if ( b < 3 ) {
+      opts.dense_bytes = 0;
+    }
+    if ( b == 1 ) {
+      opts.compress = 1;
+    }
+    if ( b == 2 ) {
+      opts.backend = KSP_HASH;
+      opts.expected = 16;
+    }
+    ks = init_KSP_opts( k, &opts );
+    if ( (b == 3) && (ks->backend != KSP_DENSE) ) {
+      free_KSP( ks ); // too big for a dense array
+      break;
+    }
+    count_seq_threads( ks, seq, VERIFY_THREADS );
+    fails += check_counts( ks, &kc, want, names[b], "counted" ) > 0;
+    free_KSP( ks );
+  }
+  free( want );
+  free_kcounts( &kc );
+  free( seq );
+  return fails;
+}
+
+/* verify_scatter
+   Args: size_t k - kmer length
+   Builds the tree, the compressed tree, and (if 4^k counters fit)
+   the dense array with a KScatter of VERIFY_THREADS threads, with
+   buckets small enough to be flushed many times, and checks the
+   counts are what one thread gets.
+   Returns: number of checks that failed
+*/
+int verify_scatter( size_t k ) {
+  const char* names[] = { "tree scatter", "compressed scatter",
+			  "dense scatter" };
+  KSPOpts opts;
+  KScatterP sc;
+  KCounts kc;
+  KSP ks;
+  KIter it;
+  char* seq;
+  size_t pos;
+  pkmer pk;
+  int b, fails = 0;
+
+  seq = verify_input( k, &kc );
+  for( b = 0; b < 3; b++ ) {
+    set_default_KSPOpts( &opts );
+    opts.count_bits = 8;
+    opts.threads = VERIFY_THREADS;
+    if ( b < 2 ) {
+      opts.dense_bytes = 0;
+    }
+    if ( b == 1 ) {
+      opts.compress = 1;
+    }
+    ks = init_KSP_opts( k, &opts );
+    if ( (b == 2) && (ks->backend != KSP_DENSE) ) {
+      free_KSP( ks ); // too big for a dense array
+      break;
+    }
+    sc = init_kscatter( ks, VERIFY_THREADS, VERIFY_SCATTER_CAP );
+    if ( sc->threads != VERIFY_THREADS ) {
+      printf( "FAIL %s: built in %d threads, not %d\n",
+	      names[b], sc->threads, VERIFY_THREADS );
+      fails++;
+    }
+    init_kmer_iter( &it, seq, VERIFY_SEQ_LEN, k );
+    while( next_canonical_kmer( &it, &pk, &pos ) ) {
+      kscatter_add( sc, pk );
+    }
+    kscatter_flush( sc );
+    free_kscatter( sc );
+    fails += check_counts( ks, &kc, kc.counts, names[b], "counted" ) > 0;
+    free_KSP( ks );
+  }
+  free_kcounts( &kc );
+  free( seq );
+  return fails;
+}
+
+/* verify_disk
+   Args: size_t k - kmer length
+   Spills the verify sequence to VERIFY_BUCKETS bucket files and
+   checks that every kmer is counted in just one bucket, with its
+   whole count; that disk_count_hist (with the buckets built in
+   VERIFY_THREADS threads) is the histogram of the counts; and that
+   disk_repeated_kmers has all the kmers seen more than once and no
+   others.
+   Returns: number of checks that failed
+*/
+int verify_disk( size_t k ) {
+  KSPOpts opts;
+  KBucketsP kb;
+  KCounts kc;
+  KSP ks;
+  ChrP chr;
+  char* seq;
+  size_t* got;
+  int* in;
+  size_t* want;
+  size_t* hist;
+  size_t i, spilled = 0, total = 0, hist_len = 2, bad = 0;
+  int b, fails = 0;
+
+  seq = verify_input( k, &kc );
+  chr = newSeq();
+  memcpy( chr->seq, seq, VERIFY_SEQ_LEN );
+  chr->seq[VERIFY_SEQ_LEN] = '\0';
+  chr->len = VERIFY_SEQ_LEN;
+  kb = init_kbuckets( k, VERIFY_BUCKETS );
+  spill_seq_kmers( kb, chr );
+  for( b = 0; b < kb->n; b++ ) {
+    spilled += kb->n_kmers[b];
+  }
+  for( i = 0; i < kc.n; i++ ) {
+    total += kc.counts[i];
+    if ( kc.counts[i] >= hist_len ) {
+      hist_len = kc.counts[i] + 1;
+    }
+  }
+  if ( spilled != total ) {
+    printf( "FAIL disk: spilled %lu kmers, not %lu\n", spilled, total );
+    fails++;
+  }
+
+  set_default_KSPOpts( &opts );
+  opts.count_bits = 8;
+  opts.dense_bytes = 0;
+  got = (size_t*)calloc( kc.n + 1, sizeof(size_t) );
+  in = (int*)calloc( kc.n + 1, sizeof(int) );
+  for( b = 0; b < kb->n; b++ ) {
+    ks = count_kbucket( kb, b, &opts );
+    for( i = 0; i < kc.n; i++ ) {
+      if ( get_pkmer_count( kc.kmers[i], ks ) > 0 ) {
+	got[i] += get_pkmer_count( kc.kmers[i], ks );
+	in[i]++;
+      }
+    }
+    free_KSP( ks );
+  }
+  for( i = 0; i < kc.n; i++ ) {
+    bad += (got[i] != kc.counts[i]) || (in[i] != 1);
+  }
+  if ( bad > 0 ) {
+    printf( "FAIL disk buckets: %lu kmers not in just one bucket with their whole count\n",
+	    bad );
+    fails++;
+  }
+  else {
+    printf( "PASS disk buckets (%lu kmers)\n", kc.n );
+  }
+
+  /* Every kmer seen i times is in hist[i] */
+  want = (size_t*)calloc( hist_len, sizeof(size_t) );
+  hist = (size_t*)malloc(sizeof(size_t) * hist_len);
+  for( i = 0; i < kc.n; i++ ) {
+    want[ kc.counts[i] ]++;
+  }
+  opts.threads = VERIFY_THREADS;
+  disk_count_hist( kb, &opts, hist, hist_len );
+  bad = 0;
+  for( i = 1; i < hist_len; i++ ) {
+    bad += hist[i] != want[i];
+  }
+  if ( bad > 0 ) {
+    printf( "FAIL disk histogram: %lu counts off\n", bad );
+    fails++;
+  }
+  else {
+    printf( "PASS disk histogram\n" );
+  }
+  free( want );
+  free( hist );
+
+  opts.threads = 1;
+  ks = disk_repeated_kmers( kb, &opts );
+  want = (size_t*)malloc(sizeof(size_t) * (kc.n + 1));
+  for( i = 0; i < kc.n; i++ ) {
+    want[i] = (kc.counts[i] > 1) ? kc.counts[i] : 0;
+  }
+  fails += check_counts( ks, &kc, want, "disk repeats", "counted" ) > 0;
+  free_KSP( ks );
+
+  free( want );
+  free( got );
+  free( in );
+  free_kbuckets( kb );
+  free( chr );
+  free_kcounts( &kc );
+  free( seq );
+  return fails;
+}
+
+/* verify_sketch
+   Args: size_t k - kmer length
+   Counts the verify sequence in a count-min sketch of only
+   VERIFY_SKETCH_BYTES, so that many kmers share counters, and
+   checks that no estimate is too low and that no more of them than
+   kcms_confidence allows are too high by more than
+   kcms_error_bound. A counter that's full (for the few kmers of a
+   tiny k) only says the count is at least that.
+   Returns: number of checks that failed
+*/
+int verify_sketch( size_t k ) {
+  KSPOpts opts;
+  KCounts kc;
+  KSP ks;
+  char* seq;
+  size_t i, est, bound, top, low = 0, high = 0, past_bound = 0;
+  double allowed;
+  int fails = 0;
+
+  seq = verify_input( k, &kc );
+  set_default_KSPOpts( &opts );
+  opts.backend = KSP_SKETCH;
+  opts.sketch_bytes = VERIFY_SKETCH_BYTES;
+  ks = init_KSP_opts( k, &opts );
+  add_seq_kmers( seq, VERIFY_SEQ_LEN, ks );
+
+  bound = kcms_error_bound( ks->cms );
+  top = ((size_t)1 << ks->cms->count_bits) - 1; // stuck there: at least that
+  for( i = 0; i < kc.n; i++ ) {
+    est = get_pkmer_count( kc.kmers[i], ks );
+    if ( (est < kc.counts[i]) && (est < top) ) {
+      low++;
+    }
+    else if ( est > kc.counts[i] ) {
+      high++;
+      past_bound += (est - kc.counts[i]) > bound;
+    }
+  }
+  allowed = (1.0 - kcms_confidence( ks->cms )) * kc.n;
+  if ( (low > 0) || (past_bound > allowed) ) {
+    printf( "FAIL sketch: %lu estimates too low, %lu more than %lu too high (%.0f allowed)\n",
+	    low, past_bound, bound, allowed );
+    fails++;
+  }
+  else {
+    printf( "PASS sketch (%lu kmers, %lu too high, %lu by more than %lu)\n",
+	    kc.n, high, past_bound, bound );
+  }
+  free_KSP( ks );
+  free_kcounts( &kc );
+  free( seq );
+  return fails;
+}
+
+/* Checks the bloom filter of ks let in n_new distinct kmers and
+   promoted n_promoted of them to the KSP.
+   Returns: TRUE if it's off */
+static int check_bloom( KSP ks, size_t n_new, size_t n_promoted,
+			const char* name ) {
+  if ( (ks->bloom_new != n_new) || (ks->bloom_promoted != n_promoted) ) {
+    printf( "FAIL %s: bloom filter saw %lu new kmers and promoted %lu, not %lu and %lu\n",
+	    name, ks->bloom_new, ks->bloom_promoted, n_new, n_promoted );
+    return 1;
+  }
+  printf( "PASS %s bloom accounting\n", name );
+  return 0;
+}
+
+/* verify_bloom
+   Args: size_t k - kmer length
+   Counts the verify sequence in the tree and the hash table with a
+   bloom filter big enough to have no false positives, so every
+   count has to be exact (kmers seen once from the filter alone),
+   every kmer has to be new to the filter once, and just the ones
+   seen more than once promoted. Then VERIFY_THREADS threads count
+   it at once, each all of it, in a tree with a filter: every kmer
+   has to be new exactly once and promoted exactly once, however
+   the threads meet.
+   Returns: number of checks that failed
+*/
+int verify_bloom( size_t k ) {
+  const char* names[] = { "tree bloom", "hash bloom" };
+  KSPOpts opts;
+  KCounts kc;
+  KSP ks;
+  char* seq;
+  size_t* want;
+  size_t i, n_repeats = 0;
+  int b, fails = 0;
+
+  seq = verify_input( k, &kc );
+  for( i = 0; i < kc.n; i++ ) {
+    n_repeats += kc.counts[i] > 1;
+  }
+  for( b = 0; b < 2; b++ ) {
+    set_default_KSPOpts( &opts );
+    opts.count_bits = 8;
+    opts.dense_bytes = 0;
+    opts.bloom_bytes = VERIFY_BLOOM_BYTES;
+    if ( b == 1 ) {
+      opts.backend = KSP_HASH;
+    }
+    ks = init_KSP_opts( k, &opts );
+    add_seq_kmers( seq, VERIFY_SEQ_LEN, ks );
+    fails += check_counts( ks, &kc, kc.counts, names[b], "counted" ) > 0;
+    fails += check_bloom( ks, kc.n, n_repeats, names[b] );
+    free_KSP( ks );
+  }
+
+  want = (size_t*)malloc(sizeof(size_t) * (kc.n + 1));
+  for( i = 0; i < kc.n; i++ ) {
+    want[i] = VERIFY_THREADS * kc.counts[i];
+  }
+  set_default_KSPOpts( &opts );
+  opts.count_bits = 8;
+  opts.dense_bytes = 0;
+  opts.bloom_bytes = VERIFY_BLOOM_BYTES;
+  opts.threads = VERIFY_THREADS;
+  ks = init_KSP_opts( k, &opts );
+  count_seq_threads( ks, seq, VERIFY_THREADS );
+  fails += check_counts( ks, &kc, want, "tree bloom _mt", "counted" ) > 0;
+  fails += check_bloom( ks, kc.n, kc.n, "tree bloom _mt" );
+  free_KSP( ks );
+
+  free( want );
+  free_kcounts( &kc );
+  free( seq );
+  return fails;
+}
+
+/* Checks that db has the count in want for every kmer of kc (0 =>
+   not there), with kdb_get and with kdb_get_batch, and that
+   kdb_hist agrees.
+   Returns: TRUE if anything is off */
+static int check_db( KDBP db, const KCounts* kc, const size_t* want,
+		     const char* name ) {
+  size_t* got;
+  size_t* hist;
+  size_t* want_hist;
+  size_t i, hist_len = 2, bad_get = 0, bad_batch = 0, bad_hist = 0;
+
+  got = (size_t*)malloc(sizeof(size_t) * (kc->n + 1));
+  kdb_get_batch( db, kc->kmers, kc->n, got );
+  for( i = 0; i < kc->n; i++ ) {
+    bad_get += kdb_get( db, kc->kmers[i] ) != want[i];
+    bad_batch += got[i] != want[i];
+    if ( want[i] >= hist_len ) {
+      hist_len = want[i] + 1;
+    }
+  }
+  hist = (size_t*)malloc(sizeof(size_t) * hist_len);
+  want_hist = (size_t*)calloc( hist_len, sizeof(size_t) );
+  for( i = 0; i < kc->n; i++ ) {
+    if ( want[i] > 0 ) {
+      want_hist[ want[i] ]++;
+    }
+  }
+  kdb_hist( db, hist, hist_len );
+  for( i = 1; i < hist_len; i++ ) {
+    bad_hist += hist[i] != want_hist[i];
+  }
+  free( got );
+  free( hist );
+  free( want_hist );
+  if ( (bad_get > 0) || (bad_batch > 0) || (bad_hist > 0) ) {
+    printf( "FAIL %s: %lu kdb_get and %lu kdb_get_batch counts off, %lu histogram counts off\n",
+	    name, bad_get, bad_batch, bad_hist );
+    return 1;
+  }
+  printf( "PASS %s (%lu kmers)\n", name, db->hdr->n_kmers );
+  return 0;
+}
+
+/* Makes an empty temp file.
+   Returns: its name, to be freed */
+static char* make_temp_file( void ) {
+  char* fn;
+  int fd;
+
+  fn = strdup( VERIFY_TEMP_TEMPLATE );
+  fd = mkstemp( fn );
+  if ( fd < 0 ) {
+    fprintf( stderr, "ERROR: Can't make temp file %s\n", fn );
+    exit( 1 );
+  }
+  close( fd );
+  return fn;
+}
+
+/* verify_db
+   Args: size_t k - kmer length
+   Counts the verify sequence in the tree and the hash table (whose
+   kmers write_kmer_db has to sort), prunes the kmers seen once, and
+   writes a database, which has to have every repeated kmer with its
+   count and nothing for the others. The same file cut one byte
+   short has to be turned down by open_kmer_db.
+   Returns: number of checks that failed
+*/
+int verify_db( size_t k ) {
+  const char* names[] = { "tree db", "hash db" };
+  KSPOpts opts;
+  KCounts kc;
+  KSP ks;
+  KDBP db;
+  char* seq;
+  char* fn;
+  size_t* want;
+  size_t i;
+  uint64_t file_len;
+  int b, fails = 0;
+
+  seq = verify_input( k, &kc );
+  want = (size_t*)malloc(sizeof(size_t) * (kc.n + 1));
+  for( i = 0; i < kc.n; i++ ) {
+    want[i] = (kc.counts[i] > 1) ? kc.counts[i] : 0;
+  }
+  fn = make_temp_file();
+  for( b = 0; b < 2; b++ ) {
+    set_default_KSPOpts( &opts );
+    opts.count_bits = 8;
+    opts.dense_bytes = 0;
+    if ( b == 1 ) {
+      opts.backend = KSP_HASH;
+    }
+    ks = init_KSP_opts( k, &opts );
+    add_seq_kmers( seq, VERIFY_SEQ_LEN, ks );
+    ksp_prune( ks, 2, SIZE_MAX );
+    if ( write_kmer_db( ks, fn, 0 ) != 0 ) {
+      printf( "FAIL %s: couldn't write %s\n", names[b], fn );
+      fails++;
+      free_KSP( ks );
+      continue;
+    }
+    free_KSP( ks );
+    db = open_kmer_db( fn );
+    if ( db == NULL ) {
+      printf( "FAIL %s: couldn't open %s\n", names[b], fn );
+      fails++;
+      continue;
+    }
+    fails += check_db( db, &kc, want, names[b] );
+    file_len = db->hdr->file_len;
+    close_kmer_db( db );
+
+    if ( truncate( fn, file_len - 1 ) != 0 ) {
+      fprintf( stderr, "ERROR: Can't truncate %s\n", fn );
+      exit( 1 );
+    }
+    db = open_kmer_db( fn );
+    if ( db != NULL ) {
+      printf( "FAIL %s: opened a file cut short\n", names[b] );
+      close_kmer_db( db );
+      fails++;
+    }
+    else {
+      printf( "PASS %s cut short\n", names[b] );
+    }
+  }
+  unlink( fn );
+  free( fn );
+  free( want );
+  free_kcounts( &kc );
+  free( seq );
+  return fails;
+}
+
+/* verify_merge
+   Args: size_t k - kmer length
+   Writes a database for each half of the verify sequence (the
+   halves overlap by k - 1, so every kmer is in one or both) and
+   merges them with next_kdb_merged, which has to give every kmer
+   of the whole sequence once, in order, with its whole count and
+   with the halves that have it. The merge written out with a
+   KDBWriter has to read back as the counts of the whole sequence.
+   Returns: number of checks that failed
+*/
+int verify_merge( size_t k ) {
+  KSPOpts opts;
+  KCounts kc;
+  KSP ks;
+  KDBP dbs[2];
+  KDBP db;
+  KDBMergeP m;
+  KDBWriterP w;
+  char* seq;
+  char* fns[2];
+  char* fn;
+  size_t mid = VERIFY_SEQ_LEN / 2;
+  size_t i = 0, count, bad = 0;
+  uint64_t presence, want_presence;
+  pkmer kmer;
+  int h, fails = 0;
+
+  seq = verify_input( k, &kc );
+  set_default_KSPOpts( &opts );
+  opts.count_bits = 8;
+  opts.dense_bytes = 0;
+  for( h = 0; h < 2; h++ ) {
+    ks = init_KSP_opts( k, &opts );
+    if ( h == 0 ) {
+      add_seq_kmers( seq, mid + k - 1, ks );
+    }
+    else {
+      add_seq_kmers( seq + mid, VERIFY_SEQ_LEN - mid, ks );
+    }
+    fns[h] = make_temp_file();
+    if ( write_kmer_db( ks, fns[h], 0 ) != 0 ) {
+      fprintf( stderr, "ERROR: Can't write %s\n", fns[h] );
+      exit( 1 );
+    }
+    free_KSP( ks );
+    dbs[h] = open_kmer_db( fns[h] );
+    if ( dbs[h] == NULL ) {
+      fprintf( stderr, "ERROR: Can't open %s\n", fns[h] );
+      exit( 1 );
+    }
+  }
+
+  m = init_kdb_merge( dbs, 2 );
+  while( next_kdb_merged( m, &kmer, &count, &presence ) ) {
+    want_presence = (kdb_get( dbs[0], kmer ) > 0) |
+      ((kdb_get( dbs[1], kmer ) > 0) << 1);
+    if ( (i >= kc.n) || (kc.kmers[i] != kmer) || (kc.counts[i] != count) ||
+	 (presence != want_presence) ) {
+      bad++;
+    }
+    i++;
+  }
+  free_kdb_merge( m );
+  if ( (bad > 0) || (i != kc.n) ) {
+    printf( "FAIL merge: %lu of %lu merged kmers off, not %lu kmers\n",
+	    bad, i, kc.n );
+    fails++;
+  }
+  else {
+    printf( "PASS merge (%lu kmers)\n", i );
+  }
+
+  fn = make_temp_file();
+  w = init_kdb_writer( fn, k, kc.n, 0 );
+  if ( w == NULL ) {
+    fprintf( stderr, "ERROR: Can't write %s\n", fn );
+    exit( 1 );
+  }
+  m = init_kdb_merge( dbs, 2 );
+  while( next_kdb_merged( m, &kmer, &count, NULL ) ) {
+    kdb_writer_add( w, kmer, count );
+  }
+  free_kdb_merge( m );
+  if ( (finish_kdb_writer( w ) != 0) || ((db = open_kmer_db( fn )) == NULL) ) {
+    printf( "FAIL merged db: couldn't write or open %s\n", fn );
+    fails++;
+  }
+  else {
+    fails += check_db( db, &kc, kc.counts, "merged db" );
+    close_kmer_db( db );
+  }
+  unlink( fn );
+  free( fn );
+
+  for( h = 0; h < 2; h++ ) {
+    close_kmer_db( dbs[h] );
+    unlink( fns[h] );
+    free( fns[h] );
+  }
+  free_kcounts( &kc );
+  free( seq );
+  return fails;
+}
+
+/* The verify sequence as a fasta file, and where each record of it
+   is in the sequence */
+typedef struct verify_fasta {
+  char* text;
+  size_t len;
+  size_t starts[VERIFY_MAX_RECORDS + 1]; // record r is starts[r] up to starts[r+1]
+  int n_records;
+} VerifyFasta;
+
+/* Writes seq into vf->text as a fasta file that's as awkward to read
+   as it can be and still mean seq: records end after an N (so no
+   kmer is lost between them), the headers have descriptions, the
+   lines are 1 to 120 bases with some in lower case, some records
+   have CRLF line ends, and there are blank lines, spaces and tabs
+   in the lines, and no line end at the very end */
+static void make_verify_fasta( const char* seq, size_t len, VerifyFasta* vf ) {
+  size_t i, end, w;
+  int crlf;
+
+  vf->text = (char*)malloc(sizeof(char) * (4 * len + 64 * VERIFY_MAX_RECORDS));
+  vf->len = 0;
+  vf->n_records = 0;
+  i = 0;
+  while( i < len ) {
+    /* The record goes up to and takes in an N, now and then */
+    for( end = i; end < len; end++ ) {
+      if ( (toupper( seq[end] ) == 'N') && (rand()%3 == 0) &&
+	   (vf->n_records + 1 < VERIFY_MAX_RECORDS) ) {
+	end++;
+	break;
+      }
+    }
+    vf->starts[vf->n_records] = i;
+    crlf = rand()%4 == 0;
+    vf->len += sprintf( &vf->text[vf->len], ">rec%d%sdescription %d%s",
+			vf->n_records, (rand()%2) ? " " : "\t",
+			rand(), crlf ? "\r\n" : "\n" );
+    vf->n_records++;
+    while( i < end ) {
+      for( w = 1 + rand()%120; (w > 0) && (i < end); w--, i++ ) {
+	vf->text[vf->len++] = (rand()%10 == 0) ? tolower( seq[i] ) : seq[i];
+	if ( rand()%50 == 0 ) {
+	  vf->text[vf->len++] = (rand()%2) ? ' ' : '\t';
+	}
+      }
+      if ( (i == len) && (rand()%2 == 0) ) {
+	break;
+      }
+      if ( rand()%20 == 0 ) {
+	vf->text[vf->len++] = ' ';
+      }
+      if ( crlf ) {
+	vf->text[vf->len++] = '\r';
+      }
+      vf->text[vf->len++] = '\n';
+      if ( rand()%20 == 0 ) {
+	vf->text[vf->len++] = '\n';
+      }
+    }
+  }
+  vf->starts[vf->n_records] = len;
+}
+
+/* Writes vf to a new temp file, gzipped if gz.
+   Returns: its name, to be freed */
+static char* write_verify_fasta( const VerifyFasta* vf, int gz ) {
+  char* fn;
+  FILE* fp;
+  gzFile gzfp;
+
+  fn = make_temp_file();
+  if ( gz ) {
+    gzfp = gzopen( fn, "w" );
+    if ( (gzfp == NULL) || (gzwrite( gzfp, vf->text, vf->len ) != vf->len) ) {
+      fprintf( stderr, "ERROR: Can't write %s\n", fn );
+      exit( 1 );
+    }
+    gzclose( gzfp );
+  }
+  else {
+    fp = fileOpen( fn, "w" );
+    if ( (fp == NULL) || (fwrite( vf->text, 1, vf->len, fp ) != vf->len) ) {
+      fprintf( stderr, "ERROR: Can't write %s\n", fn );
+      exit( 1 );
+    }
+    fclose( fp );
+  }
+  return fn;
+}
+
+/* Checks that record r read back as id with bases (line ends and
+   all taken out, upper case) of seq.
+   Returns: TRUE if it's off */
+static int check_record( const VerifyFasta* vf, const char* seq, int r,
+			 const char* id, size_t id_len,
+			 const char* bases, size_t len ) {
+  char want_id[32];
+  size_t i, n;
+
+  if ( r >= vf->n_records ) {
+    return 1;
+  }
+  sprintf( want_id, "rec%d", r );
+  n = vf->starts[r+1] - vf->starts[r];
+  if ( (id_len != strlen( want_id )) || (strncmp( id, want_id, id_len ) != 0) ||
+       (len != n) ) {
+    return 1;
+  }
+  for( i = 0; i < n; i++ ) {
+    if ( bases[i] != toupper( seq[ vf->starts[r] + i ] ) ) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* verify_parse
+   Args: size_t k - kmer length
+   Writes the verify sequence as an awkward fasta file
+   (make_verify_fasta), plain and gzipped, reads it back with
+   read_next_fasta and gz_read_next_fasta, and checks every record's
+   id and bases, and every kmer's count.
+   Returns: number of checks that failed
+*/
+int verify_parse( size_t k ) {
+  const char* names[] = { "fasta", "gzipped fasta" };
+  VerifyFasta* vf;
+  KSPOpts opts;
+  KCounts kc;
+  KSP ks;
+  ChrP chr;
+  FILE* fp = NULL;
+  gzFile gzfp = NULL;
+  char* seq;
+  char* fn;
+  int gz, r, bad, fails = 0;
+
+  seq = verify_input( k, &kc );
+  vf = (VerifyFasta*)malloc(sizeof(VerifyFasta));
+  make_verify_fasta( seq, VERIFY_SEQ_LEN, vf );
+  chr = newSeq();
+  set_default_KSPOpts( &opts );
+  opts.count_bits = 8;
+  opts.dense_bytes = 0;
+  for( gz = 0; gz < 2; gz++ ) {
+    fn = write_verify_fasta( vf, gz );
+    if ( gz ) {
+      gzfp = gzopen( fn, "r" );
+    }
+    else {
+      fp = fileOpen( fn, "r" );
+    }
+    if ( (fp == NULL) && (gzfp == NULL) ) {
+      exit( 1 );
+    }
+    ks = init_KSP_opts( k, &opts );
+    r = 0;
+    bad = 0;
+    while( (gz ? gz_read_next_fasta( gzfp, chr ) :
+	    read_next_fasta( fp, chr )) == 0 ) {
+      bad += check_record( vf, seq, r, chr->id, strlen( chr->id ),
+			   chr->seq, chr->len );
+      add_seq_kmers( chr->seq, chr->len, ks );
+      r++;
+    }
+    if ( (bad > 0) || (r != vf->n_records) ) {
+      printf( "FAIL %s: %d of %d records read back wrong, not %d records\n",
+	      names[gz], bad, r, vf->n_records );
+      fails++;
+    }
+    else {
+      printf( "PASS %s (%d records)\n", names[gz], r );
+    }
+    fails += check_counts( ks, &kc, kc.counts, names[gz], "read" ) > 0;
+    free_KSP( ks );
+    if ( gz ) {
+      gzclose( gzfp );
+    }
+    else {
+      fclose( fp );
+    }
+    unlink( fn );
+    free( fn );
+  }
+  free( chr );
+  free( vf->text );
+  free( vf );
+  free_kcounts( &kc );
+  free( seq );
+  return fails;
+}
+
+/* verify_map
+   Args: size_t k - kmer length
+   Writes the verify sequence as an awkward fasta file
+   (make_verify_fasta) and maps it with open_fasta_map: every
+   next_fasta_view has to have the record's id, and its bases once
+   the whitespace is out, and the kmers of the views as they are
+   (line ends and all) have to be the kmers of the sequence. So do
+   the ones count_fasta_kmers finds, mapping the file itself. An
+   empty file has no records.
+   Returns: number of checks that failed
+*/
+int verify_map( size_t k ) {
+  VerifyFasta* vf;
+  KSPOpts opts;
+  KCounts kc;
+  KSP ks;
+  FastaMap fm;
+  FastaView fv;
+  char* seq;
+  char* fn;
+  char* bases;
+  size_t i, n;
+  int r = 0, bad = 0, fails = 0;
+
+  seq = verify_input( k, &kc );
+  vf = (VerifyFasta*)malloc(sizeof(VerifyFasta));
+  make_verify_fasta( seq, VERIFY_SEQ_LEN, vf );
+  fn = write_verify_fasta( vf, 0 );
+  set_default_KSPOpts( &opts );
+  opts.count_bits = 8;
+  opts.dense_bytes = 0;
+
+  if ( open_fasta_map( &fm, fn ) != 0 ) {
+    fprintf( stderr, "ERROR: Can't map %s\n", fn );
+    exit( 1 );
+  }
+  ks = init_KSP_opts( k, &opts );
+  bases = (char*)malloc(sizeof(char) * (vf->len + 1));
+  while( next_fasta_view( &fm, &fv ) == 0 ) {
+    for( i = 0, n = 0; i < fv.seq_len; i++ ) {
+      if ( !isspace( (unsigned char)fv.seq[i] ) ) {
+	bases[n++] = toupper( fv.seq[i] );
+      }
+    }
+    bad += check_record( vf, seq, r, fv.id, fv.id_len, bases, n );
+    add_seq_kmers( fv.seq, fv.seq_len, ks );
+    r++;
+  }
+  close_fasta_map( &fm );
+  if ( (bad > 0) || (r != vf->n_records) ) {
+    printf( "FAIL mapped fasta: %d of %d records read back wrong, not %d records\n",
+	    bad, r, vf->n_records );
+    fails++;
+  }
+  else {
+    printf( "PASS mapped fasta (%d records)\n", r );
+  }
+  fails += check_counts( ks, &kc, kc.counts, "mapped fasta", "read" ) > 0;
+  free_KSP( ks );
+  free( bases );
+
+  ks = init_KSP_opts( k, &opts );
+  if ( count_fasta_kmers( fn, ks, 1, COUNT_SHARED ) != vf->n_records ) {
+    printf( "FAIL count_fasta_kmers: didn't read %d records\n",
+	    vf->n_records );
+    fails++;
+  }
+  fails += check_counts( ks, &kc, kc.counts, "count_fasta_kmers", "read" ) > 0;
+  free_KSP( ks );
+
+  /* Nothing at all */
+  if ( truncate( fn, 0 ) != 0 ) {
+    fprintf( stderr, "ERROR: Can't truncate %s\n", fn );
+    exit( 1 );
+  }
+  if ( open_fasta_map( &fm, fn ) != 0 ) {
+    printf( "FAIL mapped empty fasta: couldn't map it\n" );
+    fails++;
+  }
+  else {
+    if ( next_fasta_view( &fm, &fv ) == 0 ) {
+      printf( "FAIL mapped empty fasta: had a record\n" );
+      fails++;
+    }
+    else {
+      printf( "PASS mapped empty fasta\n" );
+    }
+    close_fasta_map( &fm );
+  }
+
+  unlink( fn );
+  free( fn );
+  free( vf->text );
+  free( vf );
+  free_kcounts( &kc );
+  free( seq );
+  return fails;
+}
+
+/* verify_blocks
+   Args: size_t k - kmer length
+   Checks that next_canonical_kmers hands out the same kmers as
+   next_canonical_kmer, in blocks of an odd size, and that counting
+   the verify sequence a block at a time, with add_kmers_from_seq and
+   add_kmers_from_seq_mt, gets the right counts in the tree, the
+   hash table, and the tree with a bloom filter.
+   Returns: number of checks that failed
+*/
+int verify_blocks( size_t k ) {
+  const char* names[] = { "tree blocks", "hash blocks", "tree bloom blocks" };
+  KSPOpts opts;
+  KCounts kc;
+  KSP ks;
+  KIter it, it_block;
+  char* seq;
+  size_t i, n, pos, bad = 0, total = 0;
+  pkmer block[7];
+  pkmer pk;
+  int b, fails = 0;
+
+  seq = verify_input( k, &kc );
+  init_kmer_iter( &it, seq, VERIFY_SEQ_LEN, k );
+  init_kmer_iter( &it_block, seq, VERIFY_SEQ_LEN, k );
+  while( (n = next_canonical_kmers( &it_block, block, 7 )) > 0 ) {
+    for( i = 0; i < n; i++ ) {
+      bad += !next_canonical_kmer( &it, &pk, &pos ) || (pk != block[i]);
+    }
+    total += n;
+  }
+  bad += next_canonical_kmer( &it, &pk, &pos );
+  if ( bad > 0 ) {
+    printf( "FAIL kmer blocks: %lu of %lu kmers off\n", bad, total );
+    fails++;
+  }
+  else {
+    printf( "PASS kmer blocks (%lu kmers)\n", total );
+  }
+
+  for( b = 0; b < 3; b++ ) {
+    set_default_KSPOpts( &opts );
+    opts.count_bits = 8;
+    opts.dense_bytes = 0;
+    if ( b == 1 ) {
+      opts.backend = KSP_HASH;
+    }
+    if ( b == 2 ) {
+      opts.bloom_bytes = VERIFY_BLOOM_BYTES;
+    }
+    ks = init_KSP_opts( k, &opts );
+    add_kmers_from_seq( seq, VERIFY_SEQ_LEN / 2, ks );
+    add_kmers_from_seq_mt( seq + VERIFY_SEQ_LEN / 2 - (k - 1),
+			   VERIFY_SEQ_LEN / 2 + (k - 1), ks, 0 );
+    fails += check_counts( ks, &kc, kc.counts, names[b], "counted" ) > 0;
+    free_KSP( ks );
+  }
+  free_kcounts( &kc );
+  free( seq );
+  return fails;
+}
+
+/* What list_kmer gathers */
+typedef struct kmer_list {
+  pkmer* kmers;
+  size_t* counts;
+  size_t n;
+  size_t max;
+} KList;
+
+static void list_kmer( pkmer kmer, size_t count, void* arg ) {
+  KList* kl = (KList*)arg;
+  if ( kl->n < kl->max ) {
+    kl->kmers[kl->n] = kmer;
+    kl->counts[kl->n] = count;
+  }
+  kl->n++;
+}
+
+/* verify_simd
+   Args: size_t k - kmer length
+   Counts the verify sequence in a KSP_DENSE with 8-bit counters (at
+   VERIFY_DENSE_K if k is too big for one) and lists it with
+   ksp_foreach using the kernels of every SIMD level up to the best
+   this CPU has. Each has to give exactly the sorted kmers and their
+   counts, overflow table and all.
+   Returns: number of checks that failed
+*/
+int verify_simd( size_t k ) {
+  KSPOpts opts;
+  KCounts kc;
+  KList kl;
+  KSP ks;
+  char* seq;
+  size_t i, bad;
+  int level, best, fails = 0;
+
+  if ( (2 * k >= sizeof(size_t) * CHAR_BIT) ||
+       (((size_t)1 << (2 * k)) > DENSE_MAX_BYTES) ) {
+    k = VERIFY_DENSE_K;
+  }
+  seq = verify_input( k, &kc );
+  set_default_KSPOpts( &opts );
+  opts.count_bits = 8;
+  ks = init_KSP_opts( k, &opts );
+  add_seq_kmers( seq, VERIFY_SEQ_LEN, ks );
+  kl.max = kc.n;
+  kl.kmers = (pkmer*)malloc(sizeof(pkmer) * (kc.n + 1));
+  kl.counts = (size_t*)malloc(sizeof(size_t) * (kc.n + 1));
+
+  best = simd_level();
+  for( level = SIMD_SCALAR; level <= best; level++ ) {
+    set_simd_level( level );
+    kl.n = 0;
+    ksp_foreach( ks, list_kmer, &kl );
+    bad = 0;
+    for( i = 0; (i < kl.n) && (i < kc.n); i++ ) {
+      bad += (kl.kmers[i] != kc.kmers[i]) || (kl.counts[i] != kc.counts[i]);
+    }
+    if ( (bad > 0) || (kl.n != kc.n) ) {
+      printf( "FAIL dense %s: %lu of %lu kmers off, not %lu kmers\n",
+	      simd_level_name( level ), bad, kl.n, kc.n );
+      fails++;
+    }
+    else {
+      printf( "PASS dense %s (%lu kmers)\n", simd_level_name( level ), kl.n );
+    }
+  }
+  set_simd_level( best );
+  free( kl.kmers );
+  free( kl.counts );
+  free_KSP( ks );
+  free_kcounts( &kc );
+  free( seq );
+  return fails;
+}